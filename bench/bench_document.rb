@@ -0,0 +1,21 @@
+# Creating documents of different sizes
+include SVMLight
+
+random = Random.new(Bench::SEED)
+
+[10, 100, 1000, 10000].each do |nfeatures|
+  words   = (1..nfeatures * 10).to_a.sample(nfeatures, :random => random).sort.map { |f| [f, random.rand] }
+  indices = words.map(&:first).pack('l*')
+  weights = words.map(&:last).pack('f*')
+  count   = 100_000 / nfeatures
+
+  Bench.measure("Document.create (#{nfeatures} features)", :items => count, :iterations => 10,
+                :per_item => true) do |sample|
+    count.times { sample.call { Document.create(0, 1, 0, 0, words) } }
+  end
+
+  Bench.measure("Document.from_packed (#{nfeatures} features)", :items => count, :iterations => 10,
+                :per_item => true) do |sample|
+    count.times { sample.call { Document.from_packed(indices, weights) } }
+  end
+end
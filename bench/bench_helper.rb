@@ -0,0 +1,106 @@
+require 'json'
+require 'time'
+require File.expand_path('../../lib/svmredlight', __FILE__)
+
+# Tiny harness for the benchmarks in this directory. Every measurement runs a block a number of times (after a
+# warm up run) and records throughput, latency percentiles, the ruby objects and native bytes (see
+# SVMLight.memory_stats) allocated per run and how much the resident set of the process grew, results are written
+# as JSON by Bench.report.
+module Bench
+  RESULTS = []
+  SEED    = 42
+
+  # Fewer latency samples than this and p99 would only be the slowest one, it is left out
+  MIN_P99_SAMPLES = 100
+
+  def self.clock
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  # Resident set size in bytes, 0 where /proc is not available
+  def self.rss
+    File.read('/proc/self/status')[/VmRSS:\s+(\d+)/, 1].to_i * 1024
+  rescue
+    0
+  end
+
+  def self.percentile(sorted, p)
+    sorted[[(sorted.size * p).ceil - 1, 0].max]
+  end
+
+  # @param [String] name
+  # @param [Hash] opts
+  # @option [:iterations] Fixnum how many times the block is run, 100 by default
+  # @option [:items] Fixnum how many items (documents, features, ...) one run processes, for the throughput
+  # @option [:warmup] Boolean run the block once before measuring, true by default
+  # @option [:per_item] Boolean the block gets a sampler to time each item with, sample.call { ... }, and the
+  #   percentiles are those of the items instead of the runs
+  def self.measure(name, opts = {})
+    iterations = opts[:iterations] || 100
+    items      = opts[:items] || 1
+    samples    = []
+    sample     = lambda do |&item|
+      start = clock
+      item.call
+      samples << clock - start
+    end
+
+    yield sample if opts.fetch(:warmup, true)
+    samples.clear
+
+    GC.start
+    objects   = GC.stat(:total_allocated_objects)
+    native    = SVMLight.memory_stats
+    rss       = self.rss
+    latencies = Array.new(iterations) do
+      start = clock
+      yield sample
+      clock - start
+    end
+    objects   = GC.stat(:total_allocated_objects) - objects
+    allocated = SVMLight.memory_stats[:allocated_bytes] - native[:allocated_bytes]
+    retained  = SVMLight.memory_stats[:bytes] - native[:bytes]
+    sorted    = (opts[:per_item] ? samples : latencies).sort
+    total     = latencies.inject(:+)
+
+    result = { :name                  => name,
+               :iterations            => iterations,
+               :items_per_iteration   => items,
+               :latency_samples       => sorted.size,
+               :throughput            => total > 0 ? items * iterations / total : nil,
+               :mean                  => total / iterations,
+               :p50                   => percentile(sorted, 0.5),
+               :p99                   => sorted.size >= MIN_P99_SAMPLES ? percentile(sorted, 0.99) : nil,
+               :max                   => sorted.last,
+               :allocated_objects     => objects / iterations,
+               :allocated_bytes       => allocated / iterations,
+               :native_growth_bytes   => retained,
+               :rss_growth_bytes      => self.rss - rss }
+
+    RESULTS << result
+    $stderr.puts format('%-45s %12.1f items/s  p50 %10.6fs  p99 %10s  %8d objects  %10d bytes',
+                        name, result[:throughput] || 0, result[:p50],
+                        result[:p99] ? format('%.6fs', result[:p99]) : '-', result[:allocated_objects],
+                        result[:allocated_bytes])
+    result
+  end
+
+  # Writes every result to path (bench/results/<version>-<time>.json by default), returns the path
+  def self.report(path = nil)
+    version = File.read(File.dirname(__FILE__) + '/../VERSION').strip
+    path  ||= File.dirname(__FILE__) + "/results/#{version}-#{Time.now.utc.strftime('%Y%m%d%H%M%S')}.json"
+
+    Dir.mkdir(File.dirname(path)) unless File.directory?(File.dirname(path))
+    File.open(path, 'w') do |f|
+      f.write(JSON.pretty_generate(:version       => version,
+                                   :ruby          => RUBY_VERSION,
+                                   :platform      => RUBY_PLATFORM,
+                                   :linear_engine => SVMLight.linear_engine,
+                                   :seed          => SEED,
+                                   :time          => Time.now.utc.iso8601,
+                                   :results       => RESULTS))
+    end
+
+    path
+  end
+end
@@ -0,0 +1,33 @@
+# Loading models and classifying documents with them
+include SVMLight
+
+root = File.dirname(__FILE__) + '/..'
+
+Bench.measure('model load (text)', :iterations => 5) do
+  Model.read_from_file(root + '/test/assets/model')
+end
+
+model  = Model.read_from_file(root + '/test/assets/model')
+binary = root + '/bench/results/model.bin'
+Dir.mkdir(File.dirname(binary)) unless File.directory?(File.dirname(binary))
+model.write_binary(binary)
+
+Bench.measure('model load (binary)') do
+  Model.load_binary(binary)
+end
+File.delete(binary)
+
+documents = SVMLight.read_documents(root + '/examples/example1/test.dat').map(&:first)
+
+Bench.measure('classify (one call per document)', :items => documents.size, :iterations => 10,
+              :per_item => true) do |sample|
+  documents.each { |document| sample.call { model.classify(document) } }
+end
+
+Bench.measure('classify_batch', :items => documents.size) do
+  model.classify_batch(documents)
+end
+
+Bench.measure('classify_batch (packed)', :items => documents.size) do
+  model.classify_batch(documents, :packed => true)
+end
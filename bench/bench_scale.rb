@@ -0,0 +1,36 @@
+# A synthetic corpus, BENCH_DOCUMENTS documents (1M by default) of 20 features out of 100k built in a DocumentSet
+# and scored, BENCH_TRAIN_DOCUMENTS (20k by default) of them are used for training
+include SVMLight
+
+random     = Random.new(Bench::SEED)
+ndocuments = (ENV['BENCH_DOCUMENTS'] || 1_000_000).to_i
+ntrain     = [(ENV['BENCH_TRAIN_DOCUMENTS'] || 20_000).to_i, ndocuments].min
+rows       = Array.new(1000) do
+  indices = (1..100_000).to_a.sample(20, :random => random).sort
+  [indices.pack('l*'), Array.new(20) { random.rand }.pack('f*'), indices.first.even? ? 1 : -1]
+end
+
+set = nil
+Bench.measure("DocumentSet build (#{ndocuments} documents)", :items => ndocuments, :iterations => 1,
+              :warmup => false) do
+  set = DocumentSet.new
+  ndocuments.times { |i| set.add_packed(*rows[i % rows.size]) }
+end
+
+training = set[0, ntrain]
+model    = nil
+Bench.measure("train linear (#{ntrain} synthetic documents)", :items => ntrain, :iterations => 1,
+              :warmup => false) do
+  model = Model.new(:classification, training, {}, {}, nil)
+end
+
+Bench.measure("train linear dual_cd (#{ntrain} synthetic documents)", :items => ntrain, :iterations => 1,
+              :warmup => false) do
+  Model.new(:classification, training, {'solver' => :dual_cd, 'epsilon_crit' => 0.1}, {}, nil)
+end
+
+documents = set[0, [ndocuments, 100_000].min].map(&:first)
+Bench.measure("classify_batch (#{documents.size} synthetic documents)", :items => documents.size,
+              :iterations => 3) do
+  model.classify_batch(documents)
+end
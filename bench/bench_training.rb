@@ -0,0 +1,12 @@
+# End to end training on the example training set
+include SVMLight
+
+train = SVMLight.read_documents(File.dirname(__FILE__) + '/../examples/example1/train.dat')
+
+Bench.measure('read_documents (train.dat)', :iterations => 20) do
+  SVMLight.read_documents(File.dirname(__FILE__) + '/../examples/example1/train.dat')
+end
+
+Bench.measure('train linear (train.dat)', :items => train.size, :iterations => 3) do
+  Model.new(:classification, train, {'svm_c' => 1.5}, {}, nil)
+end
@@ -0,0 +1,14 @@
+# Runs every benchmark in this directory and writes the results as JSON, see Bench.report. Set BENCH_OUTPUT to
+# choose the file, BENCH_ONLY to a comma separated list of benchmark files (without .rb) to run only some.
+require File.expand_path('../bench_helper', __FILE__)
+
+only = ENV['BENCH_ONLY'] && ENV['BENCH_ONLY'].split(',')
+
+Dir[File.dirname(__FILE__) + '/bench_*.rb'].sort.each do |file|
+  name = File.basename(file, '.rb')
+  next if name == 'bench_helper' || (only && !only.include?(name.sub(/\Abench_/, '')))
+
+  load file
+end
+
+puts Bench.report(ENV['BENCH_OUTPUT'])
@@ -8,34 +8,14 @@ include SVMLight
 # Then it will read the test set, classify every document and report how many documents in
 # the training set were correctly classified and missed.
 
-# Turn a line of the example data into an useful features array
-def line_to_ary(line, has_target = false)
-  records = line.split(' ')
-  target =  records.shift if has_target
-
-  ary = []
-
-  records.each_with_index do |record, i|
-    pos, value = record.split(':')
-    ary << [pos.to_i, value.to_f]
-  end
-
-  [ary, target]
-end
-
 # Quick sign function
 def sign(x)
   x >= 0 ? 1  : -1
 end
 
 puts "Reading training data..."
-training_documents_and_labels = []
-
-File.open('./examples/example1/train.dat', 'r').each_with_index do |line, i|
-  next if line.chars.first == '#'
-  ary, target = line_to_ary(line, true)
-  training_documents_and_labels << [Document.create(i + 1, 1, 0, 1, ary), target.to_i]
-end
+# The file is parsed in C straight into Documents, labels are the first element of each line
+training_documents_and_labels = SVMLight.read_documents('./examples/example1/train.dat')
 
 # Train a model here, you can play with the available learn_params
 m = Model.new(:classification,                 # type
@@ -52,17 +32,13 @@ total = 0
 
 # Try the new model out against the test file.
 puts "Classifiying test data, correct classitication : :) incorrect : :( .\n"
-File.open('./examples/example1/test.dat', 'r').each_with_index do |line, i|
-  next if line.chars.first == '#'
-  ary, target = line_to_ary(line, true)
-  next if ary.empty?
-  
+SVMLight.each_document('./examples/example1/test.dat') do |document, target|
   # Classify an unknown document using the model
-  result = m.classify(Document.create(i + 1, 1, 0, 1, ary)) 
+  result = m.classify(document)
 
   total += 1
 
-  if sign(result) == target.to_i
+  if sign(result) == target
     print ':) '
     hits += 1
   else
@@ -0,0 +1,609 @@
+#include "svmredlight.h"
+#include "string.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+/* Binary model files are a header followed by flat arrays (sections), every section
+ * starts at a multiple of BINARY_MODEL_ALIGN so a mmap'd file can be used as is:
+
+     alpha        double[sv_num]       alpha*y, element 0 is unused like in SVM-light
+     docnums      int64[sv_num]        docnum of the training document of each SV
+     norms        double[sv_num]       squared norm of each SV
+     rows         int64[sv_num + 1]    first word of each SV in words
+     words        WORD[nwords]         the words of every SV, each list 0 terminated
+     lin_weights  double[totwords + 1] only for linear models
+
+ * Compact models (see compact.c) have no support vectors (sv_num is 1) and instead of
+ * lin_weights a BINARY_MODEL_COMPACT header followed by their own sections:
+
+     indices      int32[nnz]           only for sparse weights
+     values       float[nnz] or int8[nnz]
+
+ * Arrays are stored in the native layout of the machine that wrote them, the header
+ * records byte order and type sizes and files written elsewhere are refused. */
+#define BINARY_MODEL_MAGIC   "SVMRLBIN"
+#define BINARY_MODEL_VERSION 1
+#define BINARY_MODEL_ALIGN   64
+#define BINARY_MODEL_BOM     0x01020304
+
+/* flags, the docnums of the support vectors are positions in the training set */
+#define BINARY_MODEL_TRAINING_DOCNUMS 1
+/* flags, lin_weights_offset points to a BINARY_MODEL_COMPACT */
+#define BINARY_MODEL_COMPACT          2
+
+typedef struct binary_model_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t word_size;
+  uint32_t fnum_size;
+  uint32_t fval_size;
+  uint32_t flags;
+  int64_t  kernel_type;
+  int64_t  poly_degree;
+  double   rbf_gamma;
+  double   coef_lin;
+  double   coef_const;
+  char     custom[56];
+  int64_t  totwords;
+  int64_t  totdoc;
+  int64_t  sv_num;
+  int64_t  at_upper_bound;
+  double   b;
+  double   maxdiff;
+  int64_t  nwords;
+  uint64_t alpha_offset;
+  uint64_t docnums_offset;
+  uint64_t norms_offset;
+  uint64_t rows_offset;
+  uint64_t words_offset;
+  uint64_t lin_weights_offset;
+  uint64_t file_size;
+} BINARY_MODEL_HEADER;
+
+typedef struct binary_model_compact {
+  int64_t  precision;
+  int64_t  len;
+  int64_t  nnz;
+  double   scale;
+  double   max_error;
+  uint64_t indices_offset;
+  uint64_t values_offset;
+} BINARY_MODEL_COMPACT_HEADER;
+
+static char empty_userdefined[] = "";
+
+static size_t
+compact_value_size(int64_t precision){
+  return precision == COMPACT_INT8 ? sizeof(int8_t) : sizeof(float);
+}
+
+static uint64_t
+align_offset(uint64_t offset){
+  return (offset + BINARY_MODEL_ALIGN - 1) & ~(uint64_t)(BINARY_MODEL_ALIGN - 1);
+}
+
+/* Frees a model created by model_load_binary, the arrays live in the mapping so
+ * free_model cannot be used */
+void
+binary_model_unmap(RMODEL *rm){
+  if(rm->m){
+    // Only weights computed after loading are outside the mapping
+    if(rm->m->lin_weights && ((char *)rm->m->lin_weights < (char *)rm->mapping ||
+       (char *)rm->m->lin_weights >= (char *)rm->mapping + rm->mapping_len))
+      free(rm->m->lin_weights);
+
+    free(rm->m->supvec);
+    free(rm->m);
+    rm->m = NULL;
+  }
+
+  free(rm->sv_docs);
+  free(rm->sv_vecs);
+
+#ifdef HAVE_SYS_MMAN_H
+  munmap(rm->mapping, rm->mapping_len);
+#else
+  free(rm->mapping);
+#endif
+
+  rm->mapping = NULL;
+}
+
+static int
+write_padding(FILE *f, uint64_t *offset){
+  static const char zeros[BINARY_MODEL_ALIGN];
+  uint64_t aligned = align_offset(*offset);
+
+  if(aligned > *offset && fwrite(zeros, 1, aligned - *offset, f) != aligned - *offset)
+    return 1;
+
+  *offset = aligned;
+  return 0;
+}
+
+static int
+write_section(FILE *f, const void *data, size_t size, uint64_t *offset){
+  if(write_padding(f, offset))
+    return 1;
+
+  if(size > 0 && fwrite(data, 1, size, f) != size)
+    return 1;
+
+  *offset += size;
+  return 0;
+}
+
+static long
+count_words(SVECTOR *vec){
+  long n = 0;
+
+  while(vec->words[n].wnum)
+    n++;
+
+  return n;
+}
+
+/* Everything needed to write the sections, computed before the file is opened so
+ * errors can be raised without leaving half written files around */
+typedef struct binary_model_sections {
+  int64_t *docnums;
+  double  *norms;
+  int64_t *rows;
+} BINARY_MODEL_SECTIONS;
+
+static void
+free_sections(BINARY_MODEL_SECTIONS *sections){
+  free(sections->docnums);
+  free(sections->norms);
+  free(sections->rows);
+}
+
+/* Writes the model in the binary format, see Model.load_binary.
+ *
+ * @param [String] path
+ * */
+static VALUE
+model_write_binary(VALUE self, VALUE path){
+  RMODEL *rm = model_get(self);
+  MODEL *m = rm->m;
+  COMPACT_WEIGHTS *c = rm->compact;
+  BINARY_MODEL_HEADER header;
+  BINARY_MODEL_COMPACT_HEADER compact;
+  BINARY_MODEL_SECTIONS sections;
+  FILE *f;
+  long i, n;
+  uint64_t offset;
+  int failed = 0, err;
+  double *lin_weights = m->lin_weights, no_alpha = 0.0;
+
+  FilePathValue(path);
+  online_fold(rm);
+
+  for(i=1; i < m->sv_num; i++){
+    if(m->supvec[i]->fvec->next || m->supvec[i]->fvec->factor != 1.0)
+      rb_raise(rb_eArgError, "Support vectors made of several feature vectors cannot be "
+               "written in the binary format");
+  }
+
+  memset(&header, 0, sizeof(header));
+  memset(&sections, 0, sizeof(sections));
+  memset(&compact, 0, sizeof(compact));
+
+  memcpy(header.magic, BINARY_MODEL_MAGIC, 8);
+  header.version        = BINARY_MODEL_VERSION;
+  header.byte_order     = BINARY_MODEL_BOM;
+  header.word_size      = sizeof(WORD);
+  header.fnum_size      = sizeof(FNUM);
+  header.fval_size      = sizeof(FVAL);
+  header.flags          = (rm->training_docnums ? BINARY_MODEL_TRAINING_DOCNUMS : 0) |
+                          (c ? BINARY_MODEL_COMPACT : 0);
+  header.kernel_type    = m->kernel_parm.kernel_type;
+  header.poly_degree    = m->kernel_parm.poly_degree;
+  header.rbf_gamma      = m->kernel_parm.rbf_gamma;
+  header.coef_lin       = m->kernel_parm.coef_lin;
+  header.coef_const     = m->kernel_parm.coef_const;
+  strncpy(header.custom, m->kernel_parm.custom, sizeof(header.custom) - 1);
+  header.totwords       = m->totwords;
+  header.totdoc         = m->totdoc;
+  header.sv_num         = m->sv_num;
+  header.at_upper_bound = m->at_upper_bound;
+  header.b              = m->b;
+  header.maxdiff        = m->maxdiff;
+
+  sections.docnums = (int64_t *)my_malloc(sizeof(int64_t) * m->sv_num);
+  sections.norms   = (double *)my_malloc(sizeof(double) * m->sv_num);
+  sections.rows    = (int64_t *)my_malloc(sizeof(int64_t) * (m->sv_num + 1));
+
+  // Slot 0 is unused but still gets its 0 terminator so rows are uniform
+  sections.docnums[0] = -1;
+  sections.norms[0]   = 0.0;
+  sections.rows[0]    = 0;
+  sections.rows[1]    = 1;
+
+  for(i=1; i < m->sv_num; i++){
+    sections.docnums[i] = m->supvec[i]->docnum;
+    sections.norms[i]   = sprod_ss(m->supvec[i]->fvec, m->supvec[i]->fvec);
+    sections.rows[i+1]  = sections.rows[i] + count_words(m->supvec[i]->fvec) + 1;
+  }
+
+  header.nwords = sections.rows[m->sv_num];
+
+  offset = align_offset(sizeof(header));
+  header.alpha_offset   = offset;
+  offset = align_offset(offset + sizeof(double) * m->sv_num);
+  header.docnums_offset = offset;
+  offset = align_offset(offset + sizeof(int64_t) * m->sv_num);
+  header.norms_offset   = offset;
+  offset = align_offset(offset + sizeof(double) * m->sv_num);
+  header.rows_offset    = offset;
+  offset = align_offset(offset + sizeof(int64_t) * (m->sv_num + 1));
+  header.words_offset   = offset;
+  offset += sizeof(WORD) * header.nwords;
+
+  if(c){
+    compact.precision = c->precision;
+    compact.len       = c->len;
+    compact.nnz       = c->nnz;
+    compact.scale     = c->scale;
+    compact.max_error = c->max_error;
+
+    offset = align_offset(offset);
+    header.lin_weights_offset = offset;
+    offset += sizeof(compact);
+
+    if(c->indices){
+      offset = align_offset(offset);
+      compact.indices_offset = offset;
+      offset += sizeof(int32_t) * c->nnz;
+    }
+
+    offset = align_offset(offset);
+    compact.values_offset = offset;
+    offset += compact_value_size(c->precision) * c->nnz;
+    lin_weights = NULL;
+  }else if(is_linear(m)){
+    if(!lin_weights){
+      add_weight_vector_to_linear_model(m);
+      lin_weights = m->lin_weights;
+    }
+
+    offset = align_offset(offset);
+    header.lin_weights_offset = offset;
+    offset += sizeof(double) * (m->totwords + 1);
+  }
+
+  header.file_size = offset;
+
+  if(!(f = fopen(StringValueCStr(path), "wb"))){
+    err = errno;
+    free_sections(&sections);
+    rb_syserr_fail_str(err, path);
+  }
+
+  offset = 0;
+  failed |= write_section(f, &header, sizeof(header), &offset);
+  // Compact models have no alphas, only the unused element 0
+  failed |= write_section(f, m->alpha ? m->alpha : &no_alpha, sizeof(double) * m->sv_num, &offset);
+  failed |= write_section(f, sections.docnums, sizeof(int64_t) * m->sv_num, &offset);
+  failed |= write_section(f, sections.norms, sizeof(double) * m->sv_num, &offset);
+  failed |= write_section(f, sections.rows, sizeof(int64_t) * (m->sv_num + 1), &offset);
+  failed |= write_padding(f, &offset);
+
+  {
+    WORD terminator;
+    terminator.wnum   = 0;
+    terminator.weight = 0;
+
+    failed |= fwrite(&terminator, sizeof(WORD), 1, f) != 1;
+
+    for(i=1; i < m->sv_num && !failed; i++){
+      n = sections.rows[i+1] - sections.rows[i];
+      failed |= fwrite(m->supvec[i]->fvec->words, sizeof(WORD), n, f) != (size_t)n;
+    }
+
+    offset += sizeof(WORD) * header.nwords;
+  }
+
+  if(lin_weights)
+    failed |= write_section(f, lin_weights, sizeof(double) * (m->totwords + 1), &offset);
+
+  if(c){
+    failed |= write_section(f, &compact, sizeof(compact), &offset);
+
+    if(c->indices)
+      failed |= write_section(f, c->indices, sizeof(int32_t) * c->nnz, &offset);
+
+    failed |= write_section(f, c->values, compact_value_size(c->precision) * c->nnz, &offset);
+  }
+
+  err = errno;
+  failed |= fclose(f) != 0;
+  free_sections(&sections);
+
+  if(failed)
+    rb_syserr_fail_str(err ? err : EIO, path);
+
+  return Qnil;
+}
+
+/* Checks that every section described in the header fits in the file, is aligned and
+ * that the rows describe 0 terminated word lists, returns the error message or NULL */
+static const char *
+validate_header(const BINARY_MODEL_HEADER *h, const char *data, size_t len){
+  const BINARY_MODEL_COMPACT_HEADER *c;
+  const int64_t *rows;
+  const int32_t *indices;
+  const WORD *words;
+  int64_t i, j;
+
+  if(len < sizeof(*h) || memcmp(h->magic, BINARY_MODEL_MAGIC, 8) != 0)
+    return "not a binary svmredlight model";
+
+  if(h->version != BINARY_MODEL_VERSION)
+    return "unsupported binary model version";
+
+  if(h->byte_order != BINARY_MODEL_BOM || h->word_size != sizeof(WORD) ||
+     h->fnum_size != sizeof(FNUM) || h->fval_size != sizeof(FVAL))
+    return "binary model written on an incompatible platform";
+
+  if(h->file_size != len)
+    return "truncated binary model";
+
+  if(h->sv_num < 1 || h->totwords < 0 || h->nwords < h->sv_num)
+    return "corrupt binary model header";
+
+/* count elements of size bytes fit at off, counts are compared against what is left of
+ * the file so huge ones cannot overflow the multiplication */
+#define SECTION_FITS(off, count, size) \
+  ((off) % BINARY_MODEL_ALIGN == 0 && (off) <= len && (uint64_t)(count) <= (len - (off)) / (size))
+
+  if(!SECTION_FITS(h->alpha_offset, h->sv_num, sizeof(double)) ||
+     !SECTION_FITS(h->docnums_offset, h->sv_num, sizeof(int64_t)) ||
+     !SECTION_FITS(h->norms_offset, h->sv_num, sizeof(double)) ||
+     !SECTION_FITS(h->rows_offset, (uint64_t)h->sv_num + 1, sizeof(int64_t)) ||
+     !SECTION_FITS(h->words_offset, h->nwords, sizeof(WORD)) ||
+     (h->lin_weights_offset && !(h->flags & BINARY_MODEL_COMPACT) &&
+      !SECTION_FITS(h->lin_weights_offset, (uint64_t)h->totwords + 1, sizeof(double))))
+    return "corrupt binary model sections";
+
+  if(h->flags & BINARY_MODEL_COMPACT){
+    if(!h->lin_weights_offset || !SECTION_FITS(h->lin_weights_offset, 1, sizeof(*c)))
+      return "corrupt binary model sections";
+
+    c = (const BINARY_MODEL_COMPACT_HEADER *)(data + h->lin_weights_offset);
+
+    if((c->precision != COMPACT_FLOAT32 && c->precision != COMPACT_INT8) ||
+       (uint64_t)c->len != (uint64_t)h->totwords + 1 || c->nnz < 0 || c->nnz > c->len ||
+       (!c->indices_offset && c->nnz != c->len))
+      return "corrupt binary model compact weights";
+
+    if((c->indices_offset && !SECTION_FITS(c->indices_offset, c->nnz, sizeof(int32_t))) ||
+       !SECTION_FITS(c->values_offset, c->nnz, compact_value_size(c->precision)))
+      return "corrupt binary model sections";
+
+    // compact.c relies on increasing feature numbers to search them
+    indices = c->indices_offset ? (const int32_t *)(data + c->indices_offset) : NULL;
+    for(i=0; indices && i < c->nnz; i++){
+      if(indices[i] < 1 || indices[i] >= c->len || (i > 0 && indices[i] <= indices[i-1]))
+        return "corrupt binary model compact weights";
+    }
+  }
+
+#undef SECTION_FITS
+
+  rows  = (const int64_t *)(data + h->rows_offset);
+  words = (const WORD *)(data + h->words_offset);
+
+  if(rows[0] != 0 || rows[h->sv_num] != h->nwords)
+    return "corrupt binary model rows";
+
+  for(i=0; i < h->sv_num; i++){
+    if(rows[i+1] <= rows[i] || words[rows[i+1] - 1].wnum != 0)
+      return "corrupt binary model rows";
+
+    // the dot products only check wnum against the upper end of the weights
+    for(j=rows[i]; j < rows[i+1]; j++){
+      if(words[j].wnum < 0 || words[j].wnum > h->totwords)
+        return "corrupt binary model support vectors";
+    }
+  }
+
+  return NULL;
+}
+
+/* Maps the whole file read only, without mmap it is read into memory */
+static int
+map_file(const char *path, void **data, size_t *len){
+  int fd, err = 0;
+  struct stat st;
+
+  if((fd = open(path, O_RDONLY)) < 0)
+    return errno;
+
+  if(fstat(fd, &st) != 0){
+    err = errno;
+    close(fd);
+    return err;
+  }
+
+  *len = (size_t)st.st_size;
+
+  if(*len < sizeof(BINARY_MODEL_HEADER)){
+    close(fd);
+    return EINVAL;
+  }
+
+#ifdef HAVE_SYS_MMAN_H
+  *data = mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0);
+
+  if(*data == MAP_FAILED)
+    err = errno;
+#else
+  ssize_t got;
+  size_t done = 0;
+
+  *data = my_malloc(*len);
+
+  while(done < *len && !err){
+    got = read(fd, (char *)*data + done, *len - done);
+
+    if(got <= 0)
+      err = got == 0 ? EIO : errno;
+    else
+      done += (size_t)got;
+  }
+
+  if(err)
+    free(*data);
+#endif
+
+  close(fd);
+  return err;
+}
+
+/* Loads a model written by Model#write_binary. The file is mmap'd and alphas, support
+ * vector words and the linear weights are used straight from the mapping, nothing is
+ * parsed, only the DOC and SVECTOR headers of the support vectors get allocated.
+ *
+ * @param [String] path
+ * */
+static VALUE
+model_load_binary(VALUE klass, VALUE path){
+  void *data = NULL;
+  size_t len = 0;
+  int err;
+  long i;
+  const char *error;
+  const BINARY_MODEL_HEADER *h;
+  const BINARY_MODEL_COMPACT_HEADER *ch;
+  const int64_t *docnums, *rows;
+  const double *norms;
+  WORD *words;
+  MODEL *m;
+  RMODEL *rm;
+
+  FilePathValue(path);
+
+  if((err = map_file(StringValueCStr(path), &data, &len)) != 0){
+    if(err == EINVAL)
+      rb_raise(rb_eArgError, "%s is not a binary svmredlight model", StringValueCStr(path));
+
+    rb_syserr_fail_str(err, path);
+  }
+
+  h = (const BINARY_MODEL_HEADER *)data;
+
+  if((error = validate_header(h, (const char *)data, len)) != NULL){
+#ifdef HAVE_SYS_MMAN_H
+    munmap(data, len);
+#else
+    free(data);
+#endif
+    rb_raise(rb_eArgError, "%s: %s", StringValueCStr(path), error);
+  }
+
+  docnums = (const int64_t *)((const char *)data + h->docnums_offset);
+  norms   = (const double *)((const char *)data + h->norms_offset);
+  rows    = (const int64_t *)((const char *)data + h->rows_offset);
+  words   = (WORD *)((char *)data + h->words_offset);
+
+  m = (MODEL *)my_malloc(sizeof(MODEL));
+  memset(m, 0, sizeof(MODEL));
+
+  m->kernel_parm.kernel_type = h->kernel_type;
+  m->kernel_parm.poly_degree = h->poly_degree;
+  m->kernel_parm.rbf_gamma   = h->rbf_gamma;
+  m->kernel_parm.coef_lin    = h->coef_lin;
+  m->kernel_parm.coef_const  = h->coef_const;
+  // h->custom is wider than kernel_parm.custom, it was NUL padded when written
+  memcpy(m->kernel_parm.custom, h->custom, sizeof(m->kernel_parm.custom) - 1);
+  m->kernel_parm.custom[sizeof(m->kernel_parm.custom) - 1] = '\0';
+  m->totwords       = h->totwords;
+  m->totdoc         = h->totdoc;
+  m->sv_num         = h->sv_num;
+  m->at_upper_bound = h->at_upper_bound;
+  m->b              = h->b;
+  m->maxdiff        = h->maxdiff;
+  m->loo_error      = m->loo_recall = m->loo_precision = -1;
+  m->xa_error       = m->xa_recall  = m->xa_precision  = -1;
+  // SVM-light never writes to these when classifying, the mapping is read only
+  m->alpha          = (double *)((char *)data + h->alpha_offset);
+  m->lin_weights    = h->lin_weights_offset && !(h->flags & BINARY_MODEL_COMPACT) ?
+                      (double *)((char *)data + h->lin_weights_offset) : NULL;
+
+  rm = rmodel_new(m);
+  rm->mapping     = data;
+  rm->mapping_len = len;
+  rm->training_docnums = (h->flags & BINARY_MODEL_TRAINING_DOCNUMS) != 0;
+  rm->sv_docs     = (DOC *)my_malloc(sizeof(DOC) * m->sv_num);
+  rm->sv_vecs     = (SVECTOR *)my_malloc(sizeof(SVECTOR) * m->sv_num);
+  m->supvec       = (DOC **)my_malloc(sizeof(DOC *) * m->sv_num);
+  m->supvec[0]    = NULL;
+
+  for(i=1; i < m->sv_num; i++){
+    rm->sv_vecs[i].words       = words + rows[i];
+    rm->sv_vecs[i].twonorm_sq  = norms[i];
+    rm->sv_vecs[i].userdefined = empty_userdefined;
+    rm->sv_vecs[i].kernel_id   = 0;
+    rm->sv_vecs[i].next        = NULL;
+    rm->sv_vecs[i].factor      = 1.0;
+
+    rm->sv_docs[i].docnum      = docnums[i];
+    rm->sv_docs[i].queryid     = 0;
+    rm->sv_docs[i].costfactor  = 0.0;
+    rm->sv_docs[i].slackid     = 0;
+    rm->sv_docs[i].kernelid    = docnums[i];
+    rm->sv_docs[i].fvec        = &rm->sv_vecs[i];
+
+    m->supvec[i] = &rm->sv_docs[i];
+  }
+
+  if(h->flags & BINARY_MODEL_COMPACT){
+    ch = (const BINARY_MODEL_COMPACT_HEADER *)((const char *)data + h->lin_weights_offset);
+
+    rm->compact = (COMPACT_WEIGHTS *)my_malloc(sizeof(COMPACT_WEIGHTS));
+    rm->compact->precision = (int)ch->precision;
+    rm->compact->len       = ch->len;
+    rm->compact->nnz       = ch->nnz;
+    rm->compact->indices   = ch->indices_offset ? (int32_t *)((char *)data + ch->indices_offset) : NULL;
+    rm->compact->values    = (char *)data + ch->values_offset;
+    rm->compact->scale     = ch->scale;
+    rm->compact->max_error = ch->max_error;
+    rm->compact->owned     = 0;
+  }else{
+    linear_engine_prepare(rm);
+    kernel_engine_prepare_mapped(rm, words, rows, m->alpha, norms);
+  }
+
+  return model_wrap(klass, rm);
+}
+
+/* Where the binary model file is mapped and how many bytes this process malloc'd on top
+ * of it (support vector headers, engines), nil for models not loaded from a binary file.
+ * See Model#memory_sharing.
+ * @return [Array|Nil] [address, length, heap bytes]
+ */
+static VALUE
+model_mapping(VALUE self){
+  RMODEL *rm = model_get(self);
+
+  if(!rm->mapping)
+    return Qnil;
+
+  return rb_ary_new3(3, ULL2NUM((uintptr_t)rm->mapping), SIZET2NUM(rm->mapping_len),
+                     SIZET2NUM(model_memsize(rm)));
+}
+
+void
+Init_svmredlight_binary_model(){
+  rb_define_singleton_method(rb_cModel, "load_binary", model_load_binary, 1);
+  rb_define_method(rb_cModel, "write_binary", model_write_binary, 1);
+  rb_define_private_method(rb_cModel, "mapping", model_mapping, 0);
+}
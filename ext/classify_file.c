@@ -0,0 +1,412 @@
+#include "svmredlight.h"
+#include "string.h"
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+/* Scores a file in SVM-light's format the way svm_classify does, in process. The input
+ * is mapped (see text_buffer_open) and handed out in chunks of whole lines (about
+ * CLASSIFY_FILE_CHUNK bytes unless the caller picks another size) to worker
+ * threads that parse and score them without the GVL, each into its own output buffer.
+ * Whoever finishes the oldest chunk still unwritten writes it, and every finished chunk
+ * after it, so predictions come out in input order. At most CLASSIFY_FILE_SLOTS_PER_THREAD
+ * chunks per thread are in flight, workers wait for the writes to catch up before taking
+ * more, so memory stays bounded whatever the size of the file. Pages of the input are
+ * dropped once their chunk is written. */
+
+#define CLASSIFY_FILE_CHUNK            (1 << 22)
+#define CLASSIFY_FILE_SLOTS_PER_THREAD 4
+#define CLASSIFY_FILE_MAX_THREADS      256
+
+/* What classify_file counts, labels 0 are unlabeled and only count as documents */
+#define COUNT_DOCUMENTS       0
+#define COUNT_LABELED         1
+#define COUNT_CORRECT         2
+#define COUNT_TRUE_POSITIVES  3
+#define COUNT_FALSE_POSITIVES 4
+#define COUNT_FALSE_NEGATIVES 5
+#define COUNT_TRUE_NEGATIVES  6
+#define COUNTS                7
+
+typedef struct file_chunk {
+  size_t start;
+  size_t end;
+  char   *out;
+  size_t out_len;
+  size_t out_capacity;
+  int    done;
+} FILE_CHUNK;
+
+typedef struct classify_file_job {
+  RMODEL      *rm;
+  TEXT_BUFFER buf;
+  FILE        *out;
+  VALUE       input_path;
+  long        nthreads;
+  size_t      chunk_size;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  size_t      claim_pos;   // where the next chunk starts
+  long        claimed;     // chunks handed out
+  long        written;     // chunks written, chunk k lives in slots[k % nslots]
+  FILE_CHUNK  *slots;
+  long        nslots;
+  long        counts[COUNTS];
+  char        error[300];
+  size_t      error_pos;   // start of the first line that failed to parse
+  int         failed;
+  int         write_errno;
+  volatile int interrupted;
+} CLASSIFY_FILE_JOB;
+
+static int
+chunk_append(FILE_CHUNK *chunk, double dist){
+  char *out;
+
+  // "%.8g\n" is never longer than 16 chars
+  if(chunk->out_len + 32 > chunk->out_capacity){
+    chunk->out_capacity = chunk->out_capacity ? chunk->out_capacity * 2 : 65536;
+
+    if(!(out = (char *)realloc(chunk->out, chunk->out_capacity)))
+      return 1;
+
+    chunk->out = out;
+  }
+
+  chunk->out_len += snprintf(chunk->out + chunk->out_len, 32, "%.8g\n", dist);
+
+  return 0;
+}
+
+/* Parses and scores the lines of chunk, on error returns 1 with error and error_pos set */
+static int
+classify_chunk(CLASSIFY_FILE_JOB *job, FILE_CHUNK *chunk, PARSED_LINE *line, long *counts,
+               char *error, size_t *error_pos){
+  const char *data = job->buf.data, *p = data + chunk->start, *end = data + chunk->end, *eol;
+  DOC doc;
+  SVECTOR vec;
+  double dist;
+  int r;
+
+  memset(&doc, 0, sizeof(DOC));
+  memset(&vec, 0, sizeof(SVECTOR));
+
+  for(; p < end; p = eol + 1){
+    if(!(eol = memchr(p, '\n', end - p)))
+      eol = end;
+
+    if((r = parse_svmlight_line(p, eol, line, error)) == 0)
+      continue;
+
+    if(r < 0){
+      *error_pos = p - data;
+      return 1;
+    }
+
+    // The example only lives for this call, no need for create_example's copies
+    vec.words       = line->words;
+    vec.twonorm_sq  = sprod_ss(&vec, &vec);
+    vec.userdefined = line->comment;
+    vec.factor      = 1.0;
+    doc.queryid     = line->queryid;
+    doc.slackid     = line->slackid;
+    doc.costfactor  = line->costfactor;
+    doc.fvec        = &vec;
+
+    dist = rmodel_classify(job->rm, &doc);
+
+    if(chunk_append(chunk, dist)){
+      strncpy(error, "Out of memory while writing predictions", 300);
+      *error_pos = p - data;
+      return 1;
+    }
+
+    counts[COUNT_DOCUMENTS]++;
+
+    // svm_classify's counts, a score of 0 is never right
+    if(line->label != 0){
+      counts[COUNT_LABELED]++;
+
+      if(dist * line->label > 0)
+        counts[COUNT_CORRECT]++;
+
+      if(dist > 0)
+        counts[line->label > 0 ? COUNT_TRUE_POSITIVES : COUNT_FALSE_POSITIVES]++;
+      else
+        counts[line->label > 0 ? COUNT_FALSE_NEGATIVES : COUNT_TRUE_NEGATIVES]++;
+    }
+  }
+
+  return 0;
+}
+
+static int
+job_stopped(CLASSIFY_FILE_JOB *job){
+  return job->interrupted || job->failed || job->write_errno;
+}
+
+/* Writes every finished chunk that is next in line, call it holding lock */
+static void
+write_finished_chunks(CLASSIFY_FILE_JOB *job){
+  FILE_CHUNK *chunk;
+#ifdef HAVE_SYS_MMAN_H
+  long page = sysconf(_SC_PAGESIZE);
+  size_t from, to;
+#endif
+
+  while(job->written < job->claimed && (chunk = &job->slots[job->written % job->nslots])->done){
+    if(!job->failed && !job->write_errno && chunk->out_len > 0 &&
+       fwrite(chunk->out, 1, chunk->out_len, job->out) != chunk->out_len)
+      job->write_errno = errno ? errno : EIO;
+
+#ifdef HAVE_SYS_MMAN_H
+    // The pages of the input are clean, the kernel reads them again if they are needed
+    if(job->buf.mapped && page > 0){
+      from = (chunk->start + page - 1) / page * page;
+      to   = chunk->end / page * page;
+
+      if(to > from)
+        madvise(job->buf.data + from, to - from, MADV_DONTNEED);
+    }
+#endif
+
+    chunk->done = 0;
+    job->written++;
+  }
+}
+
+static void *
+classify_file_worker(void *ptr){
+  CLASSIFY_FILE_JOB *job = (CLASSIFY_FILE_JOB *)ptr;
+  PARSED_LINE line;
+  FILE_CHUNK *chunk;
+  long counts[COUNTS], i;
+  char error[300];
+  size_t error_pos, end;
+  const char *eol;
+  int failed;
+
+  parsed_line_init(&line);
+
+  for(;;){
+    pthread_mutex_lock(&job->lock);
+
+    while(!job_stopped(job) && job->claim_pos < job->buf.len &&
+          job->claimed >= job->written + job->nslots)
+      pthread_cond_wait(&job->cond, &job->lock);
+
+    if(job_stopped(job) || job->claim_pos >= job->buf.len){
+      pthread_mutex_unlock(&job->lock);
+      break;
+    }
+
+    end = job->claim_pos + job->chunk_size;
+
+    if(end >= job->buf.len)
+      end = job->buf.len;
+    else if((eol = memchr(job->buf.data + end, '\n', job->buf.len - end)))
+      end = eol - job->buf.data + 1;
+    else
+      end = job->buf.len;
+
+    chunk = &job->slots[job->claimed % job->nslots];
+    chunk->start   = job->claim_pos;
+    chunk->end     = end;
+    chunk->out_len = 0;
+    job->claim_pos = end;
+    job->claimed++;
+
+    pthread_mutex_unlock(&job->lock);
+
+    memset(counts, 0, sizeof(counts));
+    failed = classify_chunk(job, chunk, &line, counts, error, &error_pos);
+
+    pthread_mutex_lock(&job->lock);
+
+    // Report the first bad line of the file, not the first one found
+    if(failed && (!job->failed || error_pos < job->error_pos)){
+      memcpy(job->error, error, sizeof(error));
+      job->error_pos = error_pos;
+      job->failed    = 1;
+    }
+
+    for(i = 0; i < COUNTS; i++)
+      job->counts[i] += counts[i];
+
+    chunk->done = 1;
+    write_finished_chunks(job);
+    pthread_cond_broadcast(&job->cond);
+
+    pthread_mutex_unlock(&job->lock);
+  }
+
+  parsed_line_free(&line);
+
+  return NULL;
+}
+
+/* Runs the workers until the file is done or the job is interrupted, the calling thread
+ * is one of them */
+static void *
+classify_file_nogvl(void *ptr){
+  CLASSIFY_FILE_JOB *job = (CLASSIFY_FILE_JOB *)ptr;
+  pthread_t threads[CLASSIFY_FILE_MAX_THREADS];
+  int started[CLASSIFY_FILE_MAX_THREADS];
+  long i;
+
+  for(i = 1; i < job->nthreads; i++)
+    started[i] = pthread_create(&threads[i], NULL, classify_file_worker, job) == 0;
+
+  classify_file_worker(job);
+
+  for(i = 1; i < job->nthreads; i++){
+    if(started[i])
+      pthread_join(threads[i], NULL);
+  }
+
+  return NULL;
+}
+
+/* Unblocking function, workers finish the chunk they have and stop, waiting ones wake up */
+static void
+classify_file_ubf(void *ptr){
+  CLASSIFY_FILE_JOB *job = (CLASSIFY_FILE_JOB *)ptr;
+
+  pthread_mutex_lock(&job->lock);
+  job->interrupted = 1;
+  pthread_cond_broadcast(&job->cond);
+  pthread_mutex_unlock(&job->lock);
+}
+
+/* Line number of the line starting at pos, only needed for error messages */
+static long
+line_number(const char *data, size_t pos){
+  const char *p = data, *end = data + pos;
+  long lineno = 1;
+
+  while(p < end && (p = memchr(p, '\n', end - p))){
+    lineno++;
+    p++;
+  }
+
+  return lineno;
+}
+
+static VALUE
+classify_file_body(VALUE ptr){
+  CLASSIFY_FILE_JOB *job = (CLASSIFY_FILE_JOB *)ptr;
+  VALUE result;
+  long i;
+
+  while(!job->failed && !job->write_errno && job->claim_pos < job->buf.len){
+    job->interrupted = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(classify_file_nogvl, job, classify_file_ubf, job);
+#else
+    classify_file_nogvl(job);
+#endif
+    // Raises on Thread#raise, timeouts, etc., the workers carry on from where they
+    // stopped otherwise
+    if(!job->failed && !job->write_errno && job->claim_pos < job->buf.len)
+      rb_thread_check_ints();
+  }
+
+  if(job->failed)
+    rb_raise(rb_eArgError, "%s line %ld: %s", StringValueCStr(job->input_path),
+             line_number(job->buf.data, job->error_pos), job->error);
+
+  if(job->write_errno || fflush(job->out) != 0)
+    rb_syserr_fail(job->write_errno ? job->write_errno : errno, "Cannot write the predictions");
+
+  result = rb_ary_new2(COUNTS);
+  for(i = 0; i < COUNTS; i++)
+    rb_ary_push(result, LONG2NUM(job->counts[i]));
+
+  return result;
+}
+
+static VALUE
+classify_file_cleanup(VALUE ptr){
+  CLASSIFY_FILE_JOB *job = (CLASSIFY_FILE_JOB *)ptr;
+  long i;
+
+  for(i = 0; i < job->nslots; i++)
+    free(job->slots[i].out);
+
+  free(job->slots);
+  fclose(job->out);
+  text_buffer_close(&job->buf);
+  pthread_cond_destroy(&job->cond);
+  pthread_mutex_destroy(&job->lock);
+
+  return Qnil;
+}
+
+/* Scores every example in input_path and writes a prediction per line to output_path, see
+ * Model#classify_file
+ * @param [String] input_path
+ * @param [String] output_path
+ * @param [Fixnum] threads 0 for the number of online CPUs
+ * @param [Fixnum] chunk_size bytes of input per chunk, 0 for CLASSIFY_FILE_CHUNK
+ * @return [Array] documents, labeled, correct, true positives, false positives, false
+ * negatives and true negatives
+ */
+static VALUE
+model_classify_path(VALUE self, VALUE input_path, VALUE output_path, VALUE threads,
+                    VALUE chunk_size){
+  CLASSIFY_FILE_JOB job;
+  VALUE result;
+  double start = 0;
+  int err, counted;
+
+  memset(&job, 0, sizeof(job));
+  job.rm = model_get(self);
+
+  FilePathValue(input_path);
+  FilePathValue(output_path);
+  Check_Type(threads, T_FIXNUM);
+  Check_Type(chunk_size, T_FIXNUM);
+
+  job.input_path = input_path;
+  job.chunk_size = FIX2LONG(chunk_size) > 0 ? (size_t)FIX2LONG(chunk_size) : CLASSIFY_FILE_CHUNK;
+  job.nthreads   = FIX2LONG(threads) > 0 ? FIX2LONG(threads) : sysconf(_SC_NPROCESSORS_ONLN);
+
+  if(job.nthreads < 1)
+    job.nthreads = 1;
+  if(job.nthreads > CLASSIFY_FILE_MAX_THREADS)
+    job.nthreads = CLASSIFY_FILE_MAX_THREADS;
+
+  if((err = text_buffer_open(StringValueCStr(input_path), &job.buf)) != 0)
+    rb_syserr_fail_str(err, input_path);
+
+  if(!(job.out = fopen(StringValueCStr(output_path), "w"))){
+    err = errno;
+    text_buffer_close(&job.buf);
+    rb_syserr_fail_str(err, output_path);
+  }
+
+  job.nslots = job.nthreads * CLASSIFY_FILE_SLOTS_PER_THREAD;
+  job.slots  = (FILE_CHUNK *)my_malloc(sizeof(FILE_CHUNK) * job.nslots);
+  memset(job.slots, 0, sizeof(FILE_CHUNK) * job.nslots);
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.cond, NULL);
+
+  if((counted = job.rm->inference != NULL))
+    start = stats_now();
+
+  result = rb_ensure(classify_file_body, (VALUE)&job, classify_file_cleanup, (VALUE)&job);
+
+  if(counted)
+    inference_stats_record(job.rm, job.counts[COUNT_DOCUMENTS], stats_now() - start);
+
+  RB_GC_GUARD(input_path);
+  return result;
+}
+
+void
+Init_svmredlight_classify_file(){
+  rb_define_private_method(rb_cModel, "classify_path", model_classify_path, 4);
+}
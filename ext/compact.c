@@ -0,0 +1,279 @@
+#include "svmredlight.h"
+#include "string.h"
+#include <math.h>
+
+/* Compact linear models. A linear model only needs its weight vector to score documents,
+ * Model#compact keeps just that, quantized to floats or to 8 bit integers times a scale,
+ * and drops the support vectors. Weights under prune_below are dropped as well, and when
+ * enough of them are the rest are stored sparse, as increasing feature numbers plus
+ * values, which are looked up by binary search.
+ *
+ * max_error is the largest difference between a full precision weight and what is
+ * stored for it, so the score of a document x is off by at most max_error * |x|_1. */
+
+static const char *
+precision_name(int precision){
+  return precision == COMPACT_INT8 ? "int8" : "float32";
+}
+
+static size_t
+value_size(int precision){
+  return precision == COMPACT_INT8 ? sizeof(int8_t) : sizeof(float);
+}
+
+static double
+stored_weight(const COMPACT_WEIGHTS *c, long i){
+  if(c->precision == COMPACT_INT8)
+    return ((const int8_t *)c->values)[i] * c->scale;
+
+  return ((const float *)c->values)[i];
+}
+
+/* Position of feature wnum in the sparse indices, starting the search at *from (words
+ * come in increasing order so each search starts where the last one ended), -1 when it
+ * is not stored */
+static long
+sparse_find(const COMPACT_WEIGHTS *c, FNUM wnum, long *from){
+  long lo = *from, hi = c->nnz;
+
+  while(lo < hi){
+    long mid = lo + (hi - lo) / 2;
+
+    if(c->indices[mid] < wnum)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  *from = lo;
+
+  return lo < c->nnz && c->indices[lo] == wnum ? lo : -1;
+}
+
+static double
+compact_dot(const COMPACT_WEIGHTS *c, const WORD *words){
+  double sum = 0.0;
+  long n, i, from = 0;
+
+  if(!c->indices){
+    if(c->precision == COMPACT_INT8){
+      const int8_t *v = (const int8_t *)c->values;
+
+      for(n = 0; words[n].wnum; n++){
+        if(words[n].wnum < c->len)
+          sum += v[words[n].wnum] * (double)words[n].weight;
+      }
+
+      return sum * c->scale;
+    }else{
+      const float *v = (const float *)c->values;
+
+      for(n = 0; words[n].wnum; n++){
+        if(words[n].wnum < c->len)
+          sum += v[words[n].wnum] * (double)words[n].weight;
+      }
+
+      return sum;
+    }
+  }
+
+  for(n = 0; words[n].wnum; n++){
+    if((i = sparse_find(c, words[n].wnum, &from)) >= 0)
+      sum += stored_weight(c, i) * words[n].weight;
+  }
+
+  return sum;
+}
+
+double
+compact_classify(RMODEL *rm, DOC *ex){
+  SVECTOR *f;
+  double sum = 0.0;
+
+  for(f = ex->fvec; f; f = f->next)
+    sum += f->factor * compact_dot(rm->compact, f->words);
+
+  return sum - rm->m->b;
+}
+
+size_t
+compact_bytes(const COMPACT_WEIGHTS *c){
+  return c->nnz * value_size(c->precision) + (c->indices ? c->nnz * sizeof(int32_t) : 0);
+}
+
+/* Fills the c->len doubles of w with the stored weights */
+void
+compact_expand(const COMPACT_WEIGHTS *c, double *w){
+  long i;
+
+  if(c->indices){
+    memset(w, 0, sizeof(double) * c->len);
+
+    for(i = 0; i < c->nnz; i++)
+      w[c->indices[i]] = stored_weight(c, i);
+  }else{
+    for(i = 0; i < c->len; i++)
+      w[i] = stored_weight(c, i);
+  }
+}
+
+void
+compact_free(RMODEL *rm){
+  COMPACT_WEIGHTS *c = rm->compact;
+
+  if(!c)
+    return;
+
+  // Compact models loaded from a binary file point into the mapping
+  if(c->owned){
+    free(c->indices);
+    free(c->values);
+  }
+
+  free(c);
+  rm->compact = NULL;
+}
+
+/* Builds the compact weights out of the dense weight vector w */
+static COMPACT_WEIGHTS *
+compact_weights_new(const double *w, long len, int precision, double prune_below){
+  COMPACT_WEIGHTS *c;
+  double max_abs = 0.0, error;
+  long i, n, nnz = 0;
+  int kept;
+
+  for(i = 1; i < len; i++){
+    if(fabs(w[i]) > max_abs)
+      max_abs = fabs(w[i]);
+
+    if(w[i] != 0.0 && fabs(w[i]) >= prune_below)
+      nnz++;
+  }
+
+  c = (COMPACT_WEIGHTS *)my_malloc(sizeof(COMPACT_WEIGHTS));
+  memset(c, 0, sizeof(COMPACT_WEIGHTS));
+  c->precision = precision;
+  c->len       = len;
+  c->owned     = 1;
+  c->scale     = precision == COMPACT_INT8 && max_abs > 0 ? max_abs / 127 : 1.0;
+
+  // Sparse only pays off when the index is smaller than the pruned values
+  if(nnz * (sizeof(int32_t) + value_size(precision)) < len * value_size(precision)){
+    c->nnz     = nnz;
+    c->indices = (int32_t *)my_malloc(sizeof(int32_t) * (nnz + 1));
+  }else{
+    c->nnz     = len;
+  }
+
+  c->values = my_malloc(value_size(precision) * (c->nnz + 1));
+
+  for(i = 0, n = 0; i < len; i++){
+    kept = i > 0 && w[i] != 0.0 && fabs(w[i]) >= prune_below;
+
+    if(c->indices && !kept){
+      error = fabs(w[i]);
+    }else{
+      // Pruned weights of dense models are stored as 0
+      if(c->indices)
+        c->indices[n] = (int32_t)i;
+
+      if(precision == COMPACT_INT8)
+        ((int8_t *)c->values)[n] = kept ? (int8_t)lround(w[i] / c->scale) : 0;
+      else
+        ((float *)c->values)[n] = kept ? (float)w[i] : 0.0f;
+
+      error = fabs(w[i] - stored_weight(c, n));
+      n++;
+    }
+
+    if(i > 0 && error > c->max_error)
+      c->max_error = error;
+  }
+
+  return c;
+}
+
+/* A compact copy of this linear model, see Model#compact
+ * @param [Symbol] precision :float32 or :int8
+ * @param [Float] prune_below weights whose absolute value is under this are dropped
+ * @return [Model]
+ */
+static VALUE
+model_compact_weights(VALUE self, VALUE precision, VALUE prune_below){
+  RMODEL *rm = model_get(self), *compact;
+  MODEL *m = rm->m, *cm;
+  int c_precision;
+
+  if(!SYMBOL_P(precision))
+    rb_raise(rb_eArgError, "precision must be :float32 or :int8");
+
+  if(SYM2ID(precision) == rb_intern("float32"))
+    c_precision = COMPACT_FLOAT32;
+  else if(SYM2ID(precision) == rb_intern("int8"))
+    c_precision = COMPACT_INT8;
+  else
+    rb_raise(rb_eArgError, "precision must be :float32 or :int8");
+
+  if(rm->compact)
+    rb_raise(rb_eArgError, "The model is already compact");
+
+  if(!rm->linear)
+    rb_raise(rb_eArgError, "Only linear models can be made compact");
+
+  if(NUM2DBL(prune_below) < 0)
+    rb_raise(rb_eArgError, "prune_below cannot be negative");
+
+  online_fold(rm);
+
+  // Everything but the support vectors, SVM-light's free_model is fine with the NULLs
+  cm = (MODEL *)my_malloc(sizeof(MODEL));
+  memset(cm, 0, sizeof(MODEL));
+  cm->kernel_parm    = m->kernel_parm;
+  cm->totwords       = m->totwords;
+  cm->totdoc         = m->totdoc;
+  cm->sv_num         = 1;
+  cm->b              = m->b;
+  cm->maxdiff        = m->maxdiff;
+  cm->loo_error      = m->loo_error;
+  cm->loo_recall     = m->loo_recall;
+  cm->loo_precision  = m->loo_precision;
+  cm->xa_error       = m->xa_error;
+  cm->xa_recall      = m->xa_recall;
+  cm->xa_precision   = m->xa_precision;
+
+  compact = rmodel_new(cm);
+  compact->compact = compact_weights_new(m->lin_weights, m->totwords + 1, c_precision,
+                                         NUM2DBL(prune_below));
+
+  return model_wrap(rb_obj_class(self), compact);
+}
+
+/* How the weights of a compact model are stored, nil for other models. bytes is the
+ * size of the stored weights, max_weight_error the largest difference between a stored
+ * weight and the full precision one.
+ * @return [Hash|Nil]
+ */
+static VALUE
+model_compact_info(VALUE self){
+  COMPACT_WEIGHTS *c = model_get(self)->compact;
+  VALUE result;
+
+  if(!c)
+    return Qnil;
+
+  result = rb_hash_new();
+  rb_hash_aset(result, ID2SYM(rb_intern("precision")), ID2SYM(rb_intern(precision_name(c->precision))));
+  rb_hash_aset(result, ID2SYM(rb_intern("sparse")), c->indices ? Qtrue : Qfalse);
+  rb_hash_aset(result, ID2SYM(rb_intern("stored_weights")), LONG2NUM(c->nnz));
+  rb_hash_aset(result, ID2SYM(rb_intern("bytes")), SIZET2NUM(compact_bytes(c)));
+  rb_hash_aset(result, ID2SYM(rb_intern("scale")), DBL2NUM(c->scale));
+  rb_hash_aset(result, ID2SYM(rb_intern("max_weight_error")), DBL2NUM(c->max_error));
+
+  return result;
+}
+
+void
+Init_svmredlight_compact(){
+  rb_define_private_method(rb_cModel, "compact_weights", model_compact_weights, 2);
+  rb_define_method(rb_cModel, "compact_info", model_compact_info, 0);
+}
@@ -0,0 +1,337 @@
+#include "svmredlight.h"
+#include "string.h"
+#include <pthread.h>
+#include <unistd.h>
+
+/* k-fold cross validation over a grid of learn/kernel params. Every (params, fold) pair
+ * is a job, jobs are picked up by a pool of native threads running without the GVL.
+ * Folds are interleaved, document i is tested in fold i % folds, and the training set of
+ * a job is an array of pointers to the same DOCs, nothing is copied.
+ *
+ * SVM-light's solver is not reentrant, so the svm_learn_classification calls still run
+ * one at a time (see train_classification), the pool overlaps them with setting up and
+ * scoring the other jobs. Configurations trained with the dual_cd solver run fully in
+ * parallel. */
+
+#define CV_MAX_THREADS 256
+
+typedef struct cv_job {
+  long        config;
+  long        fold;
+  LEARN_PARM  learn_param;
+  long        true_positives;
+  long        false_positives;
+  long        true_negatives;
+  long        false_negatives;
+  long        support_vectors;
+  double      train_time;
+  double      test_time;
+  int         done;
+} CV_JOB;
+
+typedef struct cv_args {
+  DOC          **docs;
+  double       *labels;
+  VALUE        r_docs;
+  long         totdocs;
+  long         totwords;
+  long         folds;
+  LEARN_PARM   *learn_params;
+  KERNEL_PARM  *kernel_params;
+  int          *solvers;
+  CV_JOB       *jobs;
+  long         njobs;
+  long         next;
+  long         nthreads;
+  pthread_mutex_t lock;
+  volatile int cancelled;
+} CV_ARGS;
+
+static double
+cv_score(MODEL *m, DOC *d){
+  if(m->kernel_parm.kernel_type == LINEAR){
+    if(!m->lin_weights)
+      add_weight_vector_to_linear_model(m);
+
+    return classify_example_linear(m, d);
+  }
+
+  return classify_example(m, d);
+}
+
+static void
+cv_run_job(CV_ARGS *args, CV_JOB *job){
+  DOC **train_docs;
+  double *train_labels, start, score;
+  long i, n = 0;
+  MODEL *m;
+
+  train_docs   = (DOC **)my_malloc(sizeof(DOC *) * args->totdocs);
+  train_labels = (double *)my_malloc(sizeof(double) * args->totdocs);
+
+  for(i = 0; i < args->totdocs; i++){
+    if(i % args->folds != job->fold){
+      train_docs[n]   = args->docs[i];
+      train_labels[n] = args->labels[i];
+      n++;
+    }
+  }
+
+  start = stats_now();
+  m = train_classification(train_docs, train_labels, n, args->totwords, &job->learn_param,
+                           &args->kernel_params[job->config], args->solvers[job->config],
+                           NULL, NULL, &args->cancelled);
+  job->train_time = stats_now() - start;
+
+  // m is NULL when cancelled while waiting for SVM-light's solver
+  if(m && !args->cancelled){
+    start = stats_now();
+    job->true_positives = job->false_positives = job->true_negatives = job->false_negatives = 0;
+
+    for(i = job->fold; i < args->totdocs; i += args->folds){
+      score = cv_score(m, args->docs[i]);
+
+      if(args->labels[i] > 0){
+        if(score > 0)
+          job->true_positives++;
+        else
+          job->false_negatives++;
+      }else{
+        if(score > 0)
+          job->false_positives++;
+        else
+          job->true_negatives++;
+      }
+    }
+
+    job->test_time       = stats_now() - start;
+    job->support_vectors = m->sv_num - 1;
+    job->done            = 1;
+  }
+
+  if(m)
+    free_model(m, 0);
+
+  free(train_docs);
+  free(train_labels);
+}
+
+static void *
+cv_worker(void *ptr){
+  CV_ARGS *args = (CV_ARGS *)ptr;
+  CV_JOB *job;
+
+  for(;;){
+    pthread_mutex_lock(&args->lock);
+
+    while(args->next < args->njobs && args->jobs[args->next].done)
+      args->next++;
+
+    job = args->next < args->njobs && !args->cancelled ? &args->jobs[args->next++] : NULL;
+
+    pthread_mutex_unlock(&args->lock);
+
+    if(!job)
+      return NULL;
+
+    cv_run_job(args, job);
+  }
+}
+
+static void *
+cross_validate_nogvl(void *ptr){
+  CV_ARGS *args = (CV_ARGS *)ptr;
+  pthread_t threads[CV_MAX_THREADS];
+  int started[CV_MAX_THREADS];
+  long i;
+
+  for(i = 1; i < args->nthreads; i++)
+    started[i] = pthread_create(&threads[i], NULL, cv_worker, args) == 0;
+
+  // The calling thread works too, the jobs of threads that could not be started are
+  // simply picked up by the others
+  cv_worker(args);
+
+  for(i = 1; i < args->nthreads; i++){
+    if(started[i])
+      pthread_join(threads[i], NULL);
+  }
+
+  return NULL;
+}
+
+/* Unblocking function, trainings in progress stop on their next iteration (see
+ * learn_classification_ubf) and no new job is started */
+static void
+cross_validate_ubf(void *ptr){
+  CV_ARGS *args = (CV_ARGS *)ptr;
+  long i;
+
+  args->cancelled = 1;
+
+  for(i = 0; i < args->njobs; i++)
+    args->jobs[i].learn_param.maxiter = -1;
+
+  solver_interrupt();
+}
+
+static VALUE
+cv_job_result(CV_JOB *job){
+  VALUE result = rb_hash_new();
+
+  rb_hash_aset(result, ID2SYM(rb_intern("config")), LONG2NUM(job->config));
+  rb_hash_aset(result, ID2SYM(rb_intern("fold")), LONG2NUM(job->fold));
+  rb_hash_aset(result, ID2SYM(rb_intern("true_positives")), LONG2NUM(job->true_positives));
+  rb_hash_aset(result, ID2SYM(rb_intern("false_positives")), LONG2NUM(job->false_positives));
+  rb_hash_aset(result, ID2SYM(rb_intern("true_negatives")), LONG2NUM(job->true_negatives));
+  rb_hash_aset(result, ID2SYM(rb_intern("false_negatives")), LONG2NUM(job->false_negatives));
+  rb_hash_aset(result, ID2SYM(rb_intern("support_vectors")), LONG2NUM(job->support_vectors));
+  rb_hash_aset(result, ID2SYM(rb_intern("train_time")), DBL2NUM(job->train_time));
+  rb_hash_aset(result, ID2SYM(rb_intern("test_time")), DBL2NUM(job->test_time));
+
+  return result;
+}
+
+static VALUE
+cross_validate_body(VALUE ptr){
+  CV_ARGS *args = (CV_ARGS *)ptr;
+  VALUE result;
+  long i;
+
+  for(;;){
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(cross_validate_nogvl, args, cross_validate_ubf, args);
+#else
+    cross_validate_nogvl(args);
+#endif
+    if(!args->cancelled)
+      break;
+
+    // Raises on Thread#raise, timeouts, etc. otherwise the unfinished jobs are run again
+    rb_thread_check_ints();
+
+    args->cancelled = 0;
+    args->next      = 0;
+
+    for(i = 0; i < args->njobs; i++)
+      args->jobs[i].learn_param.maxiter = args->learn_params[args->jobs[i].config].maxiter;
+  }
+
+  result = rb_ary_new2(args->njobs);
+  for(i = 0; i < args->njobs; i++)
+    rb_ary_push(result, cv_job_result(&args->jobs[i]));
+
+  return result;
+}
+
+static VALUE
+cross_validate_cleanup(VALUE ptr){
+  CV_ARGS *args = (CV_ARGS *)ptr;
+
+  pthread_mutex_destroy(&args->lock);
+  training_documents_release(args->r_docs, args->docs, args->labels);
+  free(args->learn_params);
+  free(args->kernel_params);
+  free(args->solvers);
+  free(args->jobs);
+
+  return Qnil;
+}
+
+/* Cross validates every configuration, see Model.cross_validate
+ * @param [Array|DocumentSet] r_docs_and_classes same as for learn_classification
+ * @param [Fixnum] folds
+ * @param [Array] learn_params one learn params Hash per configuration
+ * @param [Array] kernel_params one kernel params Hash per configuration
+ * @param [Fixnum] threads size of the pool, 0 uses the number of online CPUs
+ * @return [Array] one Hash per (configuration, fold) with the confusion counts and times
+ */
+static VALUE
+model_cross_validation(VALUE klass, VALUE r_docs_and_classes, VALUE folds, VALUE learn_params,
+                       VALUE kernel_params, VALUE threads){
+  CV_ARGS args;
+  VALUE r_docs, result;
+  long nconfigs, i;
+  char error_msg[300];
+
+  Check_Type(learn_params, T_ARRAY);
+  Check_Type(kernel_params, T_ARRAY);
+  Check_Type(folds, T_FIXNUM);
+  Check_Type(threads, T_FIXNUM);
+
+  nconfigs = RARRAY_LEN(learn_params);
+
+  if(nconfigs == 0 || nconfigs != RARRAY_LEN(kernel_params))
+    rb_raise(rb_eArgError, "There must be one learn and one kernel params hash per configuration");
+
+  for(i = 0; i < nconfigs; i++){
+    Check_Type(RARRAY_PTR(learn_params)[i], T_HASH);
+    Check_Type(RARRAY_PTR(kernel_params)[i], T_HASH);
+  }
+
+  memset(&args, 0, sizeof(CV_ARGS));
+  args.folds    = FIX2LONG(folds);
+  args.nthreads = FIX2LONG(threads) > 0 ? FIX2LONG(threads) : sysconf(_SC_NPROCESSORS_ONLN);
+
+  if(args.nthreads < 1)
+    args.nthreads = 1;
+  if(args.nthreads > CV_MAX_THREADS)
+    args.nthreads = CV_MAX_THREADS;
+
+  if(args.folds < 2)
+    rb_raise(rb_eArgError, "At least 2 folds are needed: %ld", args.folds);
+
+  args.learn_params  = (LEARN_PARM *)my_malloc(sizeof(LEARN_PARM) * nconfigs);
+  args.kernel_params = (KERNEL_PARM *)my_malloc(sizeof(KERNEL_PARM) * nconfigs);
+  args.solvers       = (int *)my_malloc(sizeof(int) * nconfigs);
+
+  for(i = 0; i < nconfigs; i++){
+    if(training_params(RARRAY_PTR(learn_params)[i], RARRAY_PTR(kernel_params)[i],
+                       &args.learn_params[i], &args.kernel_params[i], &args.solvers[i],
+                       error_msg) != 0)
+      goto bail;
+  }
+
+  if(training_documents(r_docs_and_classes, &args.docs, &args.labels, &args.totdocs,
+                        &args.totwords, &r_docs, error_msg) != 0)
+    goto bail;
+
+  args.r_docs = r_docs;
+
+  if(args.folds > args.totdocs){
+    training_documents_release(r_docs, args.docs, args.labels);
+    snprintf(error_msg, 300, "Cannot make %ld folds out of %ld documents", args.folds, args.totdocs);
+    goto bail;
+  }
+
+  args.njobs = nconfigs * args.folds;
+  args.jobs  = (CV_JOB *)my_malloc(sizeof(CV_JOB) * args.njobs);
+  memset(args.jobs, 0, sizeof(CV_JOB) * args.njobs);
+
+  for(i = 0; i < args.njobs; i++){
+    args.jobs[i].config      = i / args.folds;
+    args.jobs[i].fold        = i % args.folds;
+    args.jobs[i].learn_param = args.learn_params[i / args.folds];
+  }
+
+  if(args.nthreads > args.njobs)
+    args.nthreads = args.njobs;
+
+  pthread_mutex_init(&args.lock, NULL);
+
+  result = rb_ensure(cross_validate_body, (VALUE)&args, cross_validate_cleanup, (VALUE)&args);
+  RB_GC_GUARD(r_docs);
+
+  return result;
+
+bail:
+  free(args.learn_params);
+  free(args.kernel_params);
+  free(args.solvers);
+  rb_raise(rb_eArgError, "%s", error_msg);
+}
+
+void
+Init_svmredlight_cross_validation(){
+  rb_define_singleton_method(rb_cModel, "cross_validation", model_cross_validation, 5);
+}
@@ -0,0 +1,645 @@
+#include "svmredlight.h"
+#include "string.h"
+#include <stdint.h>
+
+/* A DocumentSet keeps a whole training corpus in a handful of big buffers instead of one
+ * ruby object (and three mallocs) per document:
+
+     chunks  DOCUMENT_SET_CHUNK DOC+SVECTOR headers each, never moved once allocated
+     blocks  the words of the documents, each list 0 terminated, a block holds at least
+             DOCUMENT_SET_BLOCK words
+     labels  one per document
+
+ * Headers and words never move, so training can use them in place. Documents can only
+ * be appended, and clear refuses to free the buffers while a training uses them. */
+#define DOCUMENT_SET_CHUNK 4096
+#define DOCUMENT_SET_BLOCK (1 << 20)
+
+typedef struct set_doc {
+  DOC     doc;
+  SVECTOR vec;
+} SET_DOC;
+
+typedef struct document_set {
+  long    n;
+  long    totwords;
+  long    nwords;
+  SET_DOC **chunks;
+  long    chunks_capacity;
+  double  *labels;
+  long    labels_capacity;
+  WORD    **blocks;
+  long    nblocks;
+  long    blocks_capacity;
+  long    block_used;
+  long    block_size;
+  long    words_capacity;
+  long    memsize;  // what memory.c was last told, see document_set_memory_sync
+  long    trainings; // trainings using the buffers, updated atomically (frozen sets are shared)
+} DOCUMENT_SET;
+
+VALUE rb_cDocumentSet;
+
+// create_svector, used when documents are copied, expects a string
+static char empty_userdefined[] = "";
+
+/* Frees every buffer, the set is empty afterwards */
+static void
+document_set_release(DOCUMENT_SET *set){
+  long i, memsize = set->memsize;
+
+  for(i = 0; i * DOCUMENT_SET_CHUNK < set->n; i++)
+    free(set->chunks[i]);
+
+  for(i = 0; i < set->nblocks; i++)
+    free(set->blocks[i]);
+
+  free(set->chunks);
+  free(set->blocks);
+  free(set->labels);
+  memset(set, 0, sizeof(DOCUMENT_SET));
+  set->memsize = memsize;
+}
+
+/* Bytes held by the set's buffers */
+static long
+document_set_bytes(const DOCUMENT_SET *set){
+  long chunks = (set->n + DOCUMENT_SET_CHUNK - 1) / DOCUMENT_SET_CHUNK;
+
+  return sizeof(DOCUMENT_SET) + chunks * DOCUMENT_SET_CHUNK * sizeof(SET_DOC) +
+         set->labels_capacity * sizeof(double) + set->words_capacity * sizeof(WORD);
+}
+
+/* Tells memory.c (and the GC) how much the set holds now, buffers grow in big steps so
+ * most calls have nothing to report */
+static void
+document_set_memory_sync(DOCUMENT_SET *set){
+  long memsize = document_set_bytes(set);
+
+  if(memsize != set->memsize){
+    memory_adjust(MEMORY_DOCUMENT_SETS, 0, memsize - set->memsize);
+    set->memsize = memsize;
+  }
+}
+
+static void
+document_set_free(DOCUMENT_SET *set){
+  document_set_release(set);
+  free(set);
+}
+
+static void
+document_set_dfree(void *ptr){
+  if(ptr)
+    memory_adjust(MEMORY_DOCUMENT_SETS, -1, -((DOCUMENT_SET *)ptr)->memsize);
+
+  document_set_free((DOCUMENT_SET *)ptr);
+}
+
+static size_t
+document_set_dsize(const void *ptr){
+  return ptr ? document_set_bytes((const DOCUMENT_SET *)ptr) : 0;
+}
+
+/* add, append_packed and clear check that the set is not frozen, a frozen set can be
+ * trained on from any Ractor */
+static const rb_data_type_t document_set_data_type = {
+  "SVMLight::DocumentSet",
+  {0, document_set_dfree, document_set_dsize},
+  0, 0,
+  SVMREDLIGHT_TYPED_FLAGS
+};
+
+static DOCUMENT_SET *
+document_set_get(VALUE self){
+  DOCUMENT_SET *set;
+  TypedData_Get_Struct(self, DOCUMENT_SET, &document_set_data_type, set);
+
+  return set;
+}
+
+static SET_DOC *
+document_set_at(DOCUMENT_SET *set, long i){
+  return &set->chunks[i / DOCUMENT_SET_CHUNK][i % DOCUMENT_SET_CHUNK];
+}
+
+/* Room for n words, plus the terminator, in the current block or in a new one, NULL
+ * when out of memory. Nothing here raises so sets can be filled without the GVL */
+static WORD *
+document_set_words(DOCUMENT_SET *set, long n){
+  WORD *words, **blocks;
+
+  if(set->nblocks == 0 || set->block_used + n + 1 > set->block_size){
+    if(set->nblocks == set->blocks_capacity){
+      blocks = (WORD **)realloc(set->blocks, sizeof(WORD *) *
+                                (set->blocks_capacity ? set->blocks_capacity * 2 : 16));
+      if(!blocks)
+        return NULL;
+
+      set->blocks          = blocks;
+      set->blocks_capacity = set->blocks_capacity ? set->blocks_capacity * 2 : 16;
+    }
+
+    if(!(set->blocks[set->nblocks] = (WORD *)malloc(sizeof(WORD) * (n + 1 > DOCUMENT_SET_BLOCK ?
+                                                                     n + 1 : DOCUMENT_SET_BLOCK))))
+      return NULL;
+
+    set->block_size = n + 1 > DOCUMENT_SET_BLOCK ? n + 1 : DOCUMENT_SET_BLOCK;
+    set->block_used = 0;
+    set->nblocks++;
+    set->words_capacity += set->block_size;
+  }
+
+  words = set->blocks[set->nblocks - 1] + set->block_used;
+  set->block_used += n + 1;
+
+  return words;
+}
+
+/* Adds a document with room for n words, the caller fills entry->vec.words and then
+ * calls document_set_seal. The new document's docnum is its position, NULL when out of
+ * memory */
+static SET_DOC *
+document_set_push(DOCUMENT_SET *set, long n, double label, double costfactor, long slackid,
+                  long queryid){
+  SET_DOC *entry;
+  WORD *words;
+  long chunk = set->n / DOCUMENT_SET_CHUNK;
+
+  // Everything that can fail goes first, so a failure does not leave a half added document
+  if(!(words = document_set_words(set, n)))
+    return NULL;
+
+  if(set->n == set->labels_capacity){
+    double *labels = (double *)realloc(set->labels, sizeof(double) *
+                                       (set->labels_capacity ? set->labels_capacity * 2 : 1024));
+    if(!labels)
+      return NULL;
+
+    set->labels          = labels;
+    set->labels_capacity = set->labels_capacity ? set->labels_capacity * 2 : 1024;
+  }
+
+  if(set->n % DOCUMENT_SET_CHUNK == 0){
+    if(chunk == set->chunks_capacity){
+      SET_DOC **chunks = (SET_DOC **)realloc(set->chunks, sizeof(SET_DOC *) *
+                                             (set->chunks_capacity ? set->chunks_capacity * 2 : 16));
+      if(!chunks)
+        return NULL;
+
+      set->chunks          = chunks;
+      set->chunks_capacity = set->chunks_capacity ? set->chunks_capacity * 2 : 16;
+    }
+
+    if(!(set->chunks[chunk] = (SET_DOC *)malloc(sizeof(SET_DOC) * DOCUMENT_SET_CHUNK)))
+      return NULL;
+  }
+
+  entry = document_set_at(set, set->n);
+  entry->vec.words       = words;
+  entry->vec.userdefined = empty_userdefined;
+  entry->vec.kernel_id   = 0;
+  entry->vec.next        = NULL;
+  entry->vec.factor      = 1.0;
+
+  entry->doc.docnum     = set->n;
+  entry->doc.queryid    = queryid;
+  entry->doc.costfactor = costfactor;
+  entry->doc.slackid    = slackid;
+  entry->doc.kernelid   = set->n;
+  entry->doc.fvec       = &entry->vec;
+
+  set->labels[set->n] = label;
+  set->n++;
+
+  return entry;
+}
+
+/* Terminates the n words of entry and updates the norm and the set's counters */
+static void
+document_set_seal(DOCUMENT_SET *set, SET_DOC *entry, long n){
+  entry->vec.words[n].wnum   = 0;
+  entry->vec.words[n].weight = 0;
+  entry->vec.twonorm_sq      = sprod_ss(&entry->vec, &entry->vec);
+
+  if(n > 0 && entry->vec.words[n - 1].wnum > set->totwords)
+    set->totwords = entry->vec.words[n - 1].wnum;
+
+  set->nwords += n;
+}
+
+/* Returns 1 when out of memory */
+static int
+document_set_append(DOCUMENT_SET *set, const WORD *words, long n, double label,
+                    double costfactor, long slackid, long queryid){
+  SET_DOC *entry = document_set_push(set, n, label, costfactor, slackid, queryid);
+
+  if(!entry)
+    return 1;
+
+  memcpy(entry->vec.words, words, sizeof(WORD) * n);
+  document_set_seal(set, entry, n);
+
+  return 0;
+}
+
+/* The DOC pointers and a copy of the labels for training, both malloc'd. The set counts
+ * as being trained on until document_set_training_done is called. Returns 1 and fills
+ * error when there is nothing to train on */
+int
+document_set_training_data(VALUE self, DOC ***docs, double **labels, long *totdocs,
+                           long *totwords, char *error){
+  DOCUMENT_SET *set = document_set_get(self);
+  long i;
+
+  if(set->n == 0){
+    strncpy(error, "Cannot create Model from an empty DocumentSet", 300);
+    return 1;
+  }
+
+  *docs     = (DOC **)my_malloc(sizeof(DOC *) * set->n);
+  *labels   = (double *)my_malloc(sizeof(double) * set->n);
+  *totdocs  = set->n;
+  *totwords = set->totwords;
+
+  for(i = 0; i < set->n; i++)
+    (*docs)[i] = &document_set_at(set, i)->doc;
+
+  memcpy(*labels, set->labels, sizeof(double) * set->n);
+  __atomic_fetch_add(&set->trainings, 1, __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+/* The DOC pointers handed out by document_set_training_data are not used anymore */
+void
+document_set_training_done(VALUE self){
+  __atomic_fetch_sub(&document_set_get(self)->trainings, 1, __ATOMIC_RELAXED);
+}
+
+static VALUE
+document_set_create(VALUE klass){
+  DOCUMENT_SET *set = (DOCUMENT_SET *)my_malloc(sizeof(DOCUMENT_SET));
+  VALUE result;
+
+  memset(set, 0, sizeof(DOCUMENT_SET));
+  result = TypedData_Wrap_Struct(klass, &document_set_data_type, set);
+
+  memory_adjust(MEMORY_DOCUMENT_SETS, 1, 0);
+  document_set_memory_sync(set);
+
+  return result;
+}
+
+/* Appends a copy of a Document
+ * @param [Document] document
+ * @param [Numeric] label
+ */
+static VALUE
+document_set_add(VALUE self, VALUE document, VALUE label){
+  DOCUMENT_SET *set = document_set_get(self);
+  DOC *d;
+  long n = 0;
+
+  rb_check_frozen(self);
+
+  if(rb_obj_class(document) != rb_cDocument)
+    rb_raise(rb_eTypeError, "Only Documents can be added to a DocumentSet");
+
+  if(!(TYPE(label) == T_FLOAT || TYPE(label) == T_FIXNUM))
+    rb_raise(rb_eArgError, "Labels must be numeric");
+
+  d = document_get(document);
+
+  while(d->fvec->words[n].wnum)
+    n++;
+
+  if(document_set_append(set, d->fvec->words, n, NUM2DBL(label), d->costfactor, d->slackid,
+                         d->queryid))
+    rb_raise(rb_eNoMemError, "Cannot grow the DocumentSet");
+
+  document_set_memory_sync(set);
+
+  return self;
+}
+
+/* Appends a document out of packed native int32 feature numbers and float32 weights, see
+ * DocumentSet#add_packed */
+static VALUE
+document_set_add_packed(VALUE self, VALUE indices, VALUE weights, VALUE label, VALUE cost,
+                        VALUE slackid, VALUE queryid){
+  DOCUMENT_SET *set = document_set_get(self);
+  const int32_t *c_indices;
+  const float *c_weights;
+  SET_DOC *entry;
+  double c_label, c_cost;
+  long n, i;
+
+  rb_check_frozen(self);
+  StringValue(indices);
+  StringValue(weights);
+  Check_Type(slackid, T_FIXNUM);
+  Check_Type(queryid, T_FIXNUM);
+
+  n = RSTRING_LEN(indices) / sizeof(int32_t);
+
+  if(RSTRING_LEN(indices) % sizeof(int32_t) != 0 || RSTRING_LEN(weights) != n * (long)sizeof(float))
+    rb_raise(rb_eArgError, "indices and weights must hold the same number of int32 and float32");
+
+  c_indices = (const int32_t *)RSTRING_PTR(indices);
+  c_weights = (const float *)RSTRING_PTR(weights);
+  // Converted before anything is added, NUM2DBL can raise
+  c_label   = NUM2DBL(label);
+  c_cost    = NUM2DBL(cost);
+
+  for(i = 0; i < n; i++){
+    if(c_indices[i] <= (i > 0 ? c_indices[i - 1] : 0))
+      rb_raise(rb_eArgError, "Feature numbers must be greater than zero and increasing, "
+               "found %d at position %ld", c_indices[i], i);
+  }
+
+  if(!(entry = document_set_push(set, n, c_label, c_cost, FIX2LONG(slackid), FIX2LONG(queryid))))
+    rb_raise(rb_eNoMemError, "Cannot grow the DocumentSet");
+
+  for(i = 0; i < n; i++){
+    entry->vec.words[i].wnum   = c_indices[i];
+    entry->vec.words[i].weight = (FVAL)c_weights[i];
+  }
+
+  document_set_seal(set, entry, n);
+  document_set_memory_sync(set);
+
+  return self;
+}
+
+static VALUE
+document_set_size(VALUE self){
+  return LONG2NUM(document_set_get(self)->n);
+}
+
+/* Highest feature number in the set */
+static VALUE
+document_set_total_words(VALUE self){
+  return LONG2NUM(document_set_get(self)->totwords);
+}
+
+static VALUE
+document_set_labels(VALUE self){
+  DOCUMENT_SET *set = document_set_get(self);
+  VALUE result = rb_ary_new2(set->n);
+  long i;
+
+  for(i = 0; i < set->n; i++)
+    rb_ary_push(result, DBL2NUM(set->labels[i]));
+
+  return result;
+}
+
+/* A Document (a copy, it can outlive the set) and the label of the i-th document */
+static VALUE
+document_set_entry(DOCUMENT_SET *set, long i){
+  DOC *d = &document_set_at(set, i)->doc;
+  DOC *copy;
+
+  copy = create_example(i, d->queryid, d->slackid, d->costfactor,
+                        create_svector(d->fvec->words, (char *)"", 1.0));
+
+  return rb_assoc_new(document_wrap(rb_cDocument, copy),
+                      DBL2NUM(set->labels[i]));
+}
+
+/* A new DocumentSet with len documents starting at start */
+static VALUE
+document_set_slice(DOCUMENT_SET *set, long start, long len){
+  VALUE result = document_set_create(rb_cDocumentSet);
+  DOCUMENT_SET *slice = document_set_get(result);
+  SET_DOC *entry;
+  long i, n;
+
+  for(i = start; i < start + len; i++){
+    entry = document_set_at(set, i);
+
+    for(n = 0; entry->vec.words[n].wnum; n++)
+      ;
+
+    if(document_set_append(slice, entry->vec.words, n, set->labels[i], entry->doc.costfactor,
+                           entry->doc.slackid, entry->doc.queryid))
+      rb_raise(rb_eNoMemError, "Cannot grow the DocumentSet");
+  }
+
+  document_set_memory_sync(slice);
+
+  return result;
+}
+
+/* set[i] returns [Document, label], set[start, length] and set[range] a new DocumentSet,
+ * documents are copied and renumbered in both cases */
+static VALUE
+document_set_aref(int argc, VALUE *argv, VALUE self){
+  DOCUMENT_SET *set = document_set_get(self);
+  long start, len;
+
+  rb_check_arity(argc, 1, 2);
+
+  if(argc == 2){
+    start = NUM2LONG(argv[0]);
+    len   = NUM2LONG(argv[1]);
+
+    if(start < 0)
+      start += set->n;
+    if(start < 0 || start > set->n || len < 0)
+      return Qnil;
+    if(start + len > set->n)
+      len = set->n - start;
+
+    return document_set_slice(set, start, len);
+  }
+
+  if(!FIXNUM_P(argv[0])){
+    switch(rb_range_beg_len(argv[0], &start, &len, set->n, 0)){
+    case Qfalse:
+      break;
+    case Qnil:
+      return Qnil;
+    default:
+      return document_set_slice(set, start, len);
+    }
+  }
+
+  start = NUM2LONG(argv[0]);
+  if(start < 0)
+    start += set->n;
+  if(start < 0 || start >= set->n)
+    return Qnil;
+
+  return document_set_entry(set, start);
+}
+
+/* Yields every document (a copy) and its label */
+static VALUE
+document_set_each(VALUE self){
+  long i;
+
+  RETURN_ENUMERATOR(self, 0, 0);
+
+  // The set can grow while iterating, just like an Array
+  for(i = 0; i < document_set_get(self)->n; i++)
+    rb_yield(document_set_entry(document_set_get(self), i));
+
+  return self;
+}
+
+/* State for filling a set from a file without the GVL, offset is where parsing stopped
+ * if it was interrupted */
+typedef struct document_set_read_args {
+  DOCUMENT_SET *set;
+  VALUE        path;
+  TEXT_BUFFER  buf;
+  PARSED_LINE  line;
+  size_t       offset;
+  long         lineno;
+  int          failed;
+  char         error[300];
+  volatile int interrupted;
+} DOCUMENT_SET_READ_ARGS;
+
+static void *
+document_set_read_nogvl(void *ptr){
+  DOCUMENT_SET_READ_ARGS *args = (DOCUMENT_SET_READ_ARGS *)ptr;
+  const char *start, *end, *limit = args->buf.data + args->buf.len;
+  int found;
+
+  while(args->offset < args->buf.len && !args->interrupted){
+    start = args->buf.data + args->offset;
+
+    if(!(end = memchr(start, '\n', limit - start)))
+      end = limit;
+
+    args->lineno++;
+    found = parse_svmlight_line(start, end, &args->line, args->error);
+
+    if(found > 0 && document_set_append(args->set, args->line.words, args->line.nwords,
+                                        args->line.label, args->line.costfactor,
+                                        args->line.slackid, args->line.queryid)){
+      strncpy(args->error, "Out of memory", 300);
+      found = -1;
+    }
+
+    if(found < 0){
+      args->failed = 1;
+      break;
+    }
+
+    args->offset = end - args->buf.data + 1;
+  }
+
+  return NULL;
+}
+
+static void
+document_set_read_ubf(void *ptr){
+  ((DOCUMENT_SET_READ_ARGS *)ptr)->interrupted = 1;
+}
+
+static VALUE
+document_set_read_body(VALUE ptr){
+  DOCUMENT_SET_READ_ARGS *args = (DOCUMENT_SET_READ_ARGS *)ptr;
+
+  while(args->offset < args->buf.len){
+    args->interrupted = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(document_set_read_nogvl, args, document_set_read_ubf, args);
+#else
+    document_set_read_nogvl(args);
+#endif
+    if(args->failed)
+      rb_raise(rb_eArgError, "%s line %ld: %s", StringValueCStr(args->path), args->lineno,
+               args->error);
+
+    if(args->offset < args->buf.len)
+      rb_thread_check_ints();
+  }
+
+  return Qnil;
+}
+
+static VALUE
+document_set_read_cleanup(VALUE ptr){
+  DOCUMENT_SET_READ_ARGS *args = (DOCUMENT_SET_READ_ARGS *)ptr;
+
+  parsed_line_free(&args->line);
+  text_buffer_close(&args->buf);
+  document_set_memory_sync(args->set);
+
+  return Qnil;
+}
+
+/* A new set with every labeled document in a file in SVM-light's format, the file is
+ * mmap'd and parsed straight into the set without the GVL and without creating any
+ * ruby object per document. Comments are not kept.
+ * @param [String] path
+ * @return [DocumentSet]
+ */
+static VALUE
+document_set_read_file(VALUE klass, VALUE path){
+  DOCUMENT_SET_READ_ARGS args;
+  VALUE result;
+  int err;
+
+  FilePathValue(path);
+
+  memset(&args, 0, sizeof(args));
+  args.path = path;
+  result    = document_set_create(klass);
+  args.set  = document_set_get(result);
+
+  if((err = text_buffer_open(StringValueCStr(path), &args.buf)) != 0)
+    rb_syserr_fail_str(err, path);
+
+  parsed_line_init(&args.line);
+
+  rb_ensure(document_set_read_body, (VALUE)&args, document_set_read_cleanup, (VALUE)&args);
+
+  return result;
+}
+
+/* Releases every document, the set is empty afterwards. Raises while a Model.new,
+ * retrain or cross_validation in another thread is training on the set */
+static VALUE
+document_set_clear(VALUE self){
+  DOCUMENT_SET *set = document_set_get(self);
+
+  rb_check_frozen(self);
+
+  // Training runs without the GVL on the set's DOCs, they must stay where they are
+  if(__atomic_load_n(&set->trainings, __ATOMIC_RELAXED) > 0)
+    rb_raise(rb_eRuntimeError, "Cannot clear a DocumentSet while it is being trained on");
+
+  document_set_release(set);
+  document_set_memory_sync(set);
+
+  return self;
+}
+
+/* Bytes held by the set's buffers */
+static VALUE
+document_set_memsize(VALUE self){
+  return LONG2NUM(document_set_bytes(document_set_get(self)));
+}
+
+void
+Init_svmredlight_document_set(){
+  rb_cDocumentSet = rb_define_class_under(rb_mSvmLight, "DocumentSet", rb_cObject);
+  rb_undef_alloc_func(rb_cDocumentSet);
+  rb_define_singleton_method(rb_cDocumentSet, "create", document_set_create, 0);
+  rb_define_method(rb_cDocumentSet, "add", document_set_add, 2);
+  rb_define_method(rb_cDocumentSet, "append_packed", document_set_add_packed, 6);
+  rb_define_method(rb_cDocumentSet, "size", document_set_size, 0);
+  rb_define_method(rb_cDocumentSet, "total_words", document_set_total_words, 0);
+  rb_define_method(rb_cDocumentSet, "labels", document_set_labels, 0);
+  rb_define_method(rb_cDocumentSet, "[]", document_set_aref, -1);
+  rb_define_method(rb_cDocumentSet, "each", document_set_each, 0);
+  rb_define_method(rb_cDocumentSet, "memsize", document_set_memsize, 0);
+  rb_define_method(rb_cDocumentSet, "clear", document_set_clear, 0);
+  rb_define_singleton_method(rb_cDocumentSet, "read", document_set_read_file, 1);
+}
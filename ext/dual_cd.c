@@ -0,0 +1,237 @@
+#include "svmredlight.h"
+#include "string.h"
+#include <math.h>
+
+/* Dual coordinate descent for linear classification, the way LIBLINEAR does it (Hsieh et
+ * al., A Dual Coordinate Descent Method for Large-scale Linear SVM, ICML 2008). It solves
+ * the same hinge loss dual as SVM-light,
+ *
+ *   min 1/2 a'Qa - e'a  subject to 0 <= a_i <= C_i, Q_ij = y_i y_j x_i'x_j
+ *
+ * one a_i at a time, keeping w = sum a_i y_i x_i up to date so every step costs two sparse
+ * passes over x_i and nothing is ever cached. Every pass visits the active documents in a
+ * new random order, documents stuck at a bound are shrunk out of the active set until the
+ * pass converges. The bias is the weight of an extra feature that is always 1, so unlike
+ * SVM-light's b it is regularized like the other weights.
+ *
+ * All the state is local, so the solver is reentrant and does not wait for SVM-light's
+ * solver (see solver_acquire). */
+
+#define DUAL_CD_MAX_PASSES 1000
+
+/* x'y summed over the SVECTOR chains of a and b (SVM-light's linear kernel) */
+static double
+doc_sprod(DOC *a, DOC *b){
+  SVECTOR *f, *g;
+  double sum = 0.0;
+
+  for(f = a->fvec; f; f = f->next)
+    for(g = b->fvec; g; g = g->next)
+      sum += f->factor * g->factor * sprod_ss(f, g);
+
+  return sum;
+}
+
+static double
+doc_dot(const double *w, DOC *d){
+  SVECTOR *f;
+  WORD *word;
+  double sum = 0.0, partial;
+
+  for(f = d->fvec; f; f = f->next){
+    partial = 0.0;
+
+    for(word = f->words; word->wnum; word++)
+      partial += w[word->wnum] * word->weight;
+
+    sum += f->factor * partial;
+  }
+
+  return sum;
+}
+
+static void
+doc_axpy(double *w, double a, DOC *d){
+  SVECTOR *f;
+  WORD *word;
+
+  for(f = d->fvec; f; f = f->next){
+    for(word = f->words; word->wnum; word++)
+      w[word->wnum] += a * f->factor * word->weight;
+  }
+}
+
+/* xorshift64*, rand() is neither reentrant nor per solver */
+static uint64_t
+dual_cd_random(uint64_t *state){
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+
+  return *state * 2685821657736338717ULL;
+}
+
+/* Trains a linear model on docs with the dual coordinate descent solver, see
+ * train_classification. The model points to docs just like svm_learn_classification's,
+ * index maps the position of every document to its support vector (-1 if it is not one).
+ * Unlabeled documents (label 0) are ignored, there is no transduction. The cost of
+ * document i is svm_c * costfactor (times svm_costratio for positives), svm_c 0 is
+ * SVM-light's default of 1 / avg(|x|)^2. epsilon_crit bounds the spread of the projected
+ * gradients at the end, LIBLINEAR's default of 0.1 is much faster than SVM-light's 0.001
+ * and usually as accurate. A negative learn_param->maxiter (see learn_classification_ubf)
+ * stops at the end of the current pass. */
+MODEL *
+train_dual_cd(DOC **docs, double *labels, long totdocs, long totwords, LEARN_PARM *learn_param,
+              KERNEL_PARM *kernel_param, double *alpha_in){
+  MODEL *m = (MODEL *)my_malloc(sizeof(MODEL));
+  double *w, *alpha, *upper, *qd, *y, bias_weight = 0.0, bias, c, norms = 0.0;
+  double g, pg, old, delta, pg_max_old = HUGE_VAL, pg_min_old = -HUGE_VAL, pg_max, pg_min;
+  long *active, i, s, tmp, active_size, labeled = 0, pass, nsv = 0;
+  uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+  w      = (double *)my_malloc(sizeof(double) * (totwords + 1));
+  alpha  = (double *)my_malloc(sizeof(double) * totdocs);
+  upper  = (double *)my_malloc(sizeof(double) * totdocs);
+  qd     = (double *)my_malloc(sizeof(double) * totdocs);
+  y      = (double *)my_malloc(sizeof(double) * totdocs);
+  active = (long *)my_malloc(sizeof(long) * totdocs);
+  bias   = learn_param->biased_hyperplane ? 1.0 : 0.0;
+
+  memset(w, 0, sizeof(double) * (totwords + 1));
+
+  for(i = 0; i < totdocs; i++){
+    qd[i]  = doc_sprod(docs[i], docs[i]);
+    norms += sqrt(qd[i]);
+  }
+
+  c = learn_param->svm_c > 0 ? learn_param->svm_c : (norms > 0 ? totdocs * totdocs / (norms * norms) : 1.0);
+
+  for(i = 0; i < totdocs; i++){
+    y[i]      = labels[i] > 0 ? 1.0 : -1.0;
+    upper[i]  = labels[i] == 0 ? 0.0 : c * docs[i]->costfactor * (y[i] > 0 ? learn_param->svm_costratio : 1.0);
+    alpha[i]  = alpha_in ? fmin(fabs(alpha_in[i]), upper[i]) : 0.0;
+    qd[i]    += bias * bias;
+
+    if(alpha[i] > 0){
+      doc_axpy(w, alpha[i] * y[i], docs[i]);
+      bias_weight += alpha[i] * y[i] * bias;
+    }
+
+    // Documents that cannot move are never visited
+    if(upper[i] > 0 && qd[i] > 0)
+      active[labeled++] = i;
+  }
+
+  active_size = labeled;
+  pg_max = pg_min = 0.0;
+
+  for(pass = 0; pass < DUAL_CD_MAX_PASSES && *(volatile long *)&learn_param->maxiter >= 0; pass++){
+    pg_max = -HUGE_VAL;
+    pg_min = HUGE_VAL;
+
+    for(s = 0; s < active_size; s++){
+      i = s + (long)(dual_cd_random(&seed) % (uint64_t)(active_size - s));
+      tmp = active[s]; active[s] = active[i]; active[i] = tmp;
+    }
+
+    for(s = 0; s < active_size; s++){
+      i  = active[s];
+      g  = y[i] * (doc_dot(w, docs[i]) + bias_weight * bias) - 1.0;
+      pg = 0.0;
+
+      if(alpha[i] == 0){
+        if(g > pg_max_old){
+          active_size--;
+          tmp = active[s]; active[s] = active[active_size]; active[active_size] = tmp;
+          s--;
+          continue;
+        }
+
+        if(g < 0)
+          pg = g;
+      }else if(alpha[i] == upper[i]){
+        if(g < pg_min_old){
+          active_size--;
+          tmp = active[s]; active[s] = active[active_size]; active[active_size] = tmp;
+          s--;
+          continue;
+        }
+
+        if(g > 0)
+          pg = g;
+      }else{
+        pg = g;
+      }
+
+      pg_max = fmax(pg_max, pg);
+      pg_min = fmin(pg_min, pg);
+
+      if(fabs(pg) > 1e-12){
+        old      = alpha[i];
+        alpha[i] = fmin(fmax(alpha[i] - g / qd[i], 0.0), upper[i]);
+        delta    = (alpha[i] - old) * y[i];
+
+        doc_axpy(w, delta, docs[i]);
+        bias_weight += delta * bias;
+      }
+    }
+
+    if(pg_max - pg_min <= learn_param->epsilon_crit){
+      // Converged on the active set, done if nothing was shrunk, otherwise make sure
+      // on all of them
+      if(active_size == labeled)
+        break;
+
+      active_size = labeled;
+      pg_max_old  = HUGE_VAL;
+      pg_min_old  = -HUGE_VAL;
+      continue;
+    }
+
+    pg_max_old = pg_max <= 0 ? HUGE_VAL : pg_max;
+    pg_min_old = pg_min >= 0 ? -HUGE_VAL : pg_min;
+  }
+
+  for(i = 0; i < totdocs; i++){
+    if(alpha[i] > 0)
+      nsv++;
+  }
+
+  memset(m, 0, sizeof(MODEL));
+  m->supvec      = (DOC **)my_malloc(sizeof(DOC *) * (nsv + 1));
+  m->alpha       = (double *)my_malloc(sizeof(double) * (nsv + 1));
+  m->index       = (long *)my_malloc(sizeof(long) * (totdocs + 2));
+  m->supvec[0]   = NULL;
+  m->alpha[0]    = 0.0;
+  m->sv_num      = 1;
+  m->totwords    = totwords;
+  m->totdoc      = totdocs;
+  m->kernel_parm = *kernel_param;
+  m->lin_weights = w;
+  // SVM-light scores w'x - b
+  m->b           = -bias_weight * bias;
+  m->maxdiff     = pg_max - pg_min;
+  m->loo_error   = m->loo_recall = m->loo_precision = -1;
+  m->xa_error    = m->xa_recall = m->xa_precision = -1;
+
+  for(i = 0; i < totdocs; i++){
+    m->index[i] = -1;
+
+    if(alpha[i] > 0){
+      if(alpha[i] >= upper[i])
+        m->at_upper_bound++;
+
+      m->supvec[m->sv_num] = docs[i];
+      m->alpha[m->sv_num]  = alpha[i] * y[i];
+      m->index[i]          = m->sv_num++;
+    }
+  }
+
+  free(alpha);
+  free(upper);
+  free(qd);
+  free(y);
+  free(active);
+
+  return m;
+}
@@ -1,6 +1,14 @@
 require 'mkmf'
 have_header("svm_light/svm_common.h")
+have_header("svm_light/svm_learn.h")
 have_library("svmlight")
-$objs = %w{svmredlight.o}
+have_library("pthread")
+have_header("ruby/thread.h")
+have_func("rb_thread_call_without_gvl", "ruby/thread.h")
+have_func("rb_ext_ractor_safe", "ruby.h")
+have_func("rb_gc_adjust_memory_usage", "ruby.h")
+have_header("sys/mman.h")
+have_header("immintrin.h")
+$objs = %w{svmredlight.o reader.o binary_model.o linear.o kernel_engine.o document_set.o cross_validation.o stats.o compact.o multi_model.o model_io.o dual_cd.o online.o featurizer.o memory.o classify_file.o}
 create_makefile('svmredlight')
 
@@ -0,0 +1,669 @@
+#include "svmredlight.h"
+#include "string.h"
+#include <math.h>
+
+/* Text to Documents. A Featurizer holds a vocabulary, term i (from 1) being feature
+ * number i like in the words file of examples/example1, in an open addressing hash
+ * table whose slots only hold a hash, the position of the term in one block of
+ * characters and its feature number. Texts are split in tokens, maximal runs of ASCII
+ * letters and digits (bytes over 127 are kept too so UTF-8 words stay whole), which are
+ * lowercased and looked up; unknown ones are skipped. Vocabulary terms are lowercased
+ * the same way when the table is built, there is no stemming.
+ *
+ * The weight of a feature is its count (tf), 1 (binary) or count * idf (tfidf), and the
+ * vector can be scaled to unit L2 norm. idf is 1 for every feature until fit or idf=
+ * set it, it is written in place so set it before sharing the featurizer between
+ * threads. */
+
+#define FEATURIZER_TF     1
+#define FEATURIZER_BINARY 2
+#define FEATURIZER_TFIDF  3
+
+/* Longer tokens are never in the vocabulary */
+#define FEATURIZER_MAX_TOKEN 256
+
+typedef struct vocabulary_slot {
+  uint32_t hash;
+  uint32_t offset;
+  uint32_t len;
+  uint32_t wnum;
+} VOCABULARY_SLOT;
+
+typedef struct featurizer {
+  VOCABULARY_SLOT *slots;
+  uint32_t mask;
+  char     *terms;
+  size_t   terms_len;
+  long     size;
+  double   *idf;
+  int      weighting;
+  int      normalize;
+  int      lowercase;
+} FEATURIZER;
+
+/* What featurizing one text needs, reused across the texts of a batch */
+typedef struct featurizer_scratch {
+  uint32_t *wnums;
+  long     wnums_capacity;
+  WORD     *words;
+  long     words_capacity;
+} FEATURIZER_SCRATCH;
+
+static VALUE rb_cFeaturizer;
+
+static size_t
+featurizer_memsize(const FEATURIZER *fz){
+  return sizeof(FEATURIZER) + sizeof(VOCABULARY_SLOT) * ((size_t)fz->mask + 1) +
+         fz->terms_len + 1 + sizeof(double) * (fz->size + 1);
+}
+
+static void
+featurizer_free(void *ptr){
+  FEATURIZER *fz = (FEATURIZER *)ptr;
+
+  if(!fz)
+    return;
+
+  memory_adjust(MEMORY_FEATURIZERS, -1, -(long)featurizer_memsize(fz));
+
+  free(fz->slots);
+  free(fz->terms);
+  free(fz->idf);
+  free(fz);
+}
+
+static size_t
+featurizer_dsize(const void *ptr){
+  return ptr ? featurizer_memsize((const FEATURIZER *)ptr) : 0;
+}
+
+/* Nothing but idf (see above) changes after it is built */
+static const rb_data_type_t featurizer_data_type = {
+  "SVMLight::Featurizer",
+  {0, featurizer_free, featurizer_dsize},
+  0, 0,
+  SVMREDLIGHT_TYPED_FLAGS
+};
+
+static FEATURIZER *
+featurizer_get(VALUE self){
+  FEATURIZER *fz;
+  TypedData_Get_Struct(self, FEATURIZER, &featurizer_data_type, fz);
+
+  return fz;
+}
+
+static char
+ascii_lower(char c){
+  return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+/* FNV-1a */
+static uint32_t
+term_hash(const char *s, long len){
+  uint32_t h = 2166136261u;
+  long i;
+
+  for(i = 0; i < len; i++){
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+
+  return h;
+}
+
+static VOCABULARY_SLOT *
+vocabulary_find(const FEATURIZER *fz, const char *term, long len, uint32_t hash){
+  uint32_t i = hash & fz->mask;
+  VOCABULARY_SLOT *slot;
+
+  for(;;){
+    slot = &fz->slots[i];
+
+    if(!slot->wnum ||
+       (slot->hash == hash && slot->len == (uint32_t)len &&
+        memcmp(fz->terms + slot->offset, term, len) == 0))
+      return slot;
+
+    i = (i + 1) & fz->mask;
+  }
+}
+
+/* Builds the table out of n terms laid out one per line in text (the words file
+ * format), blank lines take a feature number too. With lowercase terms are lowercased
+ * like tokens are. Repeated terms keep the first one */
+static FEATURIZER *
+featurizer_new(const char *text, size_t len, int lowercase){
+  FEATURIZER *fz = (FEATURIZER *)my_malloc(sizeof(FEATURIZER));
+  const char *line = text, *end = text + len, *eol;
+  char *shrunk;
+  char *term;
+  VOCABULARY_SLOT *slot;
+  uint32_t capacity = 16, hash;
+  long lines = 0, wnum = 0, i;
+
+  memset(fz, 0, sizeof(FEATURIZER));
+  fz->lowercase = lowercase;
+
+  for(i = 0; i < (long)len; i++){
+    if(text[i] == '\n')
+      lines++;
+  }
+  if(len > 0 && text[len - 1] != '\n')
+    lines++;
+
+  while(capacity < 2 * lines)
+    capacity *= 2;
+
+  fz->slots = (VOCABULARY_SLOT *)my_malloc(sizeof(VOCABULARY_SLOT) * capacity);
+  fz->mask  = capacity - 1;
+  fz->terms = (char *)my_malloc(len + 1);
+  memset(fz->slots, 0, sizeof(VOCABULARY_SLOT) * capacity);
+
+  while(line < end){
+    eol = memchr(line, '\n', end - line);
+    if(!eol)
+      eol = end;
+
+    wnum++;
+    len = eol - line;
+
+    // Windows line endings
+    if(len > 0 && line[len - 1] == '\r')
+      len--;
+
+    if(len > 0 && len <= FEATURIZER_MAX_TOKEN){
+      // Copied where it goes first, it is only kept if it is not repeated
+      term = fz->terms + fz->terms_len;
+      for(i = 0; i < (long)len; i++)
+        term[i] = lowercase ? ascii_lower(line[i]) : line[i];
+
+      hash = term_hash(term, len);
+      slot = vocabulary_find(fz, term, len, hash);
+
+      if(!slot->wnum){
+        slot->hash     = hash;
+        slot->offset   = (uint32_t)fz->terms_len;
+        slot->len      = (uint32_t)len;
+        slot->wnum     = (uint32_t)wnum;
+        fz->terms_len += len;
+      }
+    }
+
+    line = eol + 1;
+  }
+
+  // Blank lines and repeated terms left room at the end
+  if((shrunk = realloc(fz->terms, fz->terms_len + 1)))
+    fz->terms = shrunk;
+
+  fz->size = wnum;
+  fz->idf  = (double *)my_malloc(sizeof(double) * (wnum + 1));
+
+  for(i = 0; i <= wnum; i++)
+    fz->idf[i] = 1.0;
+
+  return fz;
+}
+
+static int
+compare_wnums(const void *a, const void *b){
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* The feature numbers of the known tokens of text, sorted, in scratch->wnums */
+static long
+featurizer_tokens(const FEATURIZER *fz, const char *text, long len, FEATURIZER_SCRATCH *scratch){
+  char token[FEATURIZER_MAX_TOKEN];
+  long i = 0, n = 0, tlen;
+  unsigned char c;
+  VOCABULARY_SLOT *slot;
+
+  while(i < len){
+    tlen = 0;
+
+    while(i < len){
+      c = (unsigned char)text[i];
+
+      if(!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 128))
+        break;
+
+      if(tlen < FEATURIZER_MAX_TOKEN)
+        token[tlen] = fz->lowercase ? ascii_lower(c) : c;
+
+      tlen++;
+      i++;
+    }
+
+    if(tlen > 0 && tlen <= FEATURIZER_MAX_TOKEN){
+      slot = vocabulary_find(fz, token, tlen, term_hash(token, tlen));
+
+      if(slot->wnum){
+        if(n == scratch->wnums_capacity){
+          scratch->wnums_capacity = scratch->wnums_capacity ? scratch->wnums_capacity * 2 : 256;
+          scratch->wnums = (uint32_t *)realloc(scratch->wnums, sizeof(uint32_t) * scratch->wnums_capacity);
+        }
+
+        scratch->wnums[n++] = slot->wnum;
+      }
+    }
+
+    if(tlen == 0)
+      i++;
+  }
+
+  qsort(scratch->wnums, n, sizeof(uint32_t), compare_wnums);
+
+  return n;
+}
+
+/* Featurizes text into a new DOC, touches no ruby object */
+static DOC *
+featurizer_doc(const FEATURIZER *fz, const char *text, long len, long docnum,
+               FEATURIZER_SCRATCH *scratch){
+  long n = featurizer_tokens(fz, text, len, scratch), i, count, nwords = 0;
+  double weight, norm = 0.0;
+
+  if(n + 1 > scratch->words_capacity){
+    scratch->words_capacity = n + 1 > 256 ? n + 1 : 256;
+    scratch->words = (WORD *)realloc(scratch->words, sizeof(WORD) * scratch->words_capacity);
+  }
+
+  for(i = 0; i < n; i += count){
+    for(count = 1; i + count < n && scratch->wnums[i + count] == scratch->wnums[i]; count++)
+      ;
+
+    if(fz->weighting == FEATURIZER_BINARY)
+      weight = 1.0;
+    else if(fz->weighting == FEATURIZER_TFIDF)
+      weight = count * fz->idf[scratch->wnums[i]];
+    else
+      weight = count;
+
+    scratch->words[nwords].wnum   = scratch->wnums[i];
+    scratch->words[nwords].weight = (FVAL)weight;
+    norm += weight * weight;
+    nwords++;
+  }
+
+  if(fz->normalize && norm > 0){
+    norm = sqrt(norm);
+
+    for(i = 0; i < nwords; i++)
+      scratch->words[i].weight = (FVAL)(scratch->words[i].weight / norm);
+  }
+
+  scratch->words[nwords].wnum = 0;
+
+  return create_example(docnum, 0, 0, 1.0, create_svector(scratch->words, (char *)"", 1.0));
+}
+
+static void
+featurizer_scratch_free(FEATURIZER_SCRATCH *scratch){
+  free(scratch->wnums);
+  free(scratch->words);
+}
+
+static int
+weighting_from_sym(VALUE weighting){
+  ID id;
+
+  if(SYMBOL_P(weighting)){
+    id = SYM2ID(weighting);
+
+    if(id == rb_intern("tf"))
+      return FEATURIZER_TF;
+    if(id == rb_intern("binary"))
+      return FEATURIZER_BINARY;
+    if(id == rb_intern("tfidf"))
+      return FEATURIZER_TFIDF;
+  }
+
+  rb_raise(rb_eArgError, "weighting must be :tf, :binary or :tfidf");
+}
+
+static VALUE
+featurizer_wrap(VALUE klass, FEATURIZER *fz, VALUE weighting, VALUE normalize){
+  VALUE result;
+
+  fz->weighting = weighting_from_sym(weighting);
+  fz->normalize = RTEST(normalize);
+
+  result = TypedData_Wrap_Struct(klass, &featurizer_data_type, fz);
+  memory_adjust(MEMORY_FEATURIZERS, 1, (long)featurizer_memsize(fz));
+
+  return result;
+}
+
+/* See Featurizer.new
+ * @param [Array] terms Strings, term i is feature number i + 1
+ */
+static VALUE
+featurizer_create(VALUE klass, VALUE terms, VALUE weighting, VALUE normalize, VALUE lowercase){
+  VALUE text;
+  long i;
+
+  Check_Type(terms, T_ARRAY);
+  weighting_from_sym(weighting);
+
+  text = rb_str_buf_new(RARRAY_LEN(terms) * 8);
+  for(i = 0; i < RARRAY_LEN(terms); i++){
+    VALUE term = RARRAY_PTR(terms)[i];
+
+    StringValue(term);
+
+    if(memchr(RSTRING_PTR(term), '\n', RSTRING_LEN(term)))
+      rb_raise(rb_eArgError, "Terms cannot contain new lines");
+
+    rb_str_buf_cat(text, RSTRING_PTR(term), RSTRING_LEN(term));
+    rb_str_buf_cat(text, "\n", 1);
+  }
+
+  return featurizer_wrap(klass, featurizer_new(RSTRING_PTR(text), RSTRING_LEN(text),
+                                               RTEST(lowercase)), weighting, normalize);
+}
+
+/* See Featurizer.load
+ * @param [String] path a file with one term per line
+ */
+static VALUE
+featurizer_from_file(VALUE klass, VALUE path, VALUE weighting, VALUE normalize, VALUE lowercase){
+  TEXT_BUFFER buf;
+  FEATURIZER *fz;
+  int err;
+
+  FilePathValue(path);
+  weighting_from_sym(weighting);
+
+  if((err = text_buffer_open(StringValueCStr(path), &buf)) != 0)
+    rb_syserr_fail_str(err, path);
+
+  fz = featurizer_new(buf.data, buf.len, RTEST(lowercase));
+  text_buffer_close(&buf);
+
+  return featurizer_wrap(klass, fz, weighting, normalize);
+}
+
+/* Featurizes one text
+ * @param [String] text
+ * @param [Fixnum] docnum
+ * @return [Document]
+ */
+static VALUE
+featurizer_featurize(VALUE self, VALUE text, VALUE docnum){
+  FEATURIZER_SCRATCH scratch;
+  DOC *d;
+
+  StringValue(text);
+  memset(&scratch, 0, sizeof(FEATURIZER_SCRATCH));
+
+  d = featurizer_doc(featurizer_get(self), RSTRING_PTR(text), RSTRING_LEN(text), NUM2LONG(docnum),
+                     &scratch);
+  featurizer_scratch_free(&scratch);
+  RB_GC_GUARD(text);
+
+  return document_wrap(rb_cDocument, d);
+}
+
+/* Everything the batch loops need, they only touch C memory so they can run without the
+ * GVL. texts holds frozen copies of the Strings so ptrs and lens stay valid, next is the
+ * first text not done yet. featurize_batch fills docs, fit counts document frequencies
+ * in df */
+typedef struct featurize_batch_args {
+  FEATURIZER *fz;
+  VALUE      texts;
+  const char **ptrs;
+  long       *lens;
+  long       n;
+  long       next;
+  long       docnum;
+  DOC        **docs;
+  long       *df;
+  FEATURIZER_SCRATCH scratch;
+  volatile int interrupted;
+} FEATURIZE_BATCH_ARGS;
+
+static void *
+featurize_batch_nogvl(void *ptr){
+  FEATURIZE_BATCH_ARGS *args = (FEATURIZE_BATCH_ARGS *)ptr;
+  long n, i;
+
+  for(; args->next < args->n && !args->interrupted; args->next++){
+    if(args->docs){
+      args->docs[args->next] = featurizer_doc(args->fz, args->ptrs[args->next],
+                                              args->lens[args->next], args->docnum + args->next,
+                                              &args->scratch);
+      continue;
+    }
+
+    n = featurizer_tokens(args->fz, args->ptrs[args->next], args->lens[args->next], &args->scratch);
+
+    for(i = 0; i < n; i++){
+      if(i == 0 || args->scratch.wnums[i] != args->scratch.wnums[i - 1])
+        args->df[args->scratch.wnums[i]]++;
+    }
+  }
+
+  return NULL;
+}
+
+/* Unblocking function, see classify_batch_ubf */
+static void
+featurize_batch_ubf(void *ptr){
+  ((FEATURIZE_BATCH_ARGS *)ptr)->interrupted = 1;
+}
+
+static VALUE
+featurize_batch_body(VALUE ptr){
+  FEATURIZE_BATCH_ARGS *args = (FEATURIZE_BATCH_ARGS *)ptr;
+  VALUE result;
+  long i;
+
+  while(args->next < args->n){
+    args->interrupted = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(featurize_batch_nogvl, args, featurize_batch_ubf, args);
+#else
+    featurize_batch_nogvl(args);
+#endif
+    if(args->next < args->n)
+      rb_thread_check_ints();
+  }
+
+  // fit, df is complete
+  if(!args->docs){
+    for(i = 1; i <= args->fz->size; i++)
+      args->fz->idf[i] = log((1.0 + args->n) / (1.0 + args->df[i])) + 1.0;
+
+    return Qnil;
+  }
+
+  result = rb_ary_new2(args->n);
+
+  // Once wrapped a DOC belongs to its Document, cleanup must not free it
+  for(i = 0; i < args->n; i++){
+    rb_ary_push(result, document_wrap(rb_cDocument, args->docs[i]));
+    args->docs[i] = NULL;
+  }
+
+  return result;
+}
+
+/* Frees the buffers and the DOCs that did not make it into a Document */
+static VALUE
+featurize_batch_cleanup(VALUE ptr){
+  FEATURIZE_BATCH_ARGS *args = (FEATURIZE_BATCH_ARGS *)ptr;
+  long i;
+
+  if(args->docs){
+    for(i = 0; i < args->next; i++){
+      if(args->docs[i])
+        free_example(args->docs[i], 1);
+    }
+  }
+
+  free(args->docs);
+  free(args->df);
+  free(args->ptrs);
+  free(args->lens);
+  featurizer_scratch_free(&args->scratch);
+
+  return Qnil;
+}
+
+static void
+featurize_batch_init(FEATURIZE_BATCH_ARGS *args, VALUE self, VALUE texts){
+  VALUE text;
+  long i;
+
+  Check_Type(texts, T_ARRAY);
+
+  memset(args, 0, sizeof(FEATURIZE_BATCH_ARGS));
+  args->fz    = featurizer_get(self);
+  args->texts = rb_ary_new2(RARRAY_LEN(texts));
+
+  // Frozen copies share the buffer of the original, nothing is copied unless somebody
+  // changes the original while we are working
+  for(i = 0; i < RARRAY_LEN(texts); i++){
+    text = RARRAY_AREF(texts, i);
+    StringValue(text);
+    rb_ary_push(args->texts, rb_str_new_frozen(text));
+  }
+
+  args->n    = RARRAY_LEN(args->texts);
+  args->ptrs = (const char **)my_malloc(sizeof(char *) * (args->n + 1));
+  args->lens = (long *)my_malloc(sizeof(long) * (args->n + 1));
+
+  for(i = 0; i < args->n; i++){
+    text = RARRAY_AREF(args->texts, i);
+    args->ptrs[i] = RSTRING_PTR(text);
+    args->lens[i] = RSTRING_LEN(text);
+  }
+}
+
+/* Featurizes many texts in a single C loop with the GVL released
+ * @param [Array] texts Strings
+ * @param [Fixnum] docnum of the first Document, the next ones count up from it
+ * @return [Array] Documents
+ */
+static VALUE
+featurizer_featurize_batch(VALUE self, VALUE texts, VALUE docnum){
+  FEATURIZE_BATCH_ARGS args;
+  VALUE result;
+
+  featurize_batch_init(&args, self, texts);
+  args.docnum = NUM2LONG(docnum);
+  args.docs   = (DOC **)my_malloc(sizeof(DOC *) * (args.n + 1));
+
+  result = rb_ensure(featurize_batch_body, (VALUE)&args, featurize_batch_cleanup, (VALUE)&args);
+
+  RB_GC_GUARD(args.texts);
+  return result;
+}
+
+/* Sets idf from the document frequencies in texts, the smoothed
+ * log((1 + n) / (1 + df)) + 1 so terms in every text still count a little
+ * @param [Array] texts Strings
+ * @return [Featurizer] self
+ */
+static VALUE
+featurizer_fit(VALUE self, VALUE texts){
+  FEATURIZE_BATCH_ARGS args;
+
+  rb_check_frozen(self);
+  featurize_batch_init(&args, self, texts);
+  args.df = (long *)my_malloc(sizeof(long) * (args.fz->size + 1));
+  memset(args.df, 0, sizeof(long) * (args.fz->size + 1));
+
+  rb_ensure(featurize_batch_body, (VALUE)&args, featurize_batch_cleanup, (VALUE)&args);
+
+  RB_GC_GUARD(args.texts);
+  return self;
+}
+
+/* @return [Array] the idf of every feature, from feature 1 */
+static VALUE
+featurizer_idf(VALUE self){
+  FEATURIZER *fz = featurizer_get(self);
+  VALUE result = rb_ary_new2(fz->size);
+  long i;
+
+  for(i = 1; i <= fz->size; i++)
+    rb_ary_push(result, DBL2NUM(fz->idf[i]));
+
+  return result;
+}
+
+/* @param [Array] idf Floats, one per feature from feature 1 */
+static VALUE
+featurizer_set_idf(VALUE self, VALUE idf){
+  FEATURIZER *fz = featurizer_get(self);
+  long i;
+
+  rb_check_frozen(self);
+  Check_Type(idf, T_ARRAY);
+
+  if(RARRAY_LEN(idf) != fz->size)
+    rb_raise(rb_eArgError, "idf must have one value per term, %ld", fz->size);
+
+  // All or nothing, NUM2DBL can raise
+  for(i = 0; i < fz->size; i++)
+    NUM2DBL(RARRAY_AREF(idf, i));
+
+  for(i = 0; i < fz->size; i++)
+    fz->idf[i + 1] = NUM2DBL(RARRAY_AREF(idf, i));
+
+  return idf;
+}
+
+/* @return [Fixnum] the number of features, the largest feature number */
+static VALUE
+featurizer_vocabulary_size(VALUE self){
+  return LONG2NUM(featurizer_get(self)->size);
+}
+
+/* @param [String] term, lowercased like tokens are
+ * @return [Fixnum, nil] the feature number of term, nil if it is not in the vocabulary */
+static VALUE
+featurizer_lookup(VALUE self, VALUE term){
+  FEATURIZER *fz = featurizer_get(self);
+  VOCABULARY_SLOT *slot;
+  char lowered[FEATURIZER_MAX_TOKEN];
+  const char *key;
+  long len, i;
+
+  StringValue(term);
+  len = RSTRING_LEN(term);
+  key = RSTRING_PTR(term);
+
+  if(len == 0 || len > FEATURIZER_MAX_TOKEN)
+    return Qnil;
+
+  if(fz->lowercase){
+    for(i = 0; i < len; i++)
+      lowered[i] = ascii_lower(key[i]);
+
+    key = lowered;
+  }
+
+  slot = vocabulary_find(fz, key, len, term_hash(key, len));
+
+  return slot->wnum ? LONG2NUM(slot->wnum) : Qnil;
+}
+
+void
+Init_svmredlight_featurizer(){
+  rb_cFeaturizer = rb_define_class_under(rb_mSvmLight, "Featurizer", rb_cObject);
+  rb_undef_alloc_func(rb_cFeaturizer);
+  rb_define_singleton_method(rb_cFeaturizer, "create", featurizer_create, 4);
+  rb_define_singleton_method(rb_cFeaturizer, "from_file", featurizer_from_file, 4);
+  rb_define_method(rb_cFeaturizer, "featurize_one", featurizer_featurize, 2);
+  rb_define_method(rb_cFeaturizer, "featurize_many", featurizer_featurize_batch, 2);
+  rb_define_method(rb_cFeaturizer, "fit", featurizer_fit, 1);
+  rb_define_method(rb_cFeaturizer, "idf", featurizer_idf, 0);
+  rb_define_method(rb_cFeaturizer, "idf=", featurizer_set_idf, 1);
+  rb_define_method(rb_cFeaturizer, "vocabulary_size", featurizer_vocabulary_size, 0);
+  rb_define_method(rb_cFeaturizer, "[]", featurizer_lookup, 1);
+}
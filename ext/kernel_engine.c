@@ -0,0 +1,486 @@
+#include "svmredlight.h"
+#include "string.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* Scoring engine for polynomial, rbf and sigmoid models. SVM-light's classify_example
+ * walks the support vectors through their DOC and SVECTOR headers and computes each dot
+ * product by merging two sparse lists. Here the support vectors are laid out one after
+ * the other in a single CSR block (row offsets into a WORD array, each row 0 terminated
+ * so it is also a valid SVECTOR word list) with their alpha*y and squared norms in flat
+ * arrays, the document is scattered once into a dense buffer and each dot product is a
+ * sparse-dense product done by the same (SIMD) kernel that scores linear models.
+ *
+ * Models with many support vectors can split the sweep over several threads, see
+ * SVMLight.kernel_threads=. The slices go through a queue served by a pool of worker
+ * threads started on first use and kept for the life of the process. Models whose
+ * support vectors or documents use more than one SVECTOR per DOC are left to
+ * classify_example. */
+
+/* Below this many words per slice handing it to a worker is not paid back */
+#define KERNEL_MIN_WORDS_PER_THREAD 32768
+#define KERNEL_MAX_THREADS 64
+
+struct kernel_engine {
+  long   sv_count;     // number of support vectors, sv_num - 1
+  long   *rows;        // sv_count + 1 offsets into words
+  WORD   *words;       // the support vectors, each list 0 terminated
+  WORD   *owned_words; // words when it was allocated here, NULL when shared with the model
+  double *coefs;       // alpha*y of each support vector
+  double *norms;       // squared norm of each support vector
+  int    mapped;       // rows, coefs and norms point into a binary model mapping
+};
+
+typedef struct kernel_sweep {
+  RMODEL              *rm;
+  const double        *dense;
+  long                len;
+  double              ex_norm;
+  long                from;
+  long                to;
+  double              sum;
+  long                *pending; // slices of the document not swept yet, under pool_lock
+  struct kernel_sweep *next;    // next queued slice
+} KERNEL_SWEEP;
+
+static long kernel_threads = 1;
+static pthread_key_t dense_key;
+
+/* The queue of slices waiting for a worker. Callers sweep queued slices themselves while
+ * they wait so a document is always finished, even when no worker could be started or
+ * after a fork, which leaves the child without the parent's workers. */
+static pthread_mutex_t pool_lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  pool_work  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  pool_done  = PTHREAD_COND_INITIALIZER;
+static KERNEL_SWEEP    *pool_head = NULL;
+static KERNEL_SWEEP    *pool_tail = NULL;
+static long            pool_workers = 0;
+
+/* Every thread scoring documents keeps its own zeroed scratch vector, released by the
+ * key destructor when the thread exits */
+typedef struct dense_buffer {
+  double *values;
+  long   len;
+} DENSE_BUFFER;
+
+static void
+dense_buffer_free(void *ptr){
+  DENSE_BUFFER *buf = (DENSE_BUFFER *)ptr;
+
+  if(buf){
+    free(buf->values);
+    free(buf);
+  }
+}
+
+static double *
+dense_buffer_get(long len){
+  DENSE_BUFFER *buf = (DENSE_BUFFER *)pthread_getspecific(dense_key);
+
+  if(!buf){
+    if(!(buf = (DENSE_BUFFER *)calloc(1, sizeof(DENSE_BUFFER))))
+      return NULL;
+
+    pthread_setspecific(dense_key, buf);
+  }
+
+  if(buf->len < len){
+    free(buf->values);
+    buf->len = 0;
+
+    if(!(buf->values = (double *)calloc(len, sizeof(double))))
+      return NULL;
+
+    buf->len = len;
+  }
+
+  return buf->values;
+}
+
+static int
+single_vector(DOC *d){
+  return d && d->fvec && !d->fvec->next && d->fvec->kernel_id == 0;
+}
+
+static int
+words_contiguous(MODEL *m){
+  long i, n;
+
+  for(i = 1; i < m->sv_num - 1; i++){
+    for(n = 0; m->supvec[i]->fvec->words[n].wnum; n++)
+      ;
+
+    if(m->supvec[i]->fvec->words + n + 1 != m->supvec[i + 1]->fvec->words)
+      return 0;
+  }
+
+  return 1;
+}
+
+/* Builds the engine for a polynomial, rbf or sigmoid model. The support vectors of
+ * models mapped from a binary file are already contiguous and are used in place. */
+void
+kernel_engine_prepare(RMODEL *rm){
+  MODEL *m = rm->m;
+  struct kernel_engine *k;
+  long i, n, total = 0;
+
+  if(rm->linear || rm->kernel)
+    return;
+
+  if(m->kernel_parm.kernel_type != POLY && m->kernel_parm.kernel_type != RBF &&
+     m->kernel_parm.kernel_type != SIGMOID)
+    return;
+
+  for(i = 1; i < m->sv_num; i++){
+    if(!single_vector(m->supvec[i]))
+      return;
+
+    for(n = 0; m->supvec[i]->fvec->words[n].wnum; n++)
+      ;
+
+    total += n + 1;
+  }
+
+  k = (struct kernel_engine *)my_malloc(sizeof(struct kernel_engine));
+  memset(k, 0, sizeof(struct kernel_engine));
+  k->sv_count = m->sv_num > 1 ? m->sv_num - 1 : 0;
+  k->rows     = (long *)my_malloc(sizeof(long) * (k->sv_count + 1));
+  k->coefs    = (double *)my_malloc(sizeof(double) * (k->sv_count + 1));
+  k->norms    = (double *)my_malloc(sizeof(double) * (k->sv_count + 1));
+
+  if(k->sv_count > 0 && words_contiguous(m)){
+    k->words = m->supvec[1]->fvec->words;
+  }else{
+    k->owned_words = (WORD *)my_malloc(sizeof(WORD) * (total + 1));
+    k->words = k->owned_words;
+  }
+
+  k->rows[0] = 0;
+  for(i = 0; i < k->sv_count; i++){
+    SVECTOR *f = m->supvec[i + 1]->fvec;
+
+    for(n = 0; f->words[n].wnum; n++)
+      ;
+
+    if(k->owned_words)
+      memcpy(k->words + k->rows[i], f->words, sizeof(WORD) * (n + 1));
+
+    k->rows[i + 1] = k->rows[i] + n + 1;
+    // The SVECTOR factor multiplies the kernel value, fold it in the coefficient
+    k->coefs[i]    = m->alpha[i + 1] * f->factor;
+    // SVM-light's create_svector leaves twonorm_sq at -1, so it is not trusted
+    k->norms[i]    = sprod_ss(f, f);
+  }
+
+  rm->kernel = k;
+}
+
+/* Builds the engine of a model mapped from a binary file straight on the file's
+ * sections (see binary_model.c), nothing is copied so every process mapping the file
+ * shares them. rows are the int64 offsets of the support vectors in words, alpha and
+ * norms the per support vector arrays, all with the unused element 0 of SVM-light. */
+void
+kernel_engine_prepare_mapped(RMODEL *rm, WORD *words, const int64_t *rows, const double *alpha,
+                             const double *norms){
+  MODEL *m = rm->m;
+  struct kernel_engine *k;
+  long i;
+
+  if(rm->linear || rm->kernel)
+    return;
+
+  if(sizeof(long) != sizeof(int64_t)){
+    kernel_engine_prepare(rm);
+    return;
+  }
+
+  if(m->kernel_parm.kernel_type != POLY && m->kernel_parm.kernel_type != RBF &&
+     m->kernel_parm.kernel_type != SIGMOID)
+    return;
+
+  // Files written before the norms were computed on write hold -1, those are rebuilt
+  for(i = 1; i < m->sv_num; i++){
+    if(norms[i] < 0){
+      kernel_engine_prepare(rm);
+      return;
+    }
+  }
+
+  // Offsets from the start of words, binary models store SVECTOR factors of 1 so the
+  // coefficients are the alphas as they are
+  k = (struct kernel_engine *)my_malloc(sizeof(struct kernel_engine));
+  memset(k, 0, sizeof(struct kernel_engine));
+  k->sv_count = m->sv_num > 1 ? m->sv_num - 1 : 0;
+  k->words    = words;
+  k->rows     = (long *)(rows + 1);
+  k->coefs    = (double *)(alpha + 1);
+  k->norms    = (double *)(norms + 1);
+  k->mapped   = 1;
+
+  rm->kernel = k;
+}
+
+void
+kernel_engine_free(RMODEL *rm){
+  struct kernel_engine *k = rm->kernel;
+
+  if(!k)
+    return;
+
+  if(!k->mapped){
+    free(k->rows);
+    free(k->coefs);
+    free(k->norms);
+  }
+
+  free(k->owned_words);
+  free(k);
+  rm->kernel = NULL;
+}
+
+static void *
+kernel_sweep(void *ptr){
+  KERNEL_SWEEP *sweep = (KERNEL_SWEEP *)ptr;
+  struct kernel_engine *k = sweep->rm->kernel;
+  KERNEL_PARM *p = &(sweep->rm->m->kernel_parm);
+  double sum = 0.0, dot;
+  long i;
+
+  for(i = sweep->from; i < sweep->to; i++){
+    dot = dense_sparse_dot(sweep->dense, sweep->len, k->words + k->rows[i],
+                           k->rows[i + 1] - k->rows[i] - 1);
+
+    switch(p->kernel_type){
+    case POLY:
+      sum += k->coefs[i] * pow(p->coef_lin * dot + p->coef_const, (double)p->poly_degree);
+      break;
+    case RBF:
+      sum += k->coefs[i] * exp(-p->rbf_gamma * (k->norms[i] - 2 * dot + sweep->ex_norm));
+      break;
+    default:
+      sum += k->coefs[i] * tanh(p->coef_lin * dot + p->coef_const);
+    }
+  }
+
+  sweep->sum = sum;
+
+  return NULL;
+}
+
+/* Takes the first queued slice, pool_lock must be held */
+static KERNEL_SWEEP *
+pool_pop(){
+  KERNEL_SWEEP *sweep = pool_head;
+
+  if(sweep){
+    pool_head = sweep->next;
+    if(!pool_head)
+      pool_tail = NULL;
+  }
+
+  return sweep;
+}
+
+/* Sweeps sweep and reports it done, pool_lock must be held and is held on return */
+static void
+pool_run(KERNEL_SWEEP *sweep){
+  pthread_mutex_unlock(&pool_lock);
+  kernel_sweep(sweep);
+  pthread_mutex_lock(&pool_lock);
+
+  if(--*sweep->pending == 0)
+    pthread_cond_broadcast(&pool_done);
+}
+
+static void *
+pool_worker(void *ptr){
+  KERNEL_SWEEP *sweep;
+
+  pthread_mutex_lock(&pool_lock);
+
+  for(;;){
+    while(!(sweep = pool_pop()))
+      pthread_cond_wait(&pool_work, &pool_lock);
+
+    pool_run(sweep);
+  }
+
+  return NULL;
+}
+
+/* Starts workers until there are n, pool_lock must be held. Workers block every signal,
+ * they are left to Ruby's threads. */
+static void
+pool_grow(long n){
+  pthread_attr_t attr;
+  pthread_t thread;
+  sigset_t all, old;
+
+  if(pool_workers >= n)
+    return;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  while(pool_workers < n && pthread_create(&thread, &attr, pool_worker, NULL) == 0)
+    pool_workers++;
+
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* The child of a fork only has the thread that forked, its queue starts empty */
+static void
+pool_atfork_child(){
+  pthread_mutex_init(&pool_lock, NULL);
+  pthread_cond_init(&pool_work, NULL);
+  pthread_cond_init(&pool_done, NULL);
+  pool_head    = NULL;
+  pool_tail    = NULL;
+  pool_workers = 0;
+}
+
+/* Bytes malloc'd for the engine, 0 for engines built on a mapping */
+size_t
+kernel_engine_heap_bytes(RMODEL *rm){
+  struct kernel_engine *k = rm->kernel;
+
+  if(!k || k->mapped)
+    return 0;
+
+  return sizeof(struct kernel_engine) + (sizeof(long) + 2 * sizeof(double)) * (k->sv_count + 1) +
+         (k->owned_words ? sizeof(WORD) * k->rows[k->sv_count] : 0);
+}
+
+/* Scores ex, the result is the same classify_example would give */
+double
+kernel_engine_classify(RMODEL *rm, DOC *ex){
+  struct kernel_engine *k = rm->kernel;
+  MODEL *m = rm->m;
+  KERNEL_SWEEP sweeps[KERNEL_MAX_THREADS], *sweep;
+  double *dense, ex_norm = 0.0, sum = 0.0;
+  long len = m->totwords + 1, nthreads, pending, i, n;
+  WORD *words;
+
+  if(!single_vector(ex) || !(dense = dense_buffer_get(len)))
+    return classify_example(m, ex);
+
+  words = ex->fvec->words;
+  for(n = 0; words[n].wnum; n++){
+    if(words[n].wnum < len)
+      dense[words[n].wnum] += words[n].weight;
+  }
+
+  // Only rbf uses the norm, documents made by create_svector have -1 there
+  if(m->kernel_parm.kernel_type == RBF)
+    ex_norm = ex->fvec->twonorm_sq >= 0 ? ex->fvec->twonorm_sq : sprod_ss(ex->fvec, ex->fvec);
+
+  nthreads = (k->rows[k->sv_count] - k->rows[0]) / KERNEL_MIN_WORDS_PER_THREAD;
+  if(nthreads > kernel_threads)
+    nthreads = kernel_threads;
+  if(nthreads < 1)
+    nthreads = 1;
+
+  pending = nthreads - 1;
+  for(i = 0; i < nthreads; i++){
+    sweeps[i].rm      = rm;
+    sweeps[i].dense   = dense;
+    sweeps[i].len     = len;
+    sweeps[i].ex_norm = ex_norm;
+    sweeps[i].from    = k->sv_count * i / nthreads;
+    sweeps[i].to      = k->sv_count * (i + 1) / nthreads;
+    sweeps[i].sum     = 0.0;
+    sweeps[i].pending = &pending;
+    sweeps[i].next    = i + 1 < nthreads ? &sweeps[i + 1] : NULL;
+  }
+
+  // The calling thread takes the first slice and queues the others, then sweeps queued
+  // slices (its own or other documents') until a worker finished the last of its own
+  if(nthreads > 1){
+    pthread_mutex_lock(&pool_lock);
+    pool_grow(kernel_threads - 1);
+
+    if(pool_tail)
+      pool_tail->next = &sweeps[1];
+    else
+      pool_head = &sweeps[1];
+    pool_tail = &sweeps[nthreads - 1];
+
+    pthread_cond_broadcast(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+  }
+
+  kernel_sweep(&sweeps[0]);
+
+  if(nthreads > 1){
+    pthread_mutex_lock(&pool_lock);
+
+    while(pending > 0){
+      if((sweep = pool_pop()))
+        pool_run(sweep);
+      else
+        pthread_cond_wait(&pool_done, &pool_lock);
+    }
+
+    pthread_mutex_unlock(&pool_lock);
+  }
+
+  // Summed in slice order so results do not depend on thread timing
+  for(i = 0; i < nthreads; i++)
+    sum += sweeps[i].sum;
+
+  for(n = 0; words[n].wnum; n++){
+    if(words[n].wnum < len)
+      dense[words[n].wnum] = 0.0;
+  }
+
+  return ex->fvec->factor * sum - m->b;
+}
+
+/* Number of threads non linear models may use to score one document, 1 by default */
+static VALUE
+svmlight_kernel_threads(VALUE mod){
+  return LONG2NUM(kernel_threads);
+}
+
+/* Sets the number of threads used to score one document with a non linear model, only
+ * models with large support vector sets are split so small ones are not slowed down.
+ * @param [Fixnum] n between 1 and 64, :auto uses the number of online CPUs
+ */
+static VALUE
+svmlight_set_kernel_threads(VALUE mod, VALUE n){
+  long c_n;
+
+  if(SYMBOL_P(n) && SYM2ID(n) == rb_intern("auto")){
+    c_n = sysconf(_SC_NPROCESSORS_ONLN);
+  }else{
+    Check_Type(n, T_FIXNUM);
+    c_n = FIX2LONG(n);
+
+    if(c_n < 1 || c_n > KERNEL_MAX_THREADS)
+      rb_raise(rb_eArgError, "kernel_threads must be between 1 and %d", KERNEL_MAX_THREADS);
+  }
+
+  if(c_n < 1)
+    c_n = 1;
+  if(c_n > KERNEL_MAX_THREADS)
+    c_n = KERNEL_MAX_THREADS;
+
+  kernel_threads = c_n;
+
+  return LONG2NUM(kernel_threads);
+}
+
+void
+Init_svmredlight_kernel_engine(){
+  pthread_key_create(&dense_key, dense_buffer_free);
+  pthread_atfork(NULL, NULL, pool_atfork_child);
+
+  rb_define_module_function(rb_mSvmLight, "kernel_threads", svmlight_kernel_threads, 0);
+  rb_define_module_function(rb_mSvmLight, "kernel_threads=", svmlight_set_kernel_threads, 1);
+}
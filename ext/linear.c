@@ -0,0 +1,237 @@
+#include "svmredlight.h"
+#include "string.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Scoring engine for linear models. A linear model's score is w*x - b, with w the dense
+ * lin_weights vector, so a document is scored by gathering the weights of its (sparse)
+ * features. On x86 CPUs with AVX2 or AVX-512 the gather, and the float to double
+ * conversion of the feature values, are done several words at a time, elsewhere a
+ * scalar loop is used. The kernel is picked once, when the extension is loaded, setting
+ * SVMREDLIGHT_DISABLE_SIMD in the environment forces the scalar one. */
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(HAVE_IMMINTRIN_H)
+#define SVMREDLIGHT_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+typedef double (*linear_dot_fn)(const double *w, long len, const WORD *words, long n);
+
+static linear_dot_fn linear_dot;
+static const char *linear_engine_name;
+
+static long
+count_words(const WORD *words){
+  long n = 0;
+
+  while(words[n].wnum)
+    n++;
+
+  return n;
+}
+
+/* Features beyond the weight vector (not seen in training) have a weight of 0 */
+static double
+linear_dot_scalar(const double *w, long len, const WORD *words, long n){
+  double sum = 0.0;
+  long i;
+
+  for(i=0; i < n; i++){
+    if(words[i].wnum < len)
+      sum += w[words[i].wnum] * (double)words[i].weight;
+  }
+
+  return sum;
+}
+
+#ifdef SVMREDLIGHT_X86_SIMD
+
+/* 4 words per iteration, a WORD is {int32 wnum, float weight} so 4 of them fill a 256
+ * bit register, the permutation splits feature numbers and values into two halves */
+__attribute__((target("avx2,fma")))
+static double
+linear_dot_avx2(const double *w, long len, const WORD *words, long n){
+  const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+  const __m128i limit = _mm_set1_epi32((int)(len > INT32_MAX ? INT32_MAX : len));
+  __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+  __m256i raw;
+  __m128i wnums, mask;
+  __m256d values, gathered;
+  double lanes[4];
+  long i = 0;
+
+  for(; i + 4 <= n; i += 4){
+    raw      = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)(words + i)), split);
+    wnums    = _mm256_castsi256_si128(raw);
+    values   = _mm256_cvtps_pd(_mm_castsi128_ps(_mm256_extracti128_si256(raw, 1)));
+    mask     = _mm_cmpgt_epi32(limit, wnums);
+    gathered = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), w, wnums,
+                                        _mm256_castsi256_pd(_mm256_cvtepi32_epi64(mask)), 8);
+
+    // Two accumulators so consecutive FMAs do not wait on each other
+    if(i & 4)
+      acc1 = _mm256_fmadd_pd(gathered, values, acc1);
+    else
+      acc0 = _mm256_fmadd_pd(gathered, values, acc0);
+  }
+
+  _mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+  // Leave the upper halves clean, SSE code (libm) after a dirty state is much slower
+  _mm256_zeroupper();
+
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + linear_dot_scalar(w, len, words + i, n - i);
+}
+
+/* Same as the AVX2 kernel, 8 words per iteration */
+__attribute__((target("avx512f")))
+static double
+linear_dot_avx512(const double *w, long len, const WORD *words, long n){
+  const __m512i split = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+  const __m512i limit = _mm512_set1_epi32((int)(len > INT32_MAX ? INT32_MAX : len));
+  __m512d acc = _mm512_setzero_pd();
+  __m512i raw;
+  __m256i wnums;
+  __m512d values, gathered;
+  __mmask8 mask;
+  double sum;
+  long i = 0;
+
+  for(; i + 8 <= n; i += 8){
+    raw      = _mm512_permutexvar_epi32(split, _mm512_loadu_si512((const void *)(words + i)));
+    wnums    = _mm512_castsi512_si256(raw);
+    values   = _mm512_cvtps_pd(_mm256_castsi256_ps(_mm512_extracti64x4_epi64(raw, 1)));
+    // Only the low 8 lanes of raw hold feature numbers
+    mask     = (__mmask8)(_mm512_cmplt_epi32_mask(raw, limit) & 0xff);
+    gathered = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), mask, wnums, w, 8);
+    acc      = _mm512_fmadd_pd(gathered, values, acc);
+  }
+
+  sum = _mm512_reduce_add_pd(acc);
+  _mm256_zeroupper();
+
+  return sum + linear_dot_scalar(w, len, words + i, n - i);
+}
+
+#endif
+
+static void
+linear_lock_init(pthread_rwlock_t *lock){
+  pthread_rwlockattr_t attr;
+
+  pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+  // Keep a stream of batch scorers from starving Model#update
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+  pthread_rwlock_init(lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+}
+
+/* Sets up the engine for a linear model, lin_weights is computed if the model does not
+ * have it yet and moved to a LINEAR_WEIGHTS_ALIGN aligned buffer (still malloc'd memory,
+ * so free_model can release it). Weights mapped from a binary model file are already
+ * aligned and used in place. */
+void
+linear_engine_prepare(RMODEL *rm){
+  MODEL *m = rm->m;
+  void *aligned;
+
+  if(!is_linear(m) || rm->linear)
+    return;
+
+  if(!m->lin_weights)
+    add_weight_vector_to_linear_model(m);
+
+  if(((uintptr_t)m->lin_weights) % LINEAR_WEIGHTS_ALIGN != 0){
+    if(posix_memalign(&aligned, LINEAR_WEIGHTS_ALIGN, sizeof(double) * (m->totwords + 1)) != 0)
+      rb_raise(rb_eNoMemError, "Cannot allocate the linear weights");
+
+    memcpy(aligned, m->lin_weights, sizeof(double) * (m->totwords + 1));
+    free(m->lin_weights);
+    m->lin_weights = (double *)aligned;
+  }
+
+  linear_lock_init(&rm->lock);
+  rm->linear = 1;
+}
+
+void
+linear_engine_free(RMODEL *rm){
+  if(rm->linear)
+    pthread_rwlock_destroy(&rm->lock);
+}
+
+/* Classifies ex with rm, linear models go through the dense weights engine (compact ones
+ * through compact.c, updated ones through online.c), polynomial, rbf and sigmoid ones
+ * through kernel_engine.c, everything else through SVM-light's classify_example.
+ *
+ * Model#update replaces the weights of a linear model (the first update swaps them for
+ * an online buffer) while other threads may be scoring without the GVL, so linear
+ * models are scored holding rm->lock for reading. */
+double
+rmodel_classify(RMODEL *rm, DOC *ex){
+  MODEL *m = rm->m;
+  SVECTOR *f;
+  double sum = 0.0;
+
+  if(rm->compact)
+    return compact_classify(rm, ex);
+
+  if(rm->kernel)
+    return kernel_engine_classify(rm, ex);
+
+  if(!rm->linear)
+    return classify_example(m, ex);
+
+  pthread_rwlock_rdlock(&rm->lock);
+
+  if(rm->online){
+    sum = online_classify(rm, ex);
+  }else{
+    for(f = ex->fvec; f; f = f->next)
+      sum += f->factor * linear_dot(m->lin_weights, m->totwords + 1, f->words, count_words(f->words));
+
+    sum -= m->b;
+  }
+
+  pthread_rwlock_unlock(&rm->lock);
+
+  return sum;
+}
+
+/* Dot product of the first n words with the dense vector w of len elements, with the
+ * same kernel linear models are scored with */
+double
+dense_sparse_dot(const double *w, long len, const WORD *words, long n){
+  return linear_dot(w, len, words, n);
+}
+
+/* Name of the kernel used to score linear models: "avx512", "avx2" or "scalar" */
+static VALUE
+svmlight_linear_engine(VALUE mod){
+  return rb_str_new2(linear_engine_name);
+}
+
+void
+Init_svmredlight_linear(){
+  linear_dot         = linear_dot_scalar;
+  linear_engine_name = "scalar";
+
+#ifdef SVMREDLIGHT_X86_SIMD
+  if(sizeof(WORD) == 8 && sizeof(FNUM) == 4 && sizeof(FVAL) == 4 &&
+     !getenv("SVMREDLIGHT_DISABLE_SIMD")){
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx512f")){
+      linear_dot         = linear_dot_avx512;
+      linear_engine_name = "avx512";
+    }else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+      linear_dot         = linear_dot_avx2;
+      linear_engine_name = "avx2";
+    }
+  }
+#endif
+
+  rb_define_module_function(rb_mSvmLight, "linear_engine", svmlight_linear_engine, 0);
+}
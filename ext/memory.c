@@ -0,0 +1,76 @@
+#include "svmredlight.h"
+
+/* Native memory held by live objects, per class. Wrapping an object adds its bytes,
+ * freeing it takes them back and objects that grow (online models, document sets)
+ * report the difference. Every change is passed on to ruby's GC with
+ * rb_gc_adjust_memory_usage, so the malloc'd weights and support vectors behind a few
+ * small objects count towards the next collection like ruby's own allocations do.
+ *
+ * Objects are created and freed from several Ractors at once, the counters are updated
+ * atomically. The file mappings of binary models are not malloc'd and other processes
+ * may share them, they are counted apart and not reported to the GC. */
+
+static const char *memory_kinds[MEMORY_KINDS] = {
+  "models", "documents", "document_sets", "multi_models", "featurizers"
+};
+
+static long memory_objects[MEMORY_KINDS];
+static long memory_bytes[MEMORY_KINDS];
+static long memory_mapped;
+static long memory_allocated; // every byte ever added, never decreases
+
+/* Call it with the GVL, from dfree too */
+void
+memory_adjust(int kind, long objects, long bytes){
+  __atomic_fetch_add(&memory_objects[kind], objects, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&memory_bytes[kind], bytes, __ATOMIC_RELAXED);
+  if(bytes > 0)
+    __atomic_fetch_add(&memory_allocated, bytes, __ATOMIC_RELAXED);
+
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+  if(bytes != 0)
+    rb_gc_adjust_memory_usage(bytes);
+#endif
+}
+
+void
+memory_adjust_mapped(long bytes){
+  __atomic_fetch_add(&memory_mapped, bytes, __ATOMIC_RELAXED);
+}
+
+#define STAT(hash, name, value) rb_hash_aset(hash, ID2SYM(rb_intern(name)), value)
+
+/* Objects alive and the native bytes they hold, per class. bytes is the total reported
+ * to the GC, mapped_bytes what binary model files map on top of it. allocated_bytes
+ * only grows, like GC.stat(:total_allocated_objects) it counts what was allocated
+ * since the process started, freed or not.
+ * @return [Hash] {:models => {:objects => 2, :bytes => 1024}, ..., :bytes => 1024,
+ * :mapped_bytes => 0, :allocated_bytes => 4096}
+ */
+static VALUE
+memory_stats(VALUE self){
+  VALUE result = rb_hash_new(), kind;
+  long bytes, total = 0;
+  int i;
+
+  for(i = 0; i < MEMORY_KINDS; i++){
+    bytes  = __atomic_load_n(&memory_bytes[i], __ATOMIC_RELAXED);
+    total += bytes;
+
+    kind = rb_hash_new();
+    STAT(kind, "objects", LONG2NUM(__atomic_load_n(&memory_objects[i], __ATOMIC_RELAXED)));
+    STAT(kind, "bytes", LONG2NUM(bytes));
+    STAT(result, memory_kinds[i], kind);
+  }
+
+  STAT(result, "bytes", LONG2NUM(total));
+  STAT(result, "mapped_bytes", LONG2NUM(__atomic_load_n(&memory_mapped, __ATOMIC_RELAXED)));
+  STAT(result, "allocated_bytes", LONG2NUM(__atomic_load_n(&memory_allocated, __ATOMIC_RELAXED)));
+
+  return result;
+}
+
+void
+Init_svmredlight_memory(){
+  rb_define_singleton_method(rb_mSvmLight, "memory_stats", memory_stats, 0);
+}
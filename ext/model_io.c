@@ -0,0 +1,485 @@
+#include "svmredlight.h"
+#include "string.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <limits.h>
+
+/* Reading and writing models in SVM-light's text format without going through
+ * read_model and write_model, which only take paths and call exit(1) on errors. Models
+ * are parsed from a String, a mmap'd file or the chunks read from an IO object, the
+ * lines are fed to a parser that keeps its state between chunks and runs without the
+ * GVL. The header is 11 lines:
+
+     SVM-light Version V6.02
+     <kernel_type> # kernel type
+     <poly_degree> # kernel parameter -d
+     <rbf_gamma> # kernel parameter -g
+     <coef_lin> # kernel parameter -s
+     <coef_const> # kernel parameter -r
+     <custom># kernel parameter -u
+     <totwords> # highest feature index
+     <totdoc> # number of training documents
+     <sv_num> # number of support vectors plus 1
+     <b> # threshold b, each following line is a SV (starting with alpha*y)
+
+ * followed by sv_num - 1 support vectors, each in the same format as a document with
+ * alpha*y as its label. */
+
+#define MODEL_HEADER_LINES 11
+#define IO_CHUNK_SIZE 65536
+
+static ID id_read;
+static ID id_write;
+
+typedef struct model_parser {
+  MODEL       *m;
+  long        lineno;
+  long        sv;       // next support vector slot
+  PARSED_LINE line;
+  char        *pending; // incomplete line left from the previous chunk
+  size_t      pending_len;
+  size_t      pending_capacity;
+  int         failed;
+  char        error[300];
+} MODEL_PARSER;
+
+/* A chunk of input, offset is where parsing stopped if it was interrupted. Unless last
+ * is set a trailing line without its newline is kept for the next chunk */
+typedef struct model_parser_feed {
+  MODEL_PARSER *parser;
+  const char   *data;
+  size_t       len;
+  size_t       offset;
+  int          last;
+  volatile int interrupted;
+} MODEL_PARSER_FEED;
+
+/* The number at the start of a header line, strtod and strtol need NUL terminated
+ * strings and lines in a buffer are not */
+static int
+header_number(const char *start, const char *end, double *val){
+  char buf[128], *stop;
+  size_t n = end - start < (long)sizeof(buf) - 1 ? (size_t)(end - start) : sizeof(buf) - 1;
+
+  memcpy(buf, start, n);
+  buf[n] = '\0';
+  *val = strtod(buf, &stop);
+
+  return stop == buf || (*stop != '\0' && *stop != ' ' && *stop != '\t' && *stop != '#' &&
+                         *stop != '\r');
+}
+
+static int
+parse_header_line(MODEL_PARSER *p, const char *start, const char *end){
+  MODEL *m = p->m;
+  long n = p->lineno - 1;
+  const char *hash;
+  double val;
+
+  if(n == 0){
+    if(end - start < 18 || strncmp(start, "SVM-light Version ", 18) != 0){
+      strncpy(p->error, "not a SVM-light model", 300);
+      return -1;
+    }
+
+    if(strncmp(start + 18, VERSION, strlen(VERSION)) != 0){
+      snprintf(p->error, 300, "model version '%.*s' does not match SVM-light's %s",
+               (int)(end - start - 18 > 20 ? 20 : end - start - 18), start + 18, VERSION);
+      return -1;
+    }
+
+    return 0;
+  }
+
+  if(n == 6){
+    hash = memchr(start, '#', end - start);
+    n    = (hash ? hash : end) - start;
+
+    if(n > (long)sizeof(m->kernel_parm.custom) - 1)
+      n = sizeof(m->kernel_parm.custom) - 1;
+
+    memcpy(m->kernel_parm.custom, start, n);
+    m->kernel_parm.custom[n] = '\0';
+    return 0;
+  }
+
+  if(header_number(start, end, &val)){
+    snprintf(p->error, 300, "invalid model header '%.*s'",
+             (int)(end - start > 40 ? 40 : end - start), start);
+    return -1;
+  }
+
+  switch(n){
+  case 1: m->kernel_parm.kernel_type = (long)val; break;
+  case 2: m->kernel_parm.poly_degree = (long)val; break;
+  case 3: m->kernel_parm.rbf_gamma   = val; break;
+  case 4: m->kernel_parm.coef_lin    = val; break;
+  case 5: m->kernel_parm.coef_const  = val; break;
+  case 7: m->totwords                = (long)val; break;
+  case 8: m->totdoc                  = (long)val; break;
+  case 9:
+    if(val < 1 || val > LONG_MAX / (long)sizeof(DOC *)){
+      snprintf(p->error, 300, "invalid number of support vectors %.0f", val - 1);
+      return -1;
+    }
+
+    m->supvec = (DOC **)my_malloc(sizeof(DOC *) * (long)val);
+    m->alpha  = (double *)my_malloc(sizeof(double) * (long)val);
+    m->supvec[0] = NULL;
+    m->alpha[0]  = 0.0;
+    // sv_num grows as support vectors are parsed so a partial model can be freed
+    p->sv     = (long)val;
+    m->sv_num = 1;
+    break;
+  case 10: m->b = val; break;
+  }
+
+  return 0;
+}
+
+static void
+parse_model_line(MODEL_PARSER *p, const char *start, const char *end){
+  int found;
+
+  if(p->failed)
+    return;
+
+  p->lineno++;
+
+  if(p->lineno <= MODEL_HEADER_LINES){
+    p->failed = parse_header_line(p, start, end) != 0;
+    return;
+  }
+
+  found = parse_svmlight_line(start, end, &p->line, p->error);
+
+  if(found < 0){
+    p->failed = 1;
+  }else if(found){
+    if(p->m->sv_num >= p->sv){
+      snprintf(p->error, 300, "more support vectors than the %ld in the header", p->sv - 1);
+      p->failed = 1;
+      return;
+    }
+
+    // The same DOCs read_model makes, the comment is kept in userdefined
+    p->m->alpha[p->m->sv_num]  = p->line.label;
+    p->m->supvec[p->m->sv_num] = create_example(-1, 0, 0, 0.0,
+                                                create_svector(p->line.words, p->line.comment, 1.0));
+    p->m->sv_num++;
+  }
+}
+
+static int
+parser_append_pending(MODEL_PARSER *p, const char *data, size_t len){
+  char *pending;
+
+  if(p->pending_len + len > p->pending_capacity){
+    if(!(pending = (char *)realloc(p->pending, (p->pending_len + len) * 2))){
+      strncpy(p->error, "out of memory while reading the model", 300);
+      p->failed = 1;
+      return 1;
+    }
+
+    p->pending          = pending;
+    p->pending_capacity = (p->pending_len + len) * 2;
+  }
+
+  memcpy(p->pending + p->pending_len, data, len);
+  p->pending_len += len;
+
+  return 0;
+}
+
+static void *
+model_parser_feed_nogvl(void *ptr){
+  MODEL_PARSER_FEED *feed = (MODEL_PARSER_FEED *)ptr;
+  MODEL_PARSER *p = feed->parser;
+  const char *start, *end, *limit = feed->data + feed->len;
+  size_t len;
+
+  while(feed->offset < feed->len && !feed->interrupted && !p->failed){
+    start = feed->data + feed->offset;
+    end   = memchr(start, '\n', limit - start);
+
+    if(!end){
+      if(!feed->last){
+        parser_append_pending(p, start, limit - start);
+        feed->offset = feed->len;
+        break;
+      }
+
+      end = limit;
+    }
+
+    if(p->pending_len > 0){
+      if(parser_append_pending(p, start, end - start))
+        break;
+
+      len = p->pending_len;
+      p->pending_len = 0;
+      parse_model_line(p, p->pending, p->pending + len);
+    }else{
+      parse_model_line(p, start, end);
+    }
+
+    feed->offset = end < limit ? (size_t)(end - feed->data) + 1 : feed->len;
+  }
+
+  if(feed->last && feed->offset >= feed->len && p->pending_len > 0 && !p->failed){
+    len = p->pending_len;
+    p->pending_len = 0;
+    parse_model_line(p, p->pending, p->pending + len);
+  }
+
+  return NULL;
+}
+
+static void
+model_parser_feed_ubf(void *ptr){
+  ((MODEL_PARSER_FEED *)ptr)->interrupted = 1;
+}
+
+/* Parses len bytes of data, raises ArgumentError on format errors */
+static void
+model_parser_feed(MODEL_PARSER *p, const char *data, size_t len, int last){
+  MODEL_PARSER_FEED feed;
+
+  feed.parser = p;
+  feed.data   = data;
+  feed.len    = len;
+  feed.offset = 0;
+  feed.last   = last;
+
+  do{
+    feed.interrupted = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(model_parser_feed_nogvl, &feed, model_parser_feed_ubf, &feed);
+#else
+    model_parser_feed_nogvl(&feed);
+#endif
+    if(p->failed)
+      rb_raise(rb_eArgError, "line %ld: %s", p->lineno, p->error);
+
+    // Raises on Thread#raise, timeouts, etc. otherwise parsing carries on
+    if(feed.interrupted)
+      rb_thread_check_ints();
+  }while(feed.offset < feed.len || (last && p->pending_len > 0));
+
+  if(last && p->lineno < MODEL_HEADER_LINES)
+    rb_raise(rb_eArgError, "truncated model, the header is incomplete");
+
+  if(last && p->m->sv_num != p->sv)
+    rb_raise(rb_eArgError, "truncated model, %ld of %ld support vectors", p->m->sv_num - 1, p->sv - 1);
+}
+
+typedef struct model_load_args {
+  MODEL_PARSER parser;
+  MODEL        *loaded;
+  VALUE        source;
+  TEXT_BUFFER  buf;
+  int          is_io;
+  int          is_path;
+} MODEL_LOAD_ARGS;
+
+static VALUE
+model_load_body(VALUE ptr){
+  MODEL_LOAD_ARGS *args = (MODEL_LOAD_ARGS *)ptr;
+  VALUE chunk;
+
+  if(args->is_path){
+    model_parser_feed(&args->parser, args->buf.data, args->buf.len, 1);
+  }else if(args->is_io){
+    while(!NIL_P(chunk = rb_funcall(args->source, id_read, 1, INT2FIX(IO_CHUNK_SIZE)))){
+      StringValue(chunk);
+      model_parser_feed(&args->parser, RSTRING_PTR(chunk), RSTRING_LEN(chunk), 0);
+      RB_GC_GUARD(chunk);
+    }
+
+    model_parser_feed(&args->parser, NULL, 0, 1);
+  }else{
+    model_parser_feed(&args->parser, RSTRING_PTR(args->source), RSTRING_LEN(args->source), 1);
+  }
+
+  args->loaded   = args->parser.m;
+  args->parser.m = NULL;
+
+  return Qnil;
+}
+
+static VALUE
+model_load_cleanup(VALUE ptr){
+  MODEL_LOAD_ARGS *args = (MODEL_LOAD_ARGS *)ptr;
+
+  // Only a partial model is left here when parsing failed
+  if(args->parser.m)
+    free_model(args->parser.m, 1);
+
+  free(args->parser.pending);
+  parsed_line_free(&args->parser.line);
+  text_buffer_close(&args->buf);
+
+  return Qnil;
+}
+
+static VALUE
+model_load_source(VALUE klass, VALUE source, int is_path){
+  MODEL_LOAD_ARGS args;
+  RMODEL *rm;
+  int err;
+
+  memset(&args, 0, sizeof(args));
+  args.is_path = is_path;
+  args.is_io   = !is_path && rb_respond_to(source, id_read);
+
+  if(is_path){
+    FilePathValue(source);
+
+    if((err = text_buffer_open(StringValueCStr(source), &args.buf)) != 0)
+      rb_syserr_fail_str(err, source);
+  }else if(!args.is_io){
+    // A frozen copy (sharing the bytes) so the string cannot change while it is parsed
+    // without the GVL
+    source = rb_str_new_frozen(StringValue(source));
+  }
+
+  args.source   = source;
+  args.parser.m = (MODEL *)my_malloc(sizeof(MODEL));
+  memset(args.parser.m, 0, sizeof(MODEL));
+  args.parser.m->loo_error = args.parser.m->loo_recall = args.parser.m->loo_precision = -1;
+  args.parser.m->xa_error  = args.parser.m->xa_recall  = args.parser.m->xa_precision  = -1;
+  parsed_line_init(&args.parser.line);
+
+  rb_ensure(model_load_body, (VALUE)&args, model_load_cleanup, (VALUE)&args);
+  RB_GC_GUARD(source);
+
+  rm = rmodel_new(args.loaded);
+  linear_engine_prepare(rm);
+  kernel_engine_prepare(rm);
+
+  return model_wrap(klass, rm);
+}
+
+/* Parses a model in SVM-light's text format out of a String or an IO object (read in
+ * chunks), nothing touches the disk. Format errors raise ArgumentError.
+ * @param [String|IO] source the model itself or any object that responds to read
+ * @return [Model]
+ */
+static VALUE
+model_load(VALUE klass, VALUE source){
+  return model_load_source(klass, source, 0);
+}
+
+/* Reads a model file in SVM-light's text format, the file is mmap'd and parsed without
+ * the GVL, errors raise instead of exiting the process like read_model does
+ * @param [String] path
+ * @return [Model]
+ */
+static VALUE
+model_read_from_file(VALUE klass, VALUE path){
+  return model_load_source(klass, path, 1);
+}
+
+/* Output of Model#dump, lines are added to buf which is handed to io.write whenever it
+ * holds IO_CHUNK_SIZE bytes, without an io everything ends up in buf */
+typedef struct model_dumper {
+  VALUE io;
+  VALUE buf;
+} MODEL_DUMPER;
+
+__attribute__((format(printf, 2, 3)))
+static void
+dumper_printf(MODEL_DUMPER *d, const char *format, ...){
+  char line[128];
+  va_list args;
+  int n;
+
+  va_start(args, format);
+  n = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+
+  rb_str_cat(d->buf, line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1);
+}
+
+static void
+dumper_flush(MODEL_DUMPER *d, int force){
+  if(NIL_P(d->io) || (!force && RSTRING_LEN(d->buf) < IO_CHUNK_SIZE))
+    return;
+
+  rb_funcall(d->io, id_write, 1, d->buf);
+  d->buf = rb_str_buf_new(IO_CHUNK_SIZE + 1024);
+}
+
+/* Writes the model in SVM-light's text format, byte for byte what write_model writes, see
+ * Model#dump
+ * @param [IO|Nil] io any object that responds to write, nil to get a String back
+ * @return [String|IO]
+ */
+static VALUE
+model_dump(VALUE self, VALUE io){
+  RMODEL *rm = model_get(self);
+  MODEL *m = rm->m;
+  MODEL_DUMPER d;
+  SVECTOR *v;
+  long i, j, sv_num = 1;
+
+  if(rm->compact)
+    rb_raise(rb_eArgError, "Compact models can only be written with write_binary");
+
+  if(!NIL_P(io) && !rb_respond_to(io, id_write))
+    rb_raise(rb_eTypeError, "Expected an object that responds to write");
+
+  online_fold(rm);
+
+  d.io  = io;
+  d.buf = rb_str_buf_new(IO_CHUNK_SIZE + 1024);
+
+  for(i = 1; i < m->sv_num; i++){
+    for(v = m->supvec[i]->fvec; v; v = v->next)
+      sv_num++;
+  }
+
+  dumper_printf(&d, "SVM-light Version %s\n", VERSION);
+  dumper_printf(&d, "%ld # kernel type\n", m->kernel_parm.kernel_type);
+  dumper_printf(&d, "%ld # kernel parameter -d \n", m->kernel_parm.poly_degree);
+  dumper_printf(&d, "%.8g # kernel parameter -g \n", m->kernel_parm.rbf_gamma);
+  dumper_printf(&d, "%.8g # kernel parameter -s \n", m->kernel_parm.coef_lin);
+  dumper_printf(&d, "%.8g # kernel parameter -r \n", m->kernel_parm.coef_const);
+  dumper_printf(&d, "%s# kernel parameter -u \n", m->kernel_parm.custom);
+  dumper_printf(&d, "%ld # highest feature index \n", m->totwords);
+  dumper_printf(&d, "%ld # number of training documents \n", m->totdoc);
+  dumper_printf(&d, "%ld # number of support vectors plus 1 \n", sv_num);
+  dumper_printf(&d, "%.8g # threshold b, each following line is a SV (starting with alpha*y)\n", m->b);
+
+  for(i = 1; i < m->sv_num; i++){
+    for(v = m->supvec[i]->fvec; v; v = v->next){
+      dumper_printf(&d, "%.32g ", m->alpha[i] * v->factor);
+
+      for(j = 0; v->words[j].wnum; j++)
+        dumper_printf(&d, "%ld:%.8g ", (long)v->words[j].wnum, (double)v->words[j].weight);
+
+      rb_str_cat2(d.buf, "#");
+      if(v->userdefined)
+        rb_str_cat2(d.buf, v->userdefined);
+      rb_str_cat2(d.buf, "\n");
+
+      dumper_flush(&d, 0);
+    }
+  }
+
+  if(NIL_P(io))
+    return d.buf;
+
+  dumper_flush(&d, 1);
+  return io;
+}
+
+void
+Init_svmredlight_model_io(){
+  id_read  = rb_intern("read");
+  id_write = rb_intern("write");
+
+  rb_define_singleton_method(rb_cModel, "load", model_load, 1);
+  rb_define_singleton_method(rb_cModel, "from_file", model_read_from_file, 1);
+  rb_define_method(rb_cModel, "dump_to", model_dump, 1);
+}
@@ -0,0 +1,408 @@
+#include "svmredlight.h"
+#include "string.h"
+#include <stdlib.h>
+
+/* One vs rest scoring over many linear models at once. The weights of every model are
+ * stacked feature-major, row f of the matrix holds the weight of feature f in each
+ * model, so a document is scored against all of them in a single pass over its words:
+ * every word adds its value times its row to a vector of per class accumulators. Rows
+ * are padded to a multiple of 4 (8 past 4 classes) and the accumulation is done with
+ * AVX2/AVX-512 where available, picked the same way as in linear.c. */
+
+#define MULTI_MODEL_ALIGN 64
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(HAVE_IMMINTRIN_H)
+#define SVMREDLIGHT_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+typedef struct multi_model {
+  long   nclasses;
+  long   stride;   // nclasses rounded up, the length of a row
+  long   len;      // rows, the largest totwords + 1, features past it weigh 0
+  double *weights; // len * stride, MULTI_MODEL_ALIGN aligned
+  double *b;       // stride thresholds
+} MULTI_MODEL;
+
+typedef void (*multi_accumulate_fn)(const MULTI_MODEL *mm, const WORD *words, double factor,
+                                    double *acc);
+
+static VALUE rb_cMultiModel;
+static multi_accumulate_fn multi_accumulate;
+
+static void
+multi_accumulate_scalar(const MULTI_MODEL *mm, const WORD *words, double factor, double *acc){
+  const double *row;
+  double x;
+  long n, c;
+
+  for(n = 0; words[n].wnum; n++){
+    if(words[n].wnum >= mm->len)
+      continue;
+
+    row = mm->weights + words[n].wnum * mm->stride;
+    x   = factor * words[n].weight;
+
+    for(c = 0; c < mm->stride; c++)
+      acc[c] += row[c] * x;
+  }
+}
+
+#ifdef SVMREDLIGHT_X86_SIMD
+
+__attribute__((target("avx2,fma")))
+static void
+multi_accumulate_avx2(const MULTI_MODEL *mm, const WORD *words, double factor, double *acc){
+  const double *row;
+  __m256d x;
+  long n, c;
+
+  for(n = 0; words[n].wnum; n++){
+    if(words[n].wnum >= mm->len)
+      continue;
+
+    row = mm->weights + words[n].wnum * mm->stride;
+    x   = _mm256_set1_pd(factor * words[n].weight);
+
+    for(c = 0; c < mm->stride; c += 4)
+      _mm256_storeu_pd(acc + c, _mm256_fmadd_pd(_mm256_load_pd(row + c), x, _mm256_loadu_pd(acc + c)));
+  }
+
+  _mm256_zeroupper();
+}
+
+/* Rows of 4 are done with AVX2 instructions, which AVX-512 CPUs have */
+__attribute__((target("avx512f,avx2,fma")))
+static void
+multi_accumulate_avx512(const MULTI_MODEL *mm, const WORD *words, double factor, double *acc){
+  const double *row;
+  __m512d x;
+  long n, c;
+
+  if(mm->stride % 8 != 0){
+    multi_accumulate_avx2(mm, words, factor, acc);
+    return;
+  }
+
+  for(n = 0; words[n].wnum; n++){
+    if(words[n].wnum >= mm->len)
+      continue;
+
+    row = mm->weights + words[n].wnum * mm->stride;
+    x   = _mm512_set1_pd(factor * words[n].weight);
+
+    for(c = 0; c < mm->stride; c += 8)
+      _mm512_storeu_pd(acc + c, _mm512_fmadd_pd(_mm512_load_pd(row + c), x, _mm512_loadu_pd(acc + c)));
+  }
+
+  _mm256_zeroupper();
+}
+
+#endif
+
+/* Scores ex against every class, acc must have room for stride doubles */
+static void
+multi_model_score(const MULTI_MODEL *mm, DOC *ex, double *acc){
+  SVECTOR *f;
+  long c;
+
+  memset(acc, 0, sizeof(double) * mm->stride);
+
+  for(f = ex->fvec; f; f = f->next)
+    multi_accumulate(mm, f->words, f->factor, acc);
+
+  for(c = 0; c < mm->nclasses; c++)
+    acc[c] -= mm->b[c];
+}
+
+static void
+multi_model_free(MULTI_MODEL *mm){
+  if(!mm)
+    return;
+
+  free(mm->weights);
+  free(mm->b);
+  free(mm);
+}
+
+static size_t
+multi_model_memsize(const MULTI_MODEL *mm){
+  return sizeof(MULTI_MODEL) + sizeof(double) * (mm->len + 1) * mm->stride;
+}
+
+static void
+multi_model_dfree(void *ptr){
+  if(ptr)
+    memory_adjust(MEMORY_MULTI_MODELS, -1, -(long)multi_model_memsize((MULTI_MODEL *)ptr));
+
+  multi_model_free((MULTI_MODEL *)ptr);
+}
+
+static size_t
+multi_model_dsize(const void *ptr){
+  return ptr ? multi_model_memsize((const MULTI_MODEL *)ptr) : 0;
+}
+
+static const rb_data_type_t multi_model_data_type = {
+  "SVMLight::MultiModel",
+  {0, multi_model_dfree, multi_model_dsize},
+  0, 0,
+  SVMREDLIGHT_TYPED_FLAGS
+};
+
+static MULTI_MODEL *
+multi_model_get(VALUE self){
+  MULTI_MODEL *mm;
+  TypedData_Get_Struct(self, MULTI_MODEL, &multi_model_data_type, mm);
+
+  return mm;
+}
+
+/* Stacks the weights of the models, see MultiModel.new
+ * @param [Array] models linear (or compact) Models
+ * @return [MultiModel]
+ */
+static VALUE
+multi_model_create(VALUE klass, VALUE models){
+  MULTI_MODEL *mm;
+  RMODEL *rm;
+  VALUE result;
+  double *w;
+  void *aligned;
+  long c, f;
+
+  Check_Type(models, T_ARRAY);
+
+  if(RARRAY_LEN(models) == 0)
+    rb_raise(rb_eArgError, "At least one model is needed");
+
+  for(c = 0; c < RARRAY_LEN(models); c++){
+    if(!rb_obj_is_kind_of(RARRAY_PTR(models)[c], rb_cModel))
+      rb_raise(rb_eTypeError, "All elements of the models array must be Models");
+
+    rm = model_get(RARRAY_PTR(models)[c]);
+
+    if(!rm->linear && !rm->compact)
+      rb_raise(rb_eArgError, "Only linear models can be stacked, model %ld is not linear", c);
+
+    online_fold(rm);
+  }
+
+  mm = (MULTI_MODEL *)my_malloc(sizeof(MULTI_MODEL));
+  memset(mm, 0, sizeof(MULTI_MODEL));
+  mm->nclasses = RARRAY_LEN(models);
+  mm->stride   = mm->nclasses <= 4 ? 4 : (mm->nclasses + 7) / 8 * 8;
+
+  for(c = 0; c < mm->nclasses; c++){
+    rm = model_get(RARRAY_PTR(models)[c]);
+
+    if(rm->m->totwords + 1 > mm->len)
+      mm->len = rm->m->totwords + 1;
+  }
+
+  if(posix_memalign(&aligned, MULTI_MODEL_ALIGN, sizeof(double) * mm->len * mm->stride) != 0){
+    free(mm);
+    rb_raise(rb_eNoMemError, "Cannot allocate the weights of %ld models", RARRAY_LEN(models));
+  }
+
+  mm->weights = (double *)aligned;
+  memset(mm->weights, 0, sizeof(double) * mm->len * mm->stride);
+  mm->b       = (double *)my_malloc(sizeof(double) * mm->stride);
+  memset(mm->b, 0, sizeof(double) * mm->stride);
+
+  for(c = 0; c < mm->nclasses; c++){
+    rm = model_get(RARRAY_PTR(models)[c]);
+    mm->b[c] = rm->m->b;
+
+    if(rm->compact){
+      w = (double *)my_malloc(sizeof(double) * rm->compact->len);
+      compact_expand(rm->compact, w);
+    }else{
+      w = rm->m->lin_weights;
+    }
+
+    for(f = 0; f < rm->m->totwords + 1; f++)
+      mm->weights[f * mm->stride + c] = w[f];
+
+    if(rm->compact)
+      free(w);
+  }
+
+  result = TypedData_Wrap_Struct(klass, &multi_model_data_type, mm);
+  memory_adjust(MEMORY_MULTI_MODELS, 1, (long)multi_model_memsize(mm));
+
+  return result;
+}
+
+static VALUE
+scores_to_ary(const double *scores, long n){
+  VALUE result = rb_ary_new2(n);
+  long i;
+
+  for(i = 0; i < n; i++)
+    rb_ary_push(result, DBL2NUM(scores[i]));
+
+  return result;
+}
+
+/* The score of document in every class, in the order the models were given
+ * @param [Document] document
+ * @return [Array] Floats
+ */
+static VALUE
+multi_model_classify(VALUE self, VALUE document){
+  MULTI_MODEL *mm = multi_model_get(self);
+  VALUE result;
+  double *acc;
+  DOC *ex;
+
+  if(rb_obj_class(document) != rb_cDocument)
+    rb_raise(rb_eTypeError, "Expected a Document");
+
+  ex = document_get(document);
+
+  acc = (double *)my_malloc(sizeof(double) * mm->stride);
+  multi_model_score(mm, ex, acc);
+  result = scores_to_ary(acc, mm->nclasses);
+  free(acc);
+
+  return result;
+}
+
+/* Same as the batch loop of Model#classify_batch, results holds nclasses scores per
+ * document */
+typedef struct multi_batch_args {
+  MULTI_MODEL *mm;
+  DOC    **docs;
+  double *results;
+  double *acc;
+  long   n;
+  long   next;
+  VALUE  packed;
+  volatile int interrupted;
+} MULTI_BATCH_ARGS;
+
+static void *
+multi_batch_nogvl(void *ptr){
+  MULTI_BATCH_ARGS *args = (MULTI_BATCH_ARGS *)ptr;
+
+  for(; args->next < args->n && !args->interrupted; args->next++){
+    multi_model_score(args->mm, args->docs[args->next], args->acc);
+    memcpy(args->results + args->next * args->mm->nclasses, args->acc,
+           sizeof(double) * args->mm->nclasses);
+  }
+
+  return NULL;
+}
+
+static void
+multi_batch_ubf(void *ptr){
+  ((MULTI_BATCH_ARGS *)ptr)->interrupted = 1;
+}
+
+static VALUE
+multi_batch_body(VALUE ptr){
+  MULTI_BATCH_ARGS *args = (MULTI_BATCH_ARGS *)ptr;
+  long nclasses = args->mm->nclasses, i;
+  VALUE result;
+
+  while(args->next < args->n){
+    args->interrupted = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(multi_batch_nogvl, args, multi_batch_ubf, args);
+#else
+    multi_batch_nogvl(args);
+#endif
+    if(args->next < args->n)
+      rb_thread_check_ints();
+  }
+
+  if(RTEST(args->packed))
+    return rb_str_new((char *)args->results, sizeof(double) * nclasses * args->n);
+
+  result = rb_ary_new2(args->n);
+
+  for(i = 0; i < args->n; i++)
+    rb_ary_push(result, scores_to_ary(args->results + i * nclasses, nclasses));
+
+  return result;
+}
+
+static VALUE
+multi_batch_cleanup(VALUE ptr){
+  MULTI_BATCH_ARGS *args = (MULTI_BATCH_ARGS *)ptr;
+
+  free(args->docs);
+  free(args->results);
+  free(args->acc);
+
+  return Qnil;
+}
+
+/* Scores many Documents in one call, with the GVL released
+ * @param [Array] r_docs an array of Documents
+ * @param [Bool] packed if true return a binary String of native doubles, the scores of
+ * each document one after the other, instead of an Array of Arrays of Floats
+ */
+static VALUE
+multi_model_classify_batch(VALUE self, VALUE r_docs, VALUE packed){
+  MULTI_BATCH_ARGS args;
+  VALUE docs, result;
+  long i;
+
+  Check_Type(r_docs, T_ARRAY);
+
+  docs = rb_ary_dup(r_docs);
+
+  for(i = 0; i < RARRAY_LEN(docs); i++){
+    if(rb_obj_class(RARRAY_PTR(docs)[i]) != rb_cDocument)
+      rb_raise(rb_eTypeError, "All elements of the documents array must be Documents");
+  }
+
+  args.mm          = multi_model_get(self);
+  args.n           = (long)RARRAY_LEN(docs);
+  args.next        = 0;
+  args.packed      = packed;
+  args.interrupted = 0;
+  args.docs        = (DOC **)my_malloc(sizeof(DOC *) * (args.n + 1));
+  args.results     = (double *)my_malloc(sizeof(double) * args.mm->nclasses * (args.n + 1));
+  args.acc         = (double *)my_malloc(sizeof(double) * args.mm->stride);
+
+  for(i = 0; i < args.n; i++)
+    args.docs[i] = document_get(RARRAY_PTR(docs)[i]);
+
+  result = rb_ensure(multi_batch_body, (VALUE)&args, multi_batch_cleanup, (VALUE)&args);
+
+  RB_GC_GUARD(docs);
+  return result;
+}
+
+/* Number of stacked models */
+static VALUE
+multi_model_size(VALUE self){
+  return LONG2NUM(multi_model_get(self)->nclasses);
+}
+
+void
+Init_svmredlight_multi_model(){
+  multi_accumulate = multi_accumulate_scalar;
+
+#ifdef SVMREDLIGHT_X86_SIMD
+  if(sizeof(WORD) == 8 && !getenv("SVMREDLIGHT_DISABLE_SIMD")){
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") &&
+       __builtin_cpu_supports("fma"))
+      multi_accumulate = multi_accumulate_avx512;
+    else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      multi_accumulate = multi_accumulate_avx2;
+  }
+#endif
+
+  rb_cMultiModel = rb_define_class_under(rb_mSvmLight, "MultiModel", rb_cObject);
+  rb_undef_alloc_func(rb_cMultiModel);
+  rb_define_singleton_method(rb_cMultiModel, "create", multi_model_create, 1);
+  rb_define_method(rb_cMultiModel, "classify", multi_model_classify, 1);
+  rb_define_method(rb_cMultiModel, "classify_many", multi_model_classify_batch, 2);
+  rb_define_method(rb_cMultiModel, "size", multi_model_size, 0);
+}
@@ -0,0 +1,462 @@
+#include "svmredlight.h"
+#include "string.h"
+#include <math.h>
+
+/* Online updates of linear models, Model#update and Model#update_batch. The first update
+ * turns the model into an online one: its weights move to a heap buffer that grows with
+ * new features, and its support vectors, which no longer describe the weights, are
+ * dropped.
+ *
+ * The weight vector is kept as scale * lin_weights so Pegasos' shrinking step
+ * (w = (1 - eta * lambda) w) is a multiplication of scale, and an update costs O(nnz) of
+ * the documents instead of O(totwords). norm2 is |lin_weights|^2, kept up to date the
+ * same way, for Pegasos' projection step. Passive aggressive updates never shrink.
+ *
+ * Updates run with the GVL held, scoring (rmodel_classify) can run without it, so
+ * updates take the model's lock for writing and every document of a linear model, online
+ * or not yet, is scored under it for reading, against one consistent version of the
+ * weights. That includes the first update, which frees the weights and support vectors
+ * the model was trained or loaded with. Whatever reads lin_weights directly
+ * (write_binary, dump, compact, MultiModel) calls online_fold first, which multiplies
+ * scale into lin_weights and stores them as the model's single support vector (alpha
+ * 1), so online models are written in both formats like any other linear model. */
+
+#define ONLINE_PEGASOS            1
+#define ONLINE_PASSIVE_AGGRESSIVE 2
+
+/* Folded into lin_weights before it gets small enough to lose precision */
+#define ONLINE_MIN_SCALE 1e-9
+
+typedef struct online_state {
+  double scale;
+  double norm2;
+  long   capacity;
+  long   updates;
+  double *alpha;
+  int    dirty;
+} ONLINE_STATE;
+
+static double *
+online_weights_alloc(long len){
+  void *w;
+
+  if(posix_memalign(&w, LINEAR_WEIGHTS_ALIGN, sizeof(double) * len) != 0)
+    return NULL;
+
+  return (double *)w;
+}
+
+/* Makes rm updatable, raises for models that are not linear */
+static void
+online_prepare(RMODEL *rm){
+  MODEL *m = rm->m;
+  ONLINE_STATE *s;
+  double *w;
+  long i;
+
+  if(!rm->linear || rm->compact)
+    rb_raise(rb_eArgError, "Only linear models that are not compact can be updated");
+
+  w = online_weights_alloc(m->totwords + 1);
+  if(!w)
+    rb_raise(rb_eNoMemError, "Cannot allocate the weights of an online model");
+
+  s = (ONLINE_STATE *)my_malloc(sizeof(ONLINE_STATE));
+  memset(s, 0, sizeof(ONLINE_STATE));
+  s->scale    = 1.0;
+  s->capacity = m->totwords + 1;
+  s->alpha    = (double *)my_malloc(sizeof(double) * 2);
+  s->alpha[0] = 0.0;
+  s->alpha[1] = 1.0;
+
+  memcpy(w, m->lin_weights, sizeof(double) * (m->totwords + 1));
+  for(i = 0; i < m->totwords + 1; i++)
+    s->norm2 += w[i] * w[i];
+
+  // Other threads may be scoring with the weights about to be freed
+  pthread_rwlock_wrlock(&rm->lock);
+
+  // Weights in a binary model's mapping stay there, see binary_model_unmap
+  if(!rm->mapping){
+    for(i = 1; i < m->sv_num; i++)
+      free_example(m->supvec[i], 1);
+
+    free(m->lin_weights);
+    free(m->alpha);
+  }
+
+  m->supvec      = (DOC **)realloc(m->supvec, sizeof(DOC *) * 2);
+  m->supvec[0]   = NULL;
+  m->alpha       = s->alpha;
+  m->sv_num      = 1;
+  m->lin_weights = w;
+
+  rm->training_docnums = 0;
+  rm->online           = s;
+
+  pthread_rwlock_unlock(&rm->lock);
+}
+
+/* Room for feature wnum, new features start at 0. Call it holding rm->lock */
+static int
+online_grow(RMODEL *rm, long wnum){
+  ONLINE_STATE *s = rm->online;
+  MODEL *m = rm->m;
+  long capacity = s->capacity;
+  double *w;
+
+  if(wnum <= m->totwords)
+    return 0;
+
+  if(wnum >= capacity){
+    while(capacity <= wnum)
+      capacity *= 2;
+
+    if(!(w = online_weights_alloc(capacity)))
+      return 1;
+
+    memcpy(w, m->lin_weights, sizeof(double) * (m->totwords + 1));
+    free(m->lin_weights);
+    m->lin_weights = w;
+    s->capacity    = capacity;
+  }
+
+  memset(m->lin_weights + m->totwords + 1, 0, sizeof(double) * (wnum - m->totwords));
+  m->totwords = wnum;
+
+  return 0;
+}
+
+static long
+doc_max_wnum(DOC *d){
+  SVECTOR *f;
+  WORD *word;
+  long max = 0;
+
+  for(f = d->fvec; f; f = f->next){
+    for(word = f->words; word->wnum; word++){
+      if(word->wnum > max)
+        max = word->wnum;
+    }
+  }
+
+  return max;
+}
+
+/* lin_weights'x and |x|^2, every feature of x is in lin_weights (see online_grow) */
+static double
+online_dot(MODEL *m, DOC *d, double *xnorm2){
+  SVECTOR *f;
+  WORD *word;
+  double sum = 0.0, partial;
+
+  if(xnorm2)
+    *xnorm2 = 0.0;
+
+  for(f = d->fvec; f; f = f->next){
+    partial = 0.0;
+
+    for(word = f->words; word->wnum; word++){
+      partial += m->lin_weights[word->wnum] * word->weight;
+
+      if(xnorm2)
+        *xnorm2 += f->factor * f->factor * word->weight * word->weight;
+    }
+
+    sum += f->factor * partial;
+  }
+
+  return sum;
+}
+
+/* lin_weights += a * x, keeping norm2 up to date */
+static void
+online_axpy(RMODEL *rm, double a, DOC *d){
+  ONLINE_STATE *s = rm->online;
+  MODEL *m = rm->m;
+  SVECTOR *f;
+  WORD *word;
+  double xnorm2, dot = online_dot(m, d, &xnorm2);
+
+  for(f = d->fvec; f; f = f->next){
+    for(word = f->words; word->wnum; word++)
+      m->lin_weights[word->wnum] += a * f->factor * word->weight;
+  }
+
+  s->norm2 += 2 * a * dot + a * a * xnorm2;
+}
+
+static void
+online_rescale(RMODEL *rm){
+  ONLINE_STATE *s = rm->online;
+  MODEL *m = rm->m;
+  long i;
+
+  for(i = 0; i < m->totwords + 1; i++)
+    m->lin_weights[i] *= s->scale;
+
+  s->norm2 *= s->scale * s->scale;
+  s->scale  = 1.0;
+}
+
+/* One mini-batch Pegasos step (Shalev-Shwartz et al., Pegasos: Primal Estimated
+ * sub-GrAdient SOlver for SVM), a trained model counts as the result of totdoc steps so
+ * the first updates do not wipe it out */
+static long
+online_pegasos(RMODEL *rm, DOC **docs, double *labels, long n, double lambda){
+  ONLINE_STATE *s = rm->online;
+  MODEL *m = rm->m;
+  double eta, *step, norm2;
+  long i, violations = 0, t;
+
+  t    = ++s->updates + (m->totdoc > 0 ? m->totdoc : 1);
+  eta  = 1.0 / (lambda * t);
+  step = (double *)my_malloc(sizeof(double) * n);
+
+  // Margins are taken before the step, all against the same weights
+  for(i = 0; i < n; i++){
+    step[i] = 0.0;
+
+    if(labels[i] != 0 && (labels[i] > 0 ? 1 : -1) * (s->scale * online_dot(m, docs[i], NULL) - m->b) < 1){
+      step[i] = labels[i] > 0 ? 1.0 : -1.0;
+      violations++;
+    }
+  }
+
+  s->scale *= 1.0 - eta * lambda;
+
+  if(s->scale < ONLINE_MIN_SCALE)
+    online_rescale(rm);
+
+  for(i = 0; i < n; i++){
+    if(step[i] != 0){
+      online_axpy(rm, eta * step[i] / (n * s->scale), docs[i]);
+      m->b -= eta * step[i] / n;
+    }
+  }
+
+  // Projection onto the ball of radius 1 / sqrt(lambda)
+  norm2 = s->scale * s->scale * s->norm2;
+  if(norm2 > 1.0 / lambda)
+    s->scale *= 1.0 / sqrt(lambda * norm2);
+
+  free(step);
+
+  return violations;
+}
+
+/* PA-I (Crammer et al., Online Passive-Aggressive Algorithms), one document at a time,
+ * the bias is the weight of a feature that is always 1 */
+static long
+online_passive_aggressive(RMODEL *rm, DOC **docs, double *labels, long n, double c){
+  ONLINE_STATE *s = rm->online;
+  MODEL *m = rm->m;
+  double y, loss, xnorm2, tau;
+  long i, violations = 0;
+
+  for(i = 0; i < n; i++){
+    if(labels[i] == 0)
+      continue;
+
+    y    = labels[i] > 0 ? 1.0 : -1.0;
+    loss = 1.0 - y * (s->scale * online_dot(m, docs[i], &xnorm2) - m->b);
+
+    if(loss <= 0)
+      continue;
+
+    tau = fmin(c, loss / (xnorm2 + 1.0));
+    online_axpy(rm, tau * y / s->scale, docs[i]);
+    m->b -= tau * y;
+    violations++;
+  }
+
+  s->updates++;
+
+  return violations;
+}
+
+/* Scores ex with an online model, rmodel_classify holds rm->lock for reading. The dot
+ * products go through the kernel of the other linear models, so right after the first
+ * update copied the weights (scale 1) scores are exactly the ones from before it */
+double
+online_classify(RMODEL *rm, DOC *ex){
+  ONLINE_STATE *s = rm->online;
+  MODEL *m = rm->m;
+  SVECTOR *f;
+  double sum = 0.0;
+  long n;
+
+  for(f = ex->fvec; f; f = f->next){
+    for(n = 0; f->words[n].wnum; n++)
+      ;
+
+    sum += f->factor * dense_sparse_dot(m->lin_weights, m->totwords + 1, f->words, n);
+  }
+
+  return s->scale * sum - m->b;
+}
+
+/* Multiplies scale into lin_weights and stores them as the model's support vector, call
+ * it (with the GVL) before reading lin_weights or the support vectors of rm, nothing to
+ * do for models that were never updated */
+void
+online_fold(RMODEL *rm){
+  ONLINE_STATE *s = rm->online;
+  MODEL *m;
+  WORD *words;
+  long i, n = 0;
+
+  if(!s)
+    return;
+
+  m = rm->m;
+  pthread_rwlock_wrlock(&rm->lock);
+
+  if(s->dirty){
+    online_rescale(rm);
+
+    words = (WORD *)my_malloc(sizeof(WORD) * (m->totwords + 1));
+    for(i = 1; i < m->totwords + 1; i++){
+      if(m->lin_weights[i] != 0){
+        words[n].wnum   = i;
+        words[n].weight = (FVAL)m->lin_weights[i];
+        n++;
+      }
+    }
+    words[n].wnum = 0;
+
+    if(m->sv_num > 1)
+      free_example(m->supvec[1], 1);
+
+    m->supvec[1] = create_example(-1, 0, 0, 1.0, create_svector(words, (char *)"", 1.0));
+    m->sv_num    = 2;
+    s->dirty     = 0;
+
+    free(words);
+  }
+
+  pthread_rwlock_unlock(&rm->lock);
+  model_memory_sync(rm);
+}
+
+/* Bytes of the state and of the weights, which have room for capacity features */
+size_t
+online_heap_bytes(const RMODEL *rm){
+  if(!rm->online)
+    return 0;
+
+  return sizeof(ONLINE_STATE) + sizeof(double) * rm->online->capacity;
+}
+
+void
+online_free(RMODEL *rm){
+  ONLINE_STATE *s = rm->online;
+
+  if(!s)
+    return;
+
+  if(rm->m->sv_num > 1)
+    free_example(rm->m->supvec[1], 1);
+
+  rm->m->sv_num = 1;
+  rm->m->alpha  = NULL;
+
+  free(s->alpha);
+  free(s);
+  rm->online = NULL;
+}
+
+/* Updates the model with documents and labels, see Model#update_batch
+ * @param [Array] documents_and_labels [Document, label] pairs
+ * @param [Symbol] rule :pegasos or :passive_aggressive
+ * @param [Float] lambda Pegasos' regularization, 0 for 1 / totdoc
+ * @param [Float] c passive aggressive's aggressiveness
+ * @return [Fixnum] how many of the documents changed the weights
+ */
+static VALUE
+model_online_update(VALUE self, VALUE documents_and_labels, VALUE rule, VALUE lambda, VALUE c){
+  RMODEL *rm = model_get(self);
+  ID rule_id;
+  int c_rule;
+  double c_lambda = NUM2DBL(lambda), c_c = NUM2DBL(c), *labels;
+  long n, i, max = 0, violations;
+  DOC **docs;
+  VALUE pair;
+
+  rb_check_frozen(self);
+  Check_Type(documents_and_labels, T_ARRAY);
+  Check_Type(rule, T_SYMBOL);
+
+  rule_id = SYM2ID(rule);
+  if(rule_id == rb_intern("pegasos"))
+    c_rule = ONLINE_PEGASOS;
+  else if(rule_id == rb_intern("passive_aggressive"))
+    c_rule = ONLINE_PASSIVE_AGGRESSIVE;
+  else
+    rb_raise(rb_eArgError, "The update rule must be :pegasos or :passive_aggressive");
+
+  if(c_lambda < 0 || c_c <= 0)
+    rb_raise(rb_eArgError, "lambda cannot be negative and c must be greater than zero");
+
+  n = RARRAY_LEN(documents_and_labels);
+  for(i = 0; i < n; i++){
+    pair = RARRAY_PTR(documents_and_labels)[i];
+
+    if(TYPE(pair) != T_ARRAY || RARRAY_LEN(pair) < 2 ||
+       rb_obj_class(RARRAY_PTR(pair)[0]) != rb_cDocument ||
+       !(TYPE(RARRAY_PTR(pair)[1]) == T_FLOAT || TYPE(RARRAY_PTR(pair)[1]) == T_FIXNUM))
+      rb_raise(rb_eArgError, "Expected [Document, label] pairs");
+  }
+
+  if(n == 0)
+    return INT2FIX(0);
+
+  if(!rm->online)
+    online_prepare(rm);
+
+  if(c_lambda == 0)
+    c_lambda = 1.0 / (rm->m->totdoc > 0 ? rm->m->totdoc : 1);
+
+  docs   = (DOC **)my_malloc(sizeof(DOC *) * n);
+  labels = (double *)my_malloc(sizeof(double) * n);
+
+  for(i = 0; i < n; i++){
+    pair      = RARRAY_PTR(documents_and_labels)[i];
+    docs[i]   = document_get(RARRAY_PTR(pair)[0]);
+    labels[i] = NUM2DBL(RARRAY_PTR(pair)[1]);
+
+    if(doc_max_wnum(docs[i]) > max)
+      max = doc_max_wnum(docs[i]);
+  }
+
+  pthread_rwlock_wrlock(&rm->lock);
+
+  if(online_grow(rm, max) != 0){
+    pthread_rwlock_unlock(&rm->lock);
+    free(docs);
+    free(labels);
+    rb_raise(rb_eNoMemError, "Cannot grow the weights of an online model");
+  }
+
+  if(c_rule == ONLINE_PEGASOS)
+    violations = online_pegasos(rm, docs, labels, n, c_lambda);
+  else
+    violations = online_passive_aggressive(rm, docs, labels, n, c_c);
+
+  rm->online->dirty = 1;
+
+  pthread_rwlock_unlock(&rm->lock);
+
+  free(docs);
+  free(labels);
+
+  // The weights may have grown, the support vectors are gone after the first update
+  model_memory_sync(rm);
+
+  return LONG2NUM(violations);
+}
+
+void
+Init_svmredlight_online(){
+  rb_define_method(rb_cModel, "online_update", model_online_update, 4);
+}
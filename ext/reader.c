@@ -0,0 +1,611 @@
+#include "svmredlight.h"
+#include "string.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+/* Size of the chunks read from IO objects */
+#define IO_CHUNK_SIZE 65536
+
+static ID id_read;
+
+/* Maps the file at path (or reads it in memory when mmap is not available), on error
+ * returns the errno value, 0 otherwise */
+int
+text_buffer_open(const char *path, TEXT_BUFFER *buf){
+  int fd, err;
+  struct stat st;
+  ssize_t got;
+  size_t done = 0;
+
+  buf->data   = NULL;
+  buf->len    = 0;
+  buf->mapped = 0;
+
+  if((fd = open(path, O_RDONLY)) < 0)
+    return errno;
+
+  if(fstat(fd, &st) != 0){
+    err = errno;
+    close(fd);
+    return err;
+  }
+
+  buf->len = (size_t)st.st_size;
+
+  if(buf->len == 0){
+    close(fd);
+    return 0;
+  }
+
+#ifdef HAVE_SYS_MMAN_H
+  buf->data = mmap(NULL, buf->len, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if(buf->data != MAP_FAILED){
+    madvise(buf->data, buf->len, MADV_SEQUENTIAL);
+    buf->mapped = 1;
+    close(fd);
+    return 0;
+  }
+#endif
+
+  buf->data = (char *)my_malloc(buf->len);
+
+  while(done < buf->len){
+    got = read(fd, buf->data + done, buf->len - done);
+
+    if(got <= 0){
+      err = got == 0 ? EIO : errno;
+      free(buf->data);
+      buf->data = NULL;
+      close(fd);
+      return err;
+    }
+
+    done += (size_t)got;
+  }
+
+  close(fd);
+  return 0;
+}
+
+void
+text_buffer_close(TEXT_BUFFER *buf){
+  if(!buf->data)
+    return;
+
+#ifdef HAVE_SYS_MMAN_H
+  if(buf->mapped)
+    munmap(buf->data, buf->len);
+  else
+#endif
+    free(buf->data);
+
+  buf->data = NULL;
+}
+
+void
+parsed_line_init(PARSED_LINE *line){
+  line->words_capacity   = 64;
+  line->words            = (WORD *)my_malloc(sizeof(WORD) * line->words_capacity);
+  line->nwords           = 0;
+  line->comment_capacity = 64;
+  line->comment          = (char *)my_malloc(line->comment_capacity);
+  line->comment[0]       = '\0';
+}
+
+void
+parsed_line_free(PARSED_LINE *line){
+  free(line->words);
+  free(line->comment);
+  line->words   = NULL;
+  line->comment = NULL;
+}
+
+static const char *
+skip_blanks(const char *p, const char *end){
+  while(p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+    p++;
+
+  return p;
+}
+
+static const char *
+token_end(const char *p, const char *end){
+  while(p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '#')
+    p++;
+
+  return p;
+}
+
+/* strtod needs a NUL terminated string, tokens in a mmap'd file are not, so they are
+ * copied first, numbers in the format are never longer than a few dozen chars */
+static int
+parse_double(const char *p, const char *end, double *val){
+  char num[64], *tail;
+  size_t len = end - p;
+
+  if(len == 0 || len >= sizeof(num))
+    return 1;
+
+  memcpy(num, p, len);
+  num[len] = '\0';
+  *val = strtod(num, &tail);
+
+  return *tail != '\0';
+}
+
+static int
+parse_long(const char *p, const char *end, long *val){
+  long sign = 1, v = 0;
+
+  if(p < end && (*p == '-' || *p == '+')){
+    sign = *p == '-' ? -1 : 1;
+    p++;
+  }
+
+  if(p == end)
+    return 1;
+
+  for(; p < end; p++){
+    if(*p < '0' || *p > '9' || v > MAXFEATNUM)
+      return 1;
+
+    v = v * 10 + (*p - '0');
+  }
+
+  *val = sign * v;
+  return 0;
+}
+
+/* Parses one line (from start up to, not including, end) in SVM-light's format
+
+     <label> [qid:<long>] [sid:<long>] [cost:<double>] <wnum>:<weight> ... [# comment]
+
+ * Feature numbers must be positive and increasing. Returns 1 when the line had an
+ * example, 0 when it is empty or just a comment, and -1 on format errors, in that case
+ * error (300 chars) gets the message */
+int
+parse_svmlight_line(const char *start, const char *end, PARSED_LINE *line, char *error){
+  const char *p, *tok, *colon;
+  long wnum, lastwnum = 0, comment_len;
+  double weight;
+
+  line->nwords     = 0;
+  line->queryid    = 0;
+  line->slackid    = 0;
+  line->costfactor = 1.0;
+  line->comment[0] = '\0';
+  line->words[0].wnum = 0;
+
+  p = skip_blanks(start, end);
+
+  if(p == end || *p == '#' || *p == '\n')
+    return 0;
+
+  tok = p;
+  p = token_end(p, end);
+
+  if(parse_double(tok, p, &line->label)){
+    snprintf(error, 300, "Invalid label '%.*s'", (int)(p - tok > 40 ? 40 : p - tok), tok);
+    return -1;
+  }
+
+  for(p = skip_blanks(p, end); p < end && *p != '#'; p = skip_blanks(p, end)){
+    tok   = p;
+    p     = token_end(p, end);
+    colon = memchr(tok, ':', p - tok);
+
+    if(!colon){
+      snprintf(error, 300, "Expected <feature>:<value> but found '%.*s'",
+               (int)(p - tok > 40 ? 40 : p - tok), tok);
+      return -1;
+    }
+
+    if(colon - tok == 3 && strncmp(tok, "qid", 3) == 0){
+      if(parse_long(colon + 1, p, &line->queryid)){
+        strncpy(error, "Invalid qid value", 300);
+        return -1;
+      }
+    }else if(colon - tok == 3 && strncmp(tok, "sid", 3) == 0){
+      if(parse_long(colon + 1, p, &line->slackid)){
+        strncpy(error, "Invalid sid value", 300);
+        return -1;
+      }
+    }else if(colon - tok == 4 && strncmp(tok, "cost", 4) == 0){
+      if(parse_double(colon + 1, p, &line->costfactor)){
+        strncpy(error, "Invalid cost value", 300);
+        return -1;
+      }
+    }else{
+      if(parse_long(tok, colon, &wnum) || parse_double(colon + 1, p, &weight)){
+        snprintf(error, 300, "Invalid feature '%.*s'", (int)(p - tok > 40 ? 40 : p - tok), tok);
+        return -1;
+      }
+
+      if(wnum <= 0 || wnum > MAXFEATNUM){
+        snprintf(error, 300, "Feature number %ld out of range [1..%ld]", wnum, (long)MAXFEATNUM);
+        return -1;
+      }
+
+      if(wnum <= lastwnum){
+        snprintf(error, 300, "Features must be in increasing order (%ld after %ld)", wnum, lastwnum);
+        return -1;
+      }
+
+      if(line->nwords + 2 > line->words_capacity){
+        line->words_capacity *= 2;
+        line->words = (WORD *)realloc(line->words, sizeof(WORD) * line->words_capacity);
+
+        if(!line->words){
+          strncpy(error, "Out of memory while parsing features", 300);
+          return -1;
+        }
+      }
+
+      line->words[line->nwords].wnum   = wnum;
+      line->words[line->nwords].weight = (FVAL)weight;
+      line->nwords++;
+      lastwnum = wnum;
+    }
+  }
+
+  line->words[line->nwords].wnum = 0;
+
+  if(p < end && *p == '#'){
+    p++;
+    comment_len = end - p;
+
+    while(comment_len > 0 && (p[comment_len - 1] == '\r' || p[comment_len - 1] == '\n'))
+      comment_len--;
+
+    if(comment_len + 1 > line->comment_capacity){
+      line->comment_capacity = comment_len + 1;
+      line->comment = (char *)realloc(line->comment, line->comment_capacity);
+
+      if(!line->comment){
+        strncpy(error, "Out of memory while parsing comment", 300);
+        return -1;
+      }
+    }
+
+    memcpy(line->comment, p, comment_len);
+    line->comment[comment_len] = '\0';
+  }
+
+  return 1;
+}
+
+/* Creates a DOC, owning copies of the words and comment, out of a parsed line */
+DOC *
+parsed_line_to_doc(PARSED_LINE *line, long docnum){
+  SVECTOR *vec;
+
+  vec = create_svector(line->words, line->comment, 1.0);
+
+  return create_example(docnum, line->queryid, line->slackid, line->costfactor, vec);
+}
+
+static VALUE
+wrap_document_and_label(DOC *d, double label){
+  return rb_assoc_new(document_wrap(rb_cDocument, d), DBL2NUM(label));
+}
+
+/* State for reading a whole file without the GVL, offset is where parsing stopped if it
+ * was interrupted */
+typedef struct read_file_args {
+  TEXT_BUFFER buf;
+  PARSED_LINE line;
+  size_t      offset;
+  long        lineno;
+  DOC         **docs;
+  double      *labels;
+  long        n;
+  long        capacity;
+  int         failed;
+  char        error[300];
+  volatile int interrupted;
+} READ_FILE_ARGS;
+
+static void *
+read_file_nogvl(void *ptr){
+  READ_FILE_ARGS *args = (READ_FILE_ARGS *)ptr;
+  const char *start, *end, *limit = args->buf.data + args->buf.len;
+  int found;
+
+  while(args->offset < args->buf.len && !args->interrupted){
+    start = args->buf.data + args->offset;
+    end   = memchr(start, '\n', limit - start);
+
+    if(!end)
+      end = limit;
+
+    args->lineno++;
+    found = parse_svmlight_line(start, end, &args->line, args->error);
+
+    if(found < 0){
+      args->failed = 1;
+      return NULL;
+    }
+
+    if(found){
+      if(args->n == args->capacity){
+        args->capacity = args->capacity ? args->capacity * 2 : 1024;
+        args->docs     = (DOC **)realloc(args->docs, sizeof(DOC *) * args->capacity);
+        args->labels   = (double *)realloc(args->labels, sizeof(double) * args->capacity);
+
+        if(!args->docs || !args->labels){
+          strncpy(args->error, "Out of memory while reading documents", 300);
+          args->failed = 1;
+          return NULL;
+        }
+      }
+
+      args->docs[args->n]   = parsed_line_to_doc(&args->line, args->n);
+      args->labels[args->n] = args->line.label;
+      args->n++;
+    }
+
+    args->offset = end - args->buf.data + 1;
+  }
+
+  return NULL;
+}
+
+static void
+read_file_ubf(void *ptr){
+  ((READ_FILE_ARGS *)ptr)->interrupted = 1;
+}
+
+static VALUE
+read_file_body(VALUE ptr){
+  READ_FILE_ARGS *args = (READ_FILE_ARGS *)ptr;
+  VALUE result;
+  long i;
+
+  while(args->offset < args->buf.len && !args->failed){
+    args->interrupted = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(read_file_nogvl, args, read_file_ubf, args);
+#else
+    read_file_nogvl(args);
+#endif
+    if(args->interrupted)
+      rb_thread_check_ints();
+  }
+
+  if(args->failed)
+    rb_raise(rb_eArgError, "line %ld: %s", args->lineno, args->error);
+
+  result = rb_ary_new2(args->n);
+
+  for(i=0; i < args->n; i++){
+    rb_ary_push(result, wrap_document_and_label(args->docs[i], args->labels[i]));
+    // From now on it belongs to the ruby object
+    args->docs[i] = NULL;
+  }
+
+  return result;
+}
+
+static VALUE
+read_file_cleanup(VALUE ptr){
+  READ_FILE_ARGS *args = (READ_FILE_ARGS *)ptr;
+  long i;
+
+  for(i=0; i < args->n; i++){
+    if(args->docs[i])
+      free_example(args->docs[i], 1);
+  }
+
+  free(args->docs);
+  free(args->labels);
+  parsed_line_free(&args->line);
+  text_buffer_close(&args->buf);
+
+  return Qnil;
+}
+
+static VALUE
+read_documents_from_file(VALUE path){
+  READ_FILE_ARGS args;
+  int err;
+
+  memset(&args, 0, sizeof(args));
+
+  if((err = text_buffer_open(StringValueCStr(path), &args.buf)) != 0)
+    rb_syserr_fail_str(err, path);
+
+  parsed_line_init(&args.line);
+
+  return rb_ensure(read_file_body, (VALUE)&args, read_file_cleanup, (VALUE)&args);
+}
+
+/* State shared by each_document and its cleanup, for files buf is the whole file, for
+ * IO objects it holds the current chunk plus the incomplete line left from the previous
+ * one */
+typedef struct each_args {
+  VALUE       source;
+  int         is_io;
+  TEXT_BUFFER buf;
+  char        *pending;
+  size_t      pending_len;
+  size_t      pending_capacity;
+  PARSED_LINE line;
+  long        lineno;
+  long        docnum;
+} EACH_ARGS;
+
+static void
+each_parse_and_yield(EACH_ARGS *args, const char *start, const char *end){
+  char error[300];
+  int found;
+
+  args->lineno++;
+  found = parse_svmlight_line(start, end, &args->line, error);
+
+  if(found < 0)
+    rb_raise(rb_eArgError, "line %ld: %s", args->lineno, error);
+
+  if(found){
+    rb_yield(wrap_document_and_label(parsed_line_to_doc(&args->line, args->docnum),
+                                     args->line.label));
+    args->docnum++;
+  }
+}
+
+static void
+each_append_pending(EACH_ARGS *args, const char *data, size_t len){
+  if(args->pending_len + len > args->pending_capacity){
+    args->pending_capacity = (args->pending_len + len) * 2;
+    args->pending = (char *)realloc(args->pending, args->pending_capacity);
+
+    if(!args->pending)
+      rb_raise(rb_eNoMemError, "Out of memory while reading documents");
+  }
+
+  memcpy(args->pending + args->pending_len, data, len);
+  args->pending_len += len;
+}
+
+static VALUE
+each_body(VALUE ptr){
+  EACH_ARGS *args = (EACH_ARGS *)ptr;
+  const char *start, *end, *limit;
+  size_t len;
+  VALUE chunk;
+
+  if(!args->is_io){
+    start = args->buf.data;
+    limit = args->buf.data + args->buf.len;
+
+    while(start < limit){
+      end = memchr(start, '\n', limit - start);
+
+      if(!end)
+        end = limit;
+
+      each_parse_and_yield(args, start, end);
+      start = end + 1;
+    }
+
+    return Qnil;
+  }
+
+  while(!NIL_P(chunk = rb_funcall(args->source, id_read, 1, INT2FIX(IO_CHUNK_SIZE)))){
+    StringValue(chunk);
+    start = RSTRING_PTR(chunk);
+    limit = start + RSTRING_LEN(chunk);
+
+    while(start < limit){
+      end = memchr(start, '\n', limit - start);
+
+      if(!end){
+        // Incomplete line, keep it until the next chunk arrives
+        each_append_pending(args, start, limit - start);
+        break;
+      }
+
+      if(args->pending_len > 0){
+        each_append_pending(args, start, end - start);
+        len = args->pending_len;
+        args->pending_len = 0;
+        each_parse_and_yield(args, args->pending, args->pending + len);
+      }else{
+        each_parse_and_yield(args, start, end);
+      }
+
+      start = end + 1;
+    }
+
+    RB_GC_GUARD(chunk);
+  }
+
+  if(args->pending_len > 0){
+    end = args->pending + args->pending_len;
+    args->pending_len = 0;
+    each_parse_and_yield(args, args->pending, end);
+  }
+
+  return Qnil;
+}
+
+static VALUE
+each_cleanup(VALUE ptr){
+  EACH_ARGS *args = (EACH_ARGS *)ptr;
+
+  free(args->pending);
+  parsed_line_free(&args->line);
+  text_buffer_close(&args->buf);
+
+  return Qnil;
+}
+
+/* Yields every labeled document in a file (path) or IO object in SVM-light's format as
+ * a pair [Document, label], documents are parsed one at a time so memory usage does not
+ * depend on the size of the input.
+ *
+ * @param [String|IO] path_or_io a file name or any object that responds to read
+ * */
+static VALUE
+svmlight_each_document(VALUE mod, VALUE path_or_io){
+  EACH_ARGS args;
+  int err;
+
+  RETURN_ENUMERATOR(mod, 1, &path_or_io);
+
+  memset(&args, 0, sizeof(args));
+  args.source = path_or_io;
+  args.is_io  = rb_respond_to(path_or_io, id_read);
+
+  if(!args.is_io){
+    FilePathValue(path_or_io);
+
+    if((err = text_buffer_open(StringValueCStr(path_or_io), &args.buf)) != 0)
+      rb_syserr_fail_str(err, path_or_io);
+  }
+
+  parsed_line_init(&args.line);
+  rb_ensure(each_body, (VALUE)&args, each_cleanup, (VALUE)&args);
+
+  return Qnil;
+}
+
+static VALUE
+collect_document(VALUE pair, VALUE result, int argc, const VALUE *argv, VALUE blockarg){
+  rb_ary_push(result, pair);
+  return Qnil;
+}
+
+/* Reads all the labeled documents in a file (path) or IO object in SVM-light's format,
+ * the result is an array of [Document, label] pairs ready for Model.new /
+ * learn_classification. Files are mmap'd and parsed without holding the GVL.
+ *
+ * @param [String|IO] path_or_io a file name or any object that responds to read
+ * */
+static VALUE
+svmlight_read_documents(VALUE mod, VALUE path_or_io){
+  VALUE result;
+
+  if(!rb_respond_to(path_or_io, id_read)){
+    FilePathValue(path_or_io);
+    return read_documents_from_file(path_or_io);
+  }
+
+  result = rb_ary_new();
+  rb_block_call(mod, rb_intern("each_document"), 1, &path_or_io, collect_document, result);
+
+  return result;
+}
+
+void
+Init_svmredlight_reader(){
+  id_read = rb_intern("read");
+
+  rb_define_module_function(rb_mSvmLight, "read_documents", svmlight_read_documents, 1);
+  rb_define_module_function(rb_mSvmLight, "each_document", svmlight_each_document, 1);
+}
@@ -0,0 +1,180 @@
+#include "svmredlight.h"
+#include "string.h"
+#include <time.h>
+#include <sys/resource.h>
+
+/* Training stats are captured around the svm_learn_classification call, inference stats
+ * are opt-in counters updated (atomically, scoring runs without the GVL) on every
+ * classify and classify_batch call. The latency histogram has power of two buckets, the
+ * first one counts calls under 1 microsecond and the last one everything above. */
+
+double
+stats_now(){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* CPU time of the calling thread, training runs on a single thread */
+double
+stats_thread_cpu_time(){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Peak resident set size of the process in bytes */
+long
+stats_peak_rss(){
+  struct rusage usage;
+
+  if(getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+
+  // Linux reports kilobytes
+  return usage.ru_maxrss * 1024;
+}
+
+void
+inference_stats_record(RMODEL *rm, long documents, double latency){
+  INFERENCE_STATS *s = rm->inference;
+  long nanoseconds = (long)(latency * 1e9), micros = nanoseconds / 1000;
+  int bucket = 0;
+
+  if(!s)
+    return;
+
+  while(micros > 0 && bucket < INFERENCE_STATS_BUCKETS - 1){
+    micros >>= 1;
+    bucket++;
+  }
+
+  __atomic_fetch_add(&s->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->documents, documents, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->latency_ns, nanoseconds, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&s->histogram[bucket], 1, __ATOMIC_RELAXED);
+}
+
+#define STAT(hash, name, value) rb_hash_aset(hash, ID2SYM(rb_intern(name)), value)
+
+/* What happened while training, nil for models that were not trained in this process.
+ * Times are seconds: setup_time collecting the documents, train_time (and
+ * train_cpu_time) inside SVM-light's solver, copy_time copying the support vectors out
+ * of the training set. kernel_evaluations is how much SVM-light's kernel_cache_statistic
+ * grew during training, that counter is process wide and non linear models scored by
+ * SVM-light in other threads at the same time are counted too.
+ * kernel_cache_rows/kernel_cache_max_rows how full the kernel cache (non linear kernels)
+ * was at the end. There is no cache hit rate, SVM-light does not count its cache
+ * lookups, the occupancy is what it exposes. peak_rss is the peak memory of the whole
+ * process, in bytes.
+ * @return [Hash|Nil]
+ */
+static VALUE
+model_training_stats(VALUE self){
+  RMODEL *rm = model_get(self);
+  TRAINING_STATS *s = rm->training;
+  VALUE result;
+
+  if(!s)
+    return Qnil;
+
+  result = rb_hash_new();
+  STAT(result, "documents", LONG2NUM(s->documents));
+  STAT(result, "features", LONG2NUM(s->features));
+  STAT(result, "support_vectors", LONG2NUM(rm->m->sv_num - 1));
+  STAT(result, "at_upper_bound", LONG2NUM(rm->m->at_upper_bound));
+  STAT(result, "maxdiff", DBL2NUM(rm->m->maxdiff));
+  STAT(result, "setup_time", DBL2NUM(s->setup_time));
+  STAT(result, "train_time", DBL2NUM(s->train_time));
+  STAT(result, "train_cpu_time", DBL2NUM(s->train_cpu_time));
+  STAT(result, "copy_time", DBL2NUM(s->copy_time));
+  STAT(result, "kernel_evaluations", LONG2NUM(s->kernel_evaluations));
+  STAT(result, "kernel_cache_size", LONG2NUM(s->kernel_cache_size));
+  STAT(result, "kernel_cache_rows", LONG2NUM(s->kernel_cache_rows));
+  STAT(result, "kernel_cache_max_rows", LONG2NUM(s->kernel_cache_max_rows));
+  STAT(result, "peak_rss", LONG2NUM(s->peak_rss));
+
+  return result;
+}
+
+/* Turns the inference counters on or off, turning them on again starts from 0. Frozen
+ * models keep counting (or not) as they were when frozen
+ * @param [Boolean] enabled
+ */
+static VALUE
+model_set_inference_stats(VALUE self, VALUE enabled){
+  RMODEL *rm = model_get(self);
+  INFERENCE_STATS *old = rm->inference;
+
+  rb_check_frozen(self);
+
+  if(RTEST(enabled)){
+    rm->inference = (INFERENCE_STATS *)my_malloc(sizeof(INFERENCE_STATS));
+    memset(rm->inference, 0, sizeof(INFERENCE_STATS));
+  }else{
+    rm->inference = NULL;
+  }
+
+  // Another thread may still be scoring with the old counters, they are small enough to
+  // be kept until the model goes away
+  if(old){
+    old->next = rm->retired_inference;
+    rm->retired_inference = old;
+  }
+
+  return enabled;
+}
+
+/* Counters of the classify and classify_batch calls since they were enabled, nil when
+ * they are not. latency is the total in seconds, latency_histogram maps the upper bound
+ * of each bucket (in seconds, the last one is Infinity) to the number of calls in it.
+ * @return [Hash|Nil]
+ */
+static VALUE
+model_inference_stats(VALUE self){
+  INFERENCE_STATS *s = model_get(self)->inference;
+  VALUE result, histogram;
+  int i;
+
+  if(!s)
+    return Qnil;
+
+  histogram = rb_hash_new();
+  for(i = 0; i < INFERENCE_STATS_BUCKETS; i++){
+    rb_hash_aset(histogram,
+                 i == INFERENCE_STATS_BUCKETS - 1 ? DBL2NUM(HUGE_VAL) : DBL2NUM((1L << i) / 1e6),
+                 LONG2NUM(__atomic_load_n(&s->histogram[i], __ATOMIC_RELAXED)));
+  }
+
+  result = rb_hash_new();
+  STAT(result, "calls", LONG2NUM(__atomic_load_n(&s->calls, __ATOMIC_RELAXED)));
+  STAT(result, "documents", LONG2NUM(__atomic_load_n(&s->documents, __ATOMIC_RELAXED)));
+  STAT(result, "latency", DBL2NUM(__atomic_load_n(&s->latency_ns, __ATOMIC_RELAXED) / 1e9));
+  STAT(result, "latency_histogram", histogram);
+
+  return result;
+}
+
+void
+stats_free(RMODEL *rm){
+  INFERENCE_STATS *s, *next;
+
+  free(rm->training);
+  free(rm->inference);
+
+  for(s = rm->retired_inference; s; s = next){
+    next = s->next;
+    free(s);
+  }
+}
+
+void
+Init_svmredlight_stats(){
+  rb_define_method(rb_cModel, "training_stats", model_training_stats, 0);
+  rb_define_method(rb_cModel, "inference_stats", model_inference_stats, 0);
+  rb_define_method(rb_cModel, "inference_stats=", model_set_inference_stats, 1);
+}
@@ -1,6 +1,7 @@
-#include "ruby.h"
-#include "svm_light/svm_common.h"
+#include "svmredlight.h"
 #include "string.h"
+#include <pthread.h>
+#include <stdint.h>
 
 /* Helper function to determine if a model uses linear kernel, this could be a #define
  * macro */
@@ -9,19 +10,212 @@ is_linear(MODEL *model){
   return model->kernel_parm.kernel_type == 0; 
 }
 
-static VALUE rb_mSvmLight;
-static VALUE rb_cModel;
-static VALUE rb_cDocument;
+VALUE rb_mSvmLight;
+VALUE rb_cModel;
+VALUE rb_cDocument;
+
+/* SVM-light's solver keeps part of its state in globals (svm_hideo.c, verbosity,
+ * kernel_cache_statistic), so even with the GVL released only one training can run at a
+ * time. solver_busy is that training, solver_lock protects it and solver_free is
+ * signaled when it is done, or when a waiting training is cancelled (see
+ * solver_interrupt) */
+static pthread_mutex_t solver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  solver_free = PTHREAD_COND_INITIALIZER;
+static int             solver_busy = 0;
+
+/* Waits for the solver, returns 1 without it if *cancelled is set first */
+static int
+solver_acquire(volatile int *cancelled){
+  pthread_mutex_lock(&solver_lock);
+
+  while(solver_busy && !*cancelled)
+    pthread_cond_wait(&solver_free, &solver_lock);
+
+  if(*cancelled){
+    pthread_mutex_unlock(&solver_lock);
+    return 1;
+  }
+
+  solver_busy = 1;
+  pthread_mutex_unlock(&solver_lock);
+
+  return 0;
+}
+
+static void
+solver_release(void){
+  pthread_mutex_lock(&solver_lock);
+  solver_busy = 0;
+  pthread_cond_broadcast(&solver_free);
+  pthread_mutex_unlock(&solver_lock);
+}
+
+/* Wakes the trainings waiting for the solver so they notice they were cancelled, call it
+ * from unblocking functions after setting the flag */
+void
+solver_interrupt(void){
+  pthread_mutex_lock(&solver_lock);
+  pthread_cond_broadcast(&solver_free);
+  pthread_mutex_unlock(&solver_lock);
+}
 
-/* Not using deep free anymore, let ruby call free on the documents otherwise we might end
- * up having double free problems, from svm_learn_main: Warning: The model contains
- * references to the original data 'docs'.  If you want to free the original data, and
- * only keep the model, you have to make a deep copy of 'model'.
- * deep_copy_of_model=copy_model(model); */
+/* Models read from files and trained models (a deep copy is made after training, see
+ * learn_classification_nogvl) own their support vectors so they are freed deep. */
 void 
-model_free(MODEL *m){
-  if(m)
-    free_model(m, 0);
+model_free(RMODEL *rm){
+  if(!rm)
+    return;
+
+  kernel_engine_free(rm);
+  online_free(rm);
+  linear_engine_free(rm);
+  compact_free(rm);
+  stats_free(rm);
+
+  if(rm->mapping)
+    binary_model_unmap(rm);
+  else if(rm->m)
+    free_model(rm->m, 1);
+
+  free(rm);
+}
+
+/* Creates the wrapper for a MODEL malloc'd the way read_model and svm_learn do it */
+RMODEL *
+rmodel_new(MODEL *m){
+  RMODEL *rm = (RMODEL *)my_malloc(sizeof(RMODEL));
+
+  memset(rm, 0, sizeof(RMODEL));
+  rm->m = m;
+
+  return rm;
+}
+
+/* Heap bytes of d and its SVECTOR chain */
+size_t
+doc_memsize(const DOC *d){
+  size_t size = sizeof(DOC);
+  SVECTOR *f;
+  WORD *word;
+
+  for(f = d->fvec; f; f = f->next){
+    for(word = f->words; word->wnum; word++)
+      ;
+
+    size += sizeof(SVECTOR) + sizeof(WORD) * (word - f->words + 1);
+
+    if(f->userdefined)
+      size += strlen(f->userdefined) + 1;
+  }
+
+  return size;
+}
+
+static int
+in_mapping(const RMODEL *rm, const void *ptr){
+  return rm->mapping && (const char *)ptr >= (const char *)rm->mapping &&
+         (const char *)ptr < (const char *)rm->mapping + rm->mapping_len;
+}
+
+/* Heap bytes of rm, the model and everything built for it. Whatever lives in the file
+ * mapping of a binary model (support vector words, alphas, weights) is not counted */
+size_t
+model_memsize(const RMODEL *rm){
+  MODEL *m = rm->m;
+  INFERENCE_STATS *s;
+  size_t size = sizeof(RMODEL);
+  long i;
+
+  if(m){
+    size += sizeof(MODEL) + sizeof(DOC *) * m->sv_num;
+
+    if(m->alpha && !in_mapping(rm, m->alpha))
+      size += sizeof(double) * m->sv_num;
+    if(m->index)
+      size += sizeof(long) * (m->totdoc + 2);
+    if(m->lin_weights && !in_mapping(rm, m->lin_weights) && !rm->online)
+      size += sizeof(double) * (m->totwords + 1);
+
+    for(i = 1; i < m->sv_num; i++){
+      // Only the headers of a binary model's support vectors are malloc'd, the one of an
+      // online model is always rebuilt on the heap
+      if(rm->mapping && !rm->online)
+        size += sizeof(DOC) + sizeof(SVECTOR);
+      else
+        size += doc_memsize(m->supvec[i]);
+    }
+  }
+
+  if(rm->training)
+    size += sizeof(TRAINING_STATS);
+
+  for(s = rm->inference; s; s = s->next)
+    size += sizeof(INFERENCE_STATS);
+  for(s = rm->retired_inference; s; s = s->next)
+    size += sizeof(INFERENCE_STATS);
+
+  if(rm->compact)
+    size += sizeof(COMPACT_WEIGHTS) + (rm->compact->owned ? compact_bytes(rm->compact) : 0);
+
+  return size + kernel_engine_heap_bytes((RMODEL *)rm) + online_heap_bytes(rm);
+}
+
+/* Tells memory.c (and the GC) how much rm holds now, call it with the GVL whenever a
+ * wrapped model grows or shrinks */
+void
+model_memory_sync(RMODEL *rm){
+  long memsize = (long)model_memsize(rm);
+
+  memory_adjust(MEMORY_MODELS, 0, memsize - rm->memsize);
+  rm->memsize = memsize;
+}
+
+static void
+model_dfree(void *ptr){
+  RMODEL *rm = (RMODEL *)ptr;
+
+  if(rm){
+    memory_adjust(MEMORY_MODELS, -1, -rm->memsize);
+    if(rm->mapping)
+      memory_adjust_mapped(-(long)rm->mapping_len);
+  }
+
+  model_free(rm);
+}
+
+static size_t
+model_dsize(const void *ptr){
+  return ptr ? model_memsize((const RMODEL *)ptr) : 0;
+}
+
+/* Nothing in a model changes after it is built (the inference counters are updated
+ * atomically), so a frozen Model can be shared by Ractors scoring concurrently */
+const rb_data_type_t model_data_type = {
+  "SVMLight::Model",
+  {0, model_dfree, model_dsize},
+  0, 0,
+  SVMREDLIGHT_TYPED_FLAGS
+};
+
+/* Wraps rm in a new instance of klass, from now on the ruby object owns it */
+VALUE
+model_wrap(VALUE klass, RMODEL *rm){
+  VALUE self = TypedData_Wrap_Struct(klass, &model_data_type, rm);
+
+  memory_adjust(MEMORY_MODELS, 1, 0);
+  model_memory_sync(rm);
+  if(rm->mapping)
+    memory_adjust_mapped((long)rm->mapping_len);
+
+  return self;
+}
+
+RMODEL *
+model_get(VALUE self){
+  RMODEL *rm;
+  TypedData_Get_Struct(self, RMODEL, &model_data_type, rm);
+
+  return rm;
 }
 
 void
@@ -30,20 +224,43 @@ doc_free(DOC *d){
     free_example(d, 1);
 }
 
-/* Read a svm_light model from a file generated by svm_learn receives the filename as
- * argument do make sure the file exists before calling this!  otherwise exit(1) might be
- * called and the ruby interpreter will die.*/
-static VALUE
-model_read_from_file(VALUE klass, VALUE filename){
-  Check_Type(filename, T_STRING);
-  MODEL *m;
+static void
+doc_dfree(void *ptr){
+  if(ptr)
+    memory_adjust(MEMORY_DOCUMENTS, -1, -(long)doc_memsize((DOC *)ptr));
 
-  m = read_model(StringValuePtr(filename));
+  doc_free((DOC *)ptr);
+}
+
+static size_t
+doc_dsize(const void *ptr){
+  return ptr ? doc_memsize((const DOC *)ptr) : 0;
+}
 
-  if(is_linear(m))
-    add_weight_vector_to_linear_model(m);
+/* Documents have no setters, frozen ones are shareable too */
+const rb_data_type_t document_data_type = {
+  "SVMLight::Document",
+  {0, doc_dfree, doc_dsize},
+  0, 0,
+  SVMREDLIGHT_TYPED_FLAGS
+};
 
-  return Data_Wrap_Struct(klass, 0, model_free, m);
+/* Wraps d in a new instance of klass (Document), from now on the ruby object owns it */
+VALUE
+document_wrap(VALUE klass, DOC *d){
+  VALUE self = TypedData_Wrap_Struct(klass, &document_data_type, d);
+
+  memory_adjust(MEMORY_DOCUMENTS, 1, (long)doc_memsize(d));
+
+  return self;
+}
+
+DOC *
+document_get(VALUE self){
+  DOC *d;
+  TypedData_Get_Struct(self, DOC, &document_data_type, d);
+
+  return d;
 }
 
 /* Helper function type checks a string meant to be used as a learn_parm, in case of error
@@ -348,6 +565,15 @@ setup_learn_params(LEARN_PARM *c_learn_param, VALUE r_hash, char *error_message)
 int 
 setup_kernel_params(KERNEL_PARM *c_kernel_param, VALUE r_hash, char *error_message){
   VALUE inter_val;
+  inter_val = rb_hash_aref(r_hash, rb_str_new2("kernel_type"));
+  if(1 == check_long_param(inter_val, 
+                           LINEAR, 
+                           &(c_kernel_param->kernel_type), 
+                           "kernel_type",
+                           error_message)){
+    return 1;
+  }
+
   inter_val = rb_hash_aref(r_hash, rb_str_new2("poly_degree"));
   if(1 == check_long_param(inter_val, 
                            3L, 
@@ -394,6 +620,20 @@ setup_kernel_params(KERNEL_PARM *c_kernel_param, VALUE r_hash, char *error_messa
 int check_kernel_and_learn_params_logic(KERNEL_PARM *c_kernel_param, 
     LEARN_PARM *c_learn_param, char *error_msg){
 
+  // Custom kernels need to be compiled into SVM-light and gram matrices cannot be given
+  // from ruby
+  if(c_kernel_param->kernel_type < LINEAR || c_kernel_param->kernel_type > SIGMOID) {
+    snprintf(error_msg, 300, "Unknown kernel type %ld, supported kernels are linear (0), "
+             "polynomial (1), rbf (2) and sigmoid (3)", c_kernel_param->kernel_type);
+    return 1;
+  }
+
+  if(c_learn_param->kernel_cache_size < 2) {
+    snprintf(error_msg, 300, "The kernel cache size must be at least 2 MB: %ld",
+             c_learn_param->kernel_cache_size);
+    return 1;
+  }
+
   if(c_learn_param->svm_iter_to_shrink == -9999) {
     if(c_kernel_param->kernel_type == LINEAR) 
       c_learn_param->svm_iter_to_shrink=2;
@@ -471,36 +711,368 @@ int check_kernel_and_learn_params_logic(KERNEL_PARM *c_kernel_param,
   return 0;
 }
 
+/* The 'solver' learn param, SVM-light's (svmlight, the default) or dual_cd (see
+ * dual_cd.c), as a String or a Symbol */
+static int
+setup_solver(VALUE r_hash, int *solver, char *error_message){
+  VALUE inter_val = rb_hash_aref(r_hash, rb_str_new2("solver"));
+
+  *solver = SOLVER_SVMLIGHT;
+
+  if(NIL_P(inter_val))
+    return 0;
+
+  if(SYMBOL_P(inter_val))
+    inter_val = rb_sym2str(inter_val);
+
+  if(TYPE(inter_val) == T_STRING && strcmp(StringValueCStr(inter_val), "dual_cd") == 0){
+    *solver = SOLVER_DUAL_CD;
+    return 0;
+  }
+
+  if(TYPE(inter_val) == T_STRING && strcmp(StringValueCStr(inter_val), "svmlight") == 0)
+    return 0;
+
+  strncpy(error_message, "The solver must be :svmlight or :dual_cd", 300);
+  return 1;
+}
+
+/* Parses and validates the learn and kernel params hashes, returns 1 and fills
+ * error_msg when they are not valid */
+int
+training_params(VALUE learn_params, VALUE kernel_params, LEARN_PARM *c_learn_param,
+                KERNEL_PARM *c_kernel_param, int *solver, char *error_msg){
+  Check_Type(learn_params, T_HASH);
+  Check_Type(kernel_params, T_HASH);
+
+  if(setup_learn_params(c_learn_param, learn_params, error_msg) != 0)
+    return 1;
+
+  c_learn_param->type = CLASSIFICATION;
+
+  if(setup_kernel_params(c_kernel_param, kernel_params, error_msg) != 0)
+    return 1;
+
+  if(setup_solver(learn_params, solver, error_msg) != 0)
+    return 1;
+
+  if(*solver == SOLVER_DUAL_CD && c_kernel_param->kernel_type != LINEAR){
+    strncpy(error_msg, "The dual_cd solver only trains linear models", 300);
+    return 1;
+  }
+
+  return check_kernel_and_learn_params_logic(c_kernel_param, c_learn_param, error_msg);
+}
+
+/* Collects the DOCs and labels to train on out of an array of [Document, label] or a
+ * DocumentSet. c_docs and labels are malloc'd, r_docs is set to an object that keeps the
+ * documents alive while they are used without the GVL. Returns 1 and fills error_msg
+ * (nothing is left allocated) when r_docs_and_classes is not valid */
+int
+training_documents(VALUE r_docs_and_classes, DOC ***c_docs, double **labels, long *totdocs,
+                   long *totwords, VALUE *r_docs, char *error_msg){
+  long i, fnum;
+  VALUE temp_ary;
+
+  if(rb_obj_is_kind_of(r_docs_and_classes, rb_cDocumentSet)){
+    // The documents live in the set's buffers, no per document work to do
+    *r_docs = r_docs_and_classes;
+
+    return document_set_training_data(r_docs_and_classes, c_docs, labels, totdocs, totwords,
+                                      error_msg);
+  }
+
+  Check_Type(r_docs_and_classes, T_ARRAY);
+
+  *totdocs  = (long)RARRAY_LEN(r_docs_and_classes);
+  *totwords = 0;
+
+  if (*totdocs == 0){
+    strncpy(error_msg, "Cannot create Model from empty Documents array", 300);
+    return 1;
+  }
+  
+  *c_docs  = (DOC **)my_malloc(sizeof(DOC *)*(*totdocs)); 
+  *labels  = (double*)my_malloc(sizeof(double)*(*totdocs));
+  // Keeps the Documents referenced while training runs without the GVL, even if another
+  // thread changes r_docs_and_classes in the meantime
+  *r_docs  = rb_ary_new2(*totdocs);
+
+  for(i=0; i < *totdocs; i++){
+    // Just one of the documents and classes arrays, we expect temp_ary to have a Document
+    // and a label (long)
+    temp_ary = RARRAY_PTR(r_docs_and_classes)[i] ;
+
+    if( TYPE(temp_ary) != T_ARRAY || 
+        RARRAY_LEN(temp_ary) < 2  ||
+        rb_obj_class(RARRAY_PTR(temp_ary)[0]) != rb_cDocument ||  
+        (TYPE(RARRAY_PTR(temp_ary)[1]) != T_FLOAT && TYPE(RARRAY_PTR(temp_ary)[1]) != T_FIXNUM )){
+      
+      strncpy(error_msg, "All elements of documents and labels should be arrays,"
+          "where the first element is a document and the second a number", 300);
+
+      goto bail;
+    }
+      
+    (*c_docs)[i] = document_get(RARRAY_PTR(temp_ary)[0]);
+    rb_ary_push(*r_docs, RARRAY_PTR(temp_ary)[0]);
+    (*labels)[i] = NUM2DBL(RARRAY_PTR(temp_ary)[1]);
+
+    fnum = 0;
+
+    // Increase feature number while there are still words in the vector
+    while((*c_docs)[i]->fvec->words[fnum].wnum) {
+      fnum++;
+    }
+    
+    if(fnum > 0 && (*c_docs)[i]->fvec->words[fnum -1].wnum > *totwords)
+      *totwords = (*c_docs)[i]->fvec->words[fnum-1].wnum;
+
+    if(*totwords > MAXFEATNUM){
+      strncpy(error_msg, "The number of features exceeds MAXFEATNUM the maximun "
+                    "number of features defined for this version of SVMLight", 300);
+      goto bail;
+    }
+  }
+
+  return 0;
+
+bail:
+  free(*c_docs);
+  free(*labels);
+  *c_docs = NULL;
+  *labels = NULL;
+
+  return 1;
+}
+
+/* Frees what training_documents returned, once nothing uses the DOCs anymore. Called
+ * with the GVL */
+void
+training_documents_release(VALUE r_docs, DOC **c_docs, double *labels){
+  free(c_docs);
+  free(labels);
+
+  if(rb_obj_is_kind_of(r_docs, rb_cDocumentSet))
+    document_set_training_done(r_docs);
+}
+
+/* Runs svm_learn_classification, with a kernel cache for non linear kernels, or the
+ * dual_cd solver. Call it without the GVL, SVM-light trainings run one at a time (see
+ * solver_acquire), dual_cd ones run concurrently. The model points to docs, stats (when
+ * not NULL) gets the solver's times and counters. Returns NULL when *cancelled is set
+ * while waiting for the solver */
+MODEL *
+train_classification(DOC **docs, double *labels, long totdocs, long totwords,
+                     LEARN_PARM *learn_param, KERNEL_PARM *kernel_param, int solver,
+                     double *alpha_in, TRAINING_STATS *stats, volatile int *cancelled){
+  KERNEL_CACHE *cache = NULL;
+  MODEL *m;
+  double start, cpu_start;
+  long evaluations;
+
+  if(solver == SOLVER_DUAL_CD){
+    start     = stats_now();
+    cpu_start = stats_thread_cpu_time();
+    m         = train_dual_cd(docs, labels, totdocs, totwords, learn_param, kernel_param,
+                              alpha_in);
+
+    if(stats){
+      stats->documents      = totdocs;
+      stats->features       = totwords;
+      stats->train_time     = stats_now() - start;
+      stats->train_cpu_time = stats_thread_cpu_time() - cpu_start;
+    }
+
+    return m;
+  }
+
+  if(solver_acquire(cancelled))
+    return NULL;
+
+  m = (MODEL *)my_malloc(sizeof(MODEL));
+
+  // Linear kernels are solved on the folded weight vector and never use the cache
+  if(kernel_param->kernel_type != LINEAR)
+    cache = kernel_cache_init(totdocs, learn_param->kernel_cache_size);
+
+  // SVM-light's counter is process wide, classify_example bumps it too (without the GVL
+  // or any lock) so scoring in other threads while training adds to the difference
+  evaluations = kernel_cache_statistic;
+  start       = stats_now();
+  cpu_start   = stats_thread_cpu_time();
+
+  svm_learn_classification(docs, labels, totdocs, totwords, learn_param, kernel_param,
+                           cache, m, alpha_in);
+
+  if(stats){
+    stats->documents          = totdocs;
+    stats->features           = totwords;
+    stats->train_time         = stats_now() - start;
+    stats->train_cpu_time     = stats_thread_cpu_time() - cpu_start;
+    stats->kernel_evaluations = kernel_cache_statistic - evaluations;
+
+    if(cache){
+      stats->kernel_cache_size     = learn_param->kernel_cache_size * 1024 * 1024;
+      stats->kernel_cache_rows     = cache->elems;
+      stats->kernel_cache_max_rows = cache->max_elems;
+    }
+  }
+
+  if(cache)
+    kernel_cache_cleanup(cache);
+
+  solver_release();
+
+  return m;
+}
+
+/* Everything svm_learn_classification needs, so training can run without the GVL. maxiter
+ * keeps the value requested by the user, learn_param->maxiter is clobbered to cancel */
+typedef struct learn_args {
+  DOC         **docs;
+  double      *labels;
+  long        totdocs;
+  long        totwords;
+  LEARN_PARM  *learn_param;
+  KERNEL_PARM *kernel_param;
+  double      *alpha_in;
+  int         solver;
+  long        maxiter;
+  MODEL       *m;
+  int         copied;  // m is the deep copy, see learn_classification_nogvl
+  TRAINING_STATS stats;
+  VALUE       r_docs;
+  volatile int cancelled;
+} LEARN_ARGS;
+
+static void *
+learn_classification_nogvl(void *ptr){
+  LEARN_ARGS *args = (LEARN_ARGS *)ptr;
+  MODEL *copy;
+  long i;
+
+  double start;
+
+  if(!args->cancelled)
+    args->m = train_classification(args->docs, args->labels, args->totdocs, args->totwords,
+                                   args->learn_param, args->kernel_param, args->solver,
+                                   args->alpha_in, &args->stats, &args->cancelled);
+
+  // The model points to the training documents, keep a copy of the support vectors only
+  // so the documents can be collected (and their memory reused) right away. The copies
+  // are numbered by their position in the training set, see Model#alphas
+  if(args->m && !args->cancelled){
+    start   = stats_now();
+    copy    = copy_model(args->m);
+
+    if(args->m->index){
+      for(i = 0; i < args->totdocs; i++){
+        if(args->m->index[i] > 0)
+          copy->supvec[args->m->index[i]]->docnum = i;
+      }
+    }
+
+    free_model(args->m, 0);
+    args->m      = copy;
+    args->copied = 1;
+    args->stats.copy_time = stats_now() - start;
+  }
+
+  return NULL;
+}
+
+/* Unblocking function. SVM-light has no cancellation hook, but optimize_to_convergence
+ * checks learn_parm->maxiter (iterations without progress) on every iteration, a
+ * negative value makes it terminate on the next one, the partial model is then
+ * discarded */
+static void
+learn_classification_ubf(void *ptr){
+  LEARN_ARGS *args = (LEARN_ARGS *)ptr;
+
+  args->cancelled = 1;
+  args->learn_param->maxiter = -1;
+  solver_interrupt();
+}
+
+static VALUE
+learn_classification_body(VALUE ptr){
+  LEARN_ARGS *args = (LEARN_ARGS *)ptr;
+
+  for(;;){
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(learn_classification_nogvl, args, learn_classification_ubf, args);
+#else
+    learn_classification_nogvl(args);
+#endif
+    if(!args->cancelled)
+      break;
+
+    // Cancelled after the copy was made, the copy owns its support vectors
+    if(args->m){
+      free_model(args->m, args->copied);
+      args->m      = NULL;
+      args->copied = 0;
+    }
+
+    // Raises on Thread#raise, timeouts, etc. If nothing is pending (i.e. a trap handler
+    // just ran) train again from scratch
+    rb_thread_check_ints();
+
+    args->cancelled = 0;
+    args->learn_param->maxiter = args->maxiter;
+  }
+
+  return Qnil;
+}
+
+/* Frees the training buffers, the documents themselves belong to ruby objects */
+static VALUE
+learn_classification_cleanup(VALUE ptr){
+  LEARN_ARGS *args = (LEARN_ARGS *)ptr;
+
+  free(args->alpha_in);
+  training_documents_release(args->r_docs, args->docs, args->labels);
+
+  return Qnil;
+}
+
 /* This function will let you train a new SVM model, for now we *only* support
- * classification SVMs and linear kernels, in ruby-land the kernel and learning params
- * will be represented by hashes where the keys are the name of the respective field in
- * the options structure
+ * classification SVMs, with linear, polynomial, rbf and sigmoid kernels, in ruby-land the
+ * kernel and learning params will be represented by hashes where the keys are the name of
+ * the respective field in the options structure
  *
- * @param [Array] r_docs_and_classes is an array of arrays where each of the inner arrays must have two elements, the first a Document and the second a label (1, -1 ) for classification
+ * @param [Array|DocumentSet] r_docs_and_classes is an array of arrays where each of the inner arrays must have two elements, the first a Document and the second a label (1, -1 ) for classification, or a DocumentSet
  * @param [Hash] learn_params the learning options, each key is the name of a filed in the LEARN_PARM struct
  * @param [Hash] kernel_params the kernel options, each key is the name of a filed in the KERNEL_PARM struct
- * @param [Bool] use_cache, useless for now caches cannot be set for linear kernels
- * @param [Array] alpha, array of alpha values
+ * @param [Bool] use_cache, kept for compatibility, non linear kernels always train with a
+ * kernel cache of kernel_cache_size MB (a learn param), linear kernels do not need one
+ * @param [Array] alpha, array of alpha values, one per document (see Model#alphas), missing
+ * values are 0
  * */
 static VALUE
 model_learn_classification(VALUE klass, 
                            VALUE r_docs_and_classes,  // Docs + labels array of arrays
                            VALUE learn_params,        // Options hash with learning options
                            VALUE kernel_params,       // Options hash with kernel options
-                           VALUE use_cache,          // If no linear
+                           VALUE use_cache,          // Ignored, see above
                            VALUE alpha
                           ){
   int i;
   double *labels = NULL, *alpha_in = NULL;
-  long totdocs, totwords = 0,  fnum = 0;
-  MODEL  *m = NULL;
+  long totdocs, totwords = 0;
+  RMODEL *rm;
   DOC    **c_docs = NULL;
   LEARN_PARM c_learn_param;
   KERNEL_PARM c_kernel_param;
-  VALUE temp_ary, exception = rb_eArgError;
+  int solver;
+  VALUE r_docs, exception = rb_eArgError;
+  LEARN_ARGS args;
+  double setup_start;
   char error_msg[300];
 
-  Check_Type(r_docs_and_classes, T_ARRAY);
+  if(!rb_obj_is_kind_of(r_docs_and_classes, rb_cDocumentSet))
+    Check_Type(r_docs_and_classes, T_ARRAY);
   Check_Type(learn_params, T_HASH);
   Check_Type(kernel_params, T_HASH);
 
@@ -524,81 +1096,55 @@ model_learn_classification(VALUE klass,
     }
   }
 
-  if(setup_learn_params(&c_learn_param, learn_params, error_msg) != 0){
+  if(training_params(learn_params, kernel_params, &c_learn_param, &c_kernel_param, &solver,
+                     error_msg) != 0){
     goto bail;
   }
 
-  c_learn_param.type = CLASSIFICATION;
+  memset(&args, 0, sizeof(LEARN_ARGS));
+  setup_start = stats_now();
 
-  if(setup_kernel_params(&c_kernel_param, kernel_params, error_msg) != 0){
+  if(training_documents(r_docs_and_classes, &c_docs, &labels, &totdocs, &totwords, &r_docs,
+                        error_msg) != 0){
     goto bail;
   }
 
-  //TODO Setup kernel cache when we support non linear kernels
-  c_kernel_param.kernel_type = LINEAR;
-
-  if(check_kernel_and_learn_params_logic(&c_kernel_param, &c_learn_param, error_msg) != 0){
-    goto bail;
-  }
-
-  totdocs = (long)RARRAY_LEN(r_docs_and_classes);
-
-  if (totdocs == 0){
-    strncpy(error_msg, "Cannot create Model from empty Documents array", 300);
-    goto bail;
-  }
-  
-  c_docs  = (DOC **)my_malloc(sizeof(DOC *)*(totdocs)); 
-  labels  = (double*)my_malloc(sizeof(double)*totdocs);
-
-  for(i=0; i < totdocs; i++){
-    // Just one of the documents and classes arrays, we expect temp_ary to have a Document
-    // and a label (long)
-    temp_ary = RARRAY_PTR(r_docs_and_classes)[i] ;
-
-    if( TYPE(temp_ary) != T_ARRAY || 
-        RARRAY_LEN(temp_ary) < 2  ||
-        rb_obj_class(RARRAY_PTR(temp_ary)[0]) != rb_cDocument ||  
-        (TYPE(RARRAY_PTR(temp_ary)[1]) != T_FLOAT && TYPE(RARRAY_PTR(temp_ary)[1]) != T_FIXNUM )){
-      
-      strncpy(error_msg, "All elements of documents and labels should be arrays,"
-          "where the first element is a document and the second a number", 300);
-
-      goto bail;
-    }
-      
-    Data_Get_Struct(RARRAY_PTR(temp_ary)[0], DOC, c_docs[i]);
-    labels[i] = NUM2DBL(RARRAY_PTR(temp_ary)[1]);
+  args.stats.setup_time = stats_now() - setup_start;
 
-    fnum = 0;
+  // SVM-light reads one alpha per document, missing ones (i.e. new documents when warm
+  // starting) start at 0
+  if(alpha_in && RARRAY_LEN(alpha) < totdocs){
+    alpha_in = (double *)realloc(alpha_in, sizeof(double) * totdocs);
 
-    // Increase feature number while there are still words in the vector
-    while(c_docs[i]->fvec->words[fnum].wnum) {
-      fnum++;
-    }
-    
-    if(c_docs[i]->fvec->words[fnum -1].wnum > totwords)
-      totwords = c_docs[i]->fvec->words[fnum-1].wnum;
-
-    if(totwords > MAXFEATNUM){
-      strncpy(error_msg, "The number of features exceeds MAXFEATNUM the maximun "
-                    "number of features defined for this version of SVMLight", 300);
-      goto bail;
-    }
+    for(i = RARRAY_LEN(alpha); i < totdocs; i++)
+      alpha_in[i] = 0.0;
   }
-  
-  m = (MODEL *)my_malloc(sizeof(MODEL));
 
-  svm_learn_classification(c_docs, labels, totdocs, totwords, 
-      &c_learn_param, &c_kernel_param, NULL, m, alpha_in);
-
-  free(alpha_in);
-  free(labels);
-
-  // If need arises to free the data do a deep copy of m and create the ruby object with
-  // that data.
-  // free(c_docs);
-  return Data_Wrap_Struct(klass, 0, model_free, m);
+  args.docs         = c_docs;
+  args.labels       = labels;
+  args.r_docs       = r_docs;
+  args.totdocs      = totdocs;
+  args.totwords     = totwords;
+  args.learn_param  = &c_learn_param;
+  args.kernel_param = &c_kernel_param;
+  args.alpha_in     = alpha_in;
+  args.solver       = solver;
+  args.maxiter      = c_learn_param.maxiter;
+  args.m            = NULL;
+  args.cancelled    = 0;
+
+  rb_ensure(learn_classification_body, (VALUE)&args, learn_classification_cleanup, (VALUE)&args);
+  RB_GC_GUARD(r_docs);
+
+  rm = rmodel_new(args.m);
+  rm->training_docnums = 1;
+  rm->training = (TRAINING_STATS *)my_malloc(sizeof(TRAINING_STATS));
+  *rm->training = args.stats;
+  rm->training->peak_rss = stats_peak_rss();
+  linear_engine_prepare(rm);
+  kernel_engine_prepare(rm);
+
+  return model_wrap(klass, rm);
 
 bail:
   free(alpha_in);
@@ -610,49 +1156,160 @@ bail:
 /*  Classify, takes an example (instance of Document) and returns its classification */
 static VALUE
 model_classify_example(VALUE self, VALUE example){
+  RMODEL *rm = model_get(self);
   DOC *ex;
-  MODEL *m;
-  double result;
+  double result, start = 0;
+  int counted = rm->inference != NULL;
 
-  Data_Get_Struct(example, DOC, ex);
-  Data_Get_Struct(self, MODEL, m);
+  ex = document_get(example);
 
-  /* Apparently unnecessary code 
-   
-  if(is_linear(m))
-    result = classify_example_linear(m, ex);
-  else
-  */
-  
-  result = classify_example(m, ex);
+  if(counted)
+    start = stats_now();
+
+  // Linear models are scored against the dense weight vector, see linear.c
+  result = rmodel_classify(rm, ex);
+
+  if(counted)
+    inference_stats_record(rm, 1, stats_now() - start);
 
   return rb_float_new((float)result);
 }
 
-static VALUE
-model_support_vectors_count(VALUE self){
-  MODEL *m;
-  Data_Get_Struct(self, MODEL, m);
- 
-  return INT2FIX(m->sv_num);
+/* Everything the batch scoring loop needs, it only touches C memory so it can run
+ * without the GVL. next is the index of the first document not scored yet */
+typedef struct classify_batch_args {
+  RMODEL *rm;
+  DOC    **docs;
+  double *results;
+  long   n;
+  long   next;
+  VALUE  packed;
+  volatile int interrupted;
+} CLASSIFY_BATCH_ARGS;
+
+static void *
+classify_batch_nogvl(void *ptr){
+  CLASSIFY_BATCH_ARGS *args = (CLASSIFY_BATCH_ARGS *)ptr;
+
+  for(; args->next < args->n && !args->interrupted; args->next++)
+    args->results[args->next] = rmodel_classify(args->rm, args->docs[args->next]);
+
+  return NULL;
+}
+
+/* Unblocking function, makes the scoring loop stop early so ruby can deliver
+ * Thread#raise, Thread#kill, signals, etc. */
+static void
+classify_batch_ubf(void *ptr){
+  ((CLASSIFY_BATCH_ARGS *)ptr)->interrupted = 1;
 }
 
 static VALUE
-model_write_to_file(VALUE self, VALUE pahtofile){
-  Check_Type(pahtofile, T_STRING);
+classify_batch_body(VALUE ptr){
+  CLASSIFY_BATCH_ARGS *args = (CLASSIFY_BATCH_ARGS *)ptr;
+  VALUE result;
+  long i;
+
+  while(args->next < args->n){
+    args->interrupted = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(classify_batch_nogvl, args, classify_batch_ubf, args);
+#else
+    classify_batch_nogvl(args);
+#endif
+    // Let ruby handle whatever interrupted us (this raises on Thread#raise, timeouts,
+    // etc.) and carry on from where the loop stopped otherwise
+    if(args->next < args->n)
+      rb_thread_check_ints();
+  }
 
-  MODEL *m;
-  Data_Get_Struct(self, MODEL, m);
+  if(RTEST(args->packed))
+    return rb_str_new((char *)args->results, sizeof(double) * args->n);
+
+  result = rb_ary_new2(args->n);
+
+  for(i=0; i < args->n; i++)
+    rb_ary_push(result, DBL2NUM(args->results[i]));
+
+  return result;
+}
+
+static VALUE
+classify_batch_cleanup(VALUE ptr){
+  CLASSIFY_BATCH_ARGS *args = (CLASSIFY_BATCH_ARGS *)ptr;
 
-  write_model(StringValuePtr(pahtofile), m);
+  free(args->docs);
+  free(args->results);
 
   return Qnil;
 }
 
+/* Classify many Documents in one call, all the DOCs are unwrapped up front and then
+ * scored in a single C loop with the GVL released.
+ *
+ * @param [Array] r_docs an array of Documents
+ * @param [Bool] packed if true return a binary String of native doubles instead of an
+ * Array of Floats
+ * */
+static VALUE
+model_classify_batch(VALUE self, VALUE r_docs, VALUE packed){
+  long i;
+  VALUE docs, doc, result;
+  CLASSIFY_BATCH_ARGS args;
+  double start = 0;
+  int counted;
+
+  Check_Type(r_docs, T_ARRAY);
+
+  // Work on a copy, so the Documents stay referenced even if another thread changes
+  // r_docs while we are scoring without the GVL
+  docs = rb_ary_dup(r_docs);
+
+  for(i=0; i < RARRAY_LEN(docs); i++){
+    if(rb_obj_class(RARRAY_PTR(docs)[i]) != rb_cDocument)
+      rb_raise(rb_eTypeError, "All elements of the documents array must be Documents");
+  }
+
+  args.rm          = model_get(self);
+  args.n           = (long)RARRAY_LEN(docs);
+  args.next        = 0;
+  args.packed      = packed;
+  args.interrupted = 0;
+  args.docs        = (DOC **)my_malloc(sizeof(DOC *) * (args.n + 1));
+  args.results     = (double *)my_malloc(sizeof(double) * (args.n + 1));
+
+  for(i=0; i < args.n; i++){
+    doc = RARRAY_PTR(docs)[i];
+    args.docs[i] = document_get(doc);
+  }
+
+  if((counted = args.rm->inference != NULL))
+    start = stats_now();
+
+  result = rb_ensure(classify_batch_body, (VALUE)&args, classify_batch_cleanup, (VALUE)&args);
+
+  if(counted)
+    inference_stats_record(args.rm, RARRAY_LEN(docs), stats_now() - start);
+
+  RB_GC_GUARD(docs);
+  return result;
+}
+
+static VALUE
+model_support_vectors_count(VALUE self){
+  RMODEL *rm = model_get(self);
+  MODEL *m;
+
+  online_fold(rm);
+  m = rm->m;
+ 
+  return INT2FIX(m->sv_num);
+}
+
 static VALUE
 model_total_words(VALUE self){
   MODEL *m;
-  Data_Get_Struct(self, MODEL, m);
+  m = model_get(self)->m;
 
   return INT2FIX(m->totwords);
 }
@@ -660,7 +1317,7 @@ model_total_words(VALUE self){
 static VALUE
 model_totdoc(VALUE self){
   MODEL *m;
-  Data_Get_Struct(self, MODEL, m);
+  m = model_get(self)->m;
 
   return INT2FIX(m->totdoc);
 }
@@ -668,11 +1325,85 @@ model_totdoc(VALUE self){
 static VALUE
 model_maxdiff(VALUE self){
   MODEL *m;
-  Data_Get_Struct(self, MODEL, m);
+  m = model_get(self)->m;
 
   return DBL2NUM(m->maxdiff);
 }
 
+/* The alpha of every training document, 0 for the ones that are not support vectors, in
+ * the form learn_classification takes them to warm start training. Only known for models
+ * trained here (or written to a binary file after being trained), SVM-light's text
+ * format does not keep the training positions of the support vectors.
+ * @return [Array] totdoc Floats
+ */
+static VALUE
+model_alphas(VALUE self){
+  RMODEL *rm = model_get(self);
+  MODEL *m = rm->m;
+  VALUE result;
+  long i, docnum;
+
+  if(!rm->training_docnums)
+    rb_raise(rb_eRuntimeError, "The training positions of the support vectors of this model "
+             "are unknown, models read from SVM-light files do not keep them");
+
+  result = rb_ary_new2(m->totdoc);
+  for(i = 0; i < m->totdoc; i++)
+    rb_ary_push(result, DBL2NUM(0.0));
+
+  for(i = 1; i < m->sv_num; i++){
+    docnum = m->supvec[i]->docnum;
+
+    // model->alpha holds alpha*y
+    if(docnum >= 0 && docnum < m->totdoc)
+      rb_ary_store(result, docnum, DBL2NUM(fabs(m->alpha[i])));
+  }
+
+  return result;
+}
+
+/* Copies of the support vectors, with the label given by the sign of their alpha*y
+ * @return [Array] [Document, label] pairs
+ */
+static VALUE
+model_support_vectors(VALUE self){
+  RMODEL *rm = model_get(self);
+  MODEL *m;
+  VALUE result;
+  DOC *sv, *copy;
+  long i;
+
+  online_fold(rm);
+  m      = rm->m;
+  result = rb_ary_new2(m->sv_num > 0 ? m->sv_num - 1 : 0);
+
+  for(i = 1; i < m->sv_num; i++){
+    sv   = m->supvec[i];
+    copy = create_example(sv->docnum, sv->queryid, sv->slackid, sv->costfactor,
+                          copy_svector(sv->fvec));
+
+    rb_ary_push(result, rb_assoc_new(document_wrap(rb_cDocument, copy),
+                                     DBL2NUM(m->alpha[i] > 0 ? 1.0 : -1.0)));
+  }
+
+  return result;
+}
+
+/* The kernel the model was trained with, in the form learn_classification takes it */
+static VALUE
+model_kernel_params(VALUE self){
+  KERNEL_PARM *k = &(model_get(self)->m->kernel_parm);
+  VALUE result = rb_hash_new();
+
+  rb_hash_aset(result, rb_str_new2("kernel_type"), LONG2NUM(k->kernel_type));
+  rb_hash_aset(result, rb_str_new2("poly_degree"), LONG2NUM(k->poly_degree));
+  rb_hash_aset(result, rb_str_new2("rbf_gamma"), DBL2NUM(k->rbf_gamma));
+  rb_hash_aset(result, rb_str_new2("coef_lin"), DBL2NUM(k->coef_lin));
+  rb_hash_aset(result, rb_str_new2("coef_const"), DBL2NUM(k->coef_const));
+
+  return result;
+}
+
 /* Creates a DOC from an array of words it also takes an id
  * -1 is normally OK for that value when using in filtering it also takes the C (cost)
  * parameter for the SVM.
@@ -720,13 +1451,155 @@ doc_create(VALUE klass, VALUE id, VALUE cost, VALUE slackid, VALUE queryid, VALU
 
   d = create_example(docnum, FIX2LONG(queryid), FIX2LONG(slackid), c, vec);
 
-  return Data_Wrap_Struct(klass, 0, doc_free, d);
+  return document_wrap(klass, d);
+}
+
+/* Builds a DOC out of n feature numbers and weights laid out as native int32 and
+ * float32 arrays. SVM-light interleaves them in WORD so they cannot be copied with a
+ * single memcpy, but no ruby object is touched. Returns NULL and fills error when the
+ * feature numbers are not positive and increasing. */
+static DOC *
+doc_from_packed(const int32_t *indices, const float *weights, long n, long docnum,
+                double costfactor, long slackid, long queryid, char *error){
+  SVECTOR *vec;
+  WORD *words;
+  double norm = 0.0;
+  long i;
+
+  words = (WORD *)my_malloc(sizeof(WORD) * (n + 1));
+
+  for(i = 0; i < n; i++){
+    if(indices[i] <= (i > 0 ? indices[i - 1] : 0)){
+      free(words);
+      snprintf(error, 300, "Feature numbers must be greater than zero and increasing, "
+               "found %d at position %ld", indices[i], i);
+      return NULL;
+    }
+
+    words[i].wnum   = indices[i];
+    words[i].weight = (FVAL)weights[i];
+    norm += (double)words[i].weight * (double)words[i].weight;
+  }
+  words[n].wnum = 0;
+
+  // Same as create_svector without copying words again
+  vec = (SVECTOR *)my_malloc(sizeof(SVECTOR));
+  vec->words       = words;
+  vec->twonorm_sq  = norm;
+  // create_svector, used by copy_svector, expects a string
+  vec->userdefined = (char *)my_malloc(1);
+  vec->userdefined[0] = '\0';
+  vec->kernel_id   = 0;
+  vec->next        = NULL;
+  vec->factor      = 1.0;
+
+  return create_example(docnum, queryid, slackid, costfactor, vec);
+}
+
+static long
+packed_count(VALUE str, long elem_size, const char *name){
+  if(RSTRING_LEN(str) % elem_size != 0)
+    rb_raise(rb_eArgError, "The length of %s is not a multiple of %ld bytes", name, elem_size);
+
+  return RSTRING_LEN(str) / elem_size;
+}
+
+/* Creates a Document from packed Strings of native int32 feature numbers and float32
+ * weights, see Document.from_packed */
+static VALUE
+doc_create_packed(VALUE klass, VALUE indices, VALUE weights, VALUE id, VALUE cost,
+                  VALUE slackid, VALUE queryid){
+  char error_msg[300];
+  long n;
+  DOC *d;
+
+  StringValue(indices);
+  StringValue(weights);
+  Check_Type(slackid, T_FIXNUM);
+  Check_Type(queryid, T_FIXNUM);
+
+  n = packed_count(indices, sizeof(int32_t), "indices");
+  if(n != packed_count(weights, sizeof(float), "weights"))
+    rb_raise(rb_eArgError, "indices and weights have different lengths");
+  if(n == 0)
+    rb_raise(rb_eArgError, "Cannot create Document from empty arrays");
+
+  d = doc_from_packed((const int32_t *)RSTRING_PTR(indices), (const float *)RSTRING_PTR(weights),
+                      n, NUM2LONG(id), NUM2DBL(cost), FIX2LONG(slackid), FIX2LONG(queryid),
+                      error_msg);
+  if(!d)
+    rb_raise(rb_eArgError, "%s", error_msg);
+
+  return document_wrap(klass, d);
+}
+
+/* Creates many Documents out of the same indices and weights Strings, offsets holds n+1
+ * native int64 positions, document i uses the features from offsets[i] to offsets[i+1].
+ * Documents get consecutive docnums starting at id, see Document.from_packed_batch */
+static VALUE
+doc_create_packed_batch(VALUE klass, VALUE indices, VALUE weights, VALUE offsets, VALUE id,
+                        VALUE cost, VALUE slackid, VALUE queryid){
+  char error_msg[300];
+  const int64_t *c_offsets;
+  long n, ndocs, i, c_id;
+  double c_cost;
+  DOC **docs;
+  VALUE result;
+
+  StringValue(indices);
+  StringValue(weights);
+  StringValue(offsets);
+  Check_Type(slackid, T_FIXNUM);
+  Check_Type(queryid, T_FIXNUM);
+
+  n = packed_count(indices, sizeof(int32_t), "indices");
+  if(n != packed_count(weights, sizeof(float), "weights"))
+    rb_raise(rb_eArgError, "indices and weights have different lengths");
+
+  ndocs = packed_count(offsets, sizeof(int64_t), "offsets") - 1;
+  if(ndocs < 0)
+    rb_raise(rb_eArgError, "offsets must have at least one element");
+
+  c_offsets = (const int64_t *)RSTRING_PTR(offsets);
+  c_id      = NUM2LONG(id);
+  c_cost    = NUM2DBL(cost);
+
+  for(i = 0; i < ndocs; i++){
+    if(c_offsets[i] < 0 || c_offsets[i] >= c_offsets[i + 1] || c_offsets[i + 1] > n)
+      rb_raise(rb_eArgError, "Invalid offsets for document %ld, documents cannot be empty "
+               "and must be within the %ld features", i, n);
+  }
+
+  docs = (DOC **)my_malloc(sizeof(DOC *) * (ndocs + 1));
+
+  for(i = 0; i < ndocs; i++){
+    docs[i] = doc_from_packed((const int32_t *)RSTRING_PTR(indices) + c_offsets[i],
+                              (const float *)RSTRING_PTR(weights) + c_offsets[i],
+                              c_offsets[i + 1] - c_offsets[i], c_id + i, c_cost,
+                              FIX2LONG(slackid), FIX2LONG(queryid), error_msg);
+
+    if(!docs[i]){
+      for(c_id = 0; c_id < i; c_id++)
+        doc_free(docs[c_id]);
+
+      free(docs);
+      rb_raise(rb_eArgError, "document %ld: %s", i, error_msg);
+    }
+  }
+
+  result = rb_ary_new2(ndocs);
+  for(i = 0; i < ndocs; i++)
+    rb_ary_push(result, document_wrap(klass, docs[i]));
+
+  free(docs);
+
+  return result;
 }
 
 static VALUE
 doc_get_docnum(VALUE self){
   DOC *d;
-  Data_Get_Struct(self, DOC, d);
+  d = document_get(self);
  
   return INT2FIX(d->docnum);
 }
@@ -734,7 +1607,7 @@ doc_get_docnum(VALUE self){
 static VALUE
 doc_get_slackid(VALUE self){
   DOC *d;
-  Data_Get_Struct(self, DOC, d);
+  d = document_get(self);
  
   return INT2FIX(d->slackid);
 }
@@ -742,7 +1615,7 @@ doc_get_slackid(VALUE self){
 static VALUE
 doc_get_queryid(VALUE self){
   DOC *d;
-  Data_Get_Struct(self, DOC, d);
+  d = document_get(self);
  
   return INT2FIX(d->queryid);
 }
@@ -750,29 +1623,59 @@ doc_get_queryid(VALUE self){
 static VALUE
 doc_get_costfactor(VALUE self){
   DOC *d;
-  Data_Get_Struct(self, DOC, d);
+  d = document_get(self);
  
   return DBL2NUM(d->costfactor);
 }
 
 void
 Init_svmredlight(){
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  // Models and Documents are immutable and everything else runs on C memory that is
+  // either per call or guarded (solver_lock), the methods can be called from any Ractor
+  rb_ext_ractor_safe(true);
+#endif
   rb_mSvmLight = rb_define_module("SVMLight");
   //Model
   rb_cModel = rb_define_class_under(rb_mSvmLight, "Model", rb_cObject);
-  rb_define_singleton_method(rb_cModel, "from_file", model_read_from_file, 1);
+  rb_undef_alloc_func(rb_cModel);
+  rb_define_const(rb_cModel, "LINEAR", INT2FIX(LINEAR));
+  rb_define_const(rb_cModel, "POLY", INT2FIX(POLY));
+  rb_define_const(rb_cModel, "RBF", INT2FIX(RBF));
+  rb_define_const(rb_cModel, "SIGMOID", INT2FIX(SIGMOID));
   rb_define_singleton_method(rb_cModel, "learn_classification", model_learn_classification, 5);
-  rb_define_method(rb_cModel, "to_file", model_write_to_file, 1);
   rb_define_method(rb_cModel, "support_vectors_count", model_support_vectors_count, 0);
   rb_define_method(rb_cModel, "total_words", model_total_words, 0);
   rb_define_method(rb_cModel, "classify", model_classify_example, 1);
+  rb_define_method(rb_cModel, "classify_many", model_classify_batch, 2);
   rb_define_method(rb_cModel, "totdoc", model_totdoc,0);
   rb_define_method(rb_cModel, "maxdiff", model_maxdiff,0);
+  rb_define_method(rb_cModel, "alphas", model_alphas, 0);
+  rb_define_method(rb_cModel, "support_vectors", model_support_vectors, 0);
+  rb_define_method(rb_cModel, "kernel_params", model_kernel_params, 0);
   //Document
   rb_cDocument = rb_define_class_under(rb_mSvmLight, "Document", rb_cObject);
+  rb_undef_alloc_func(rb_cDocument);
   rb_define_singleton_method(rb_cDocument, "create", doc_create, 5);
+  rb_define_singleton_method(rb_cDocument, "create_packed", doc_create_packed, 6);
+  rb_define_singleton_method(rb_cDocument, "create_packed_batch", doc_create_packed_batch, 7);
   rb_define_method(rb_cDocument, "docnum", doc_get_docnum, 0);
   rb_define_method(rb_cDocument, "costfactor", doc_get_costfactor, 0);
   rb_define_method(rb_cDocument, "slackid", doc_get_slackid, 0);
   rb_define_method(rb_cDocument, "queryid", doc_get_queryid, 0);
+
+  Init_svmredlight_reader();
+  Init_svmredlight_linear();
+  Init_svmredlight_kernel_engine();
+  Init_svmredlight_document_set();
+  Init_svmredlight_cross_validation();
+  Init_svmredlight_stats();
+  Init_svmredlight_compact();
+  Init_svmredlight_online();
+  Init_svmredlight_multi_model();
+  Init_svmredlight_model_io();
+  Init_svmredlight_binary_model();
+  Init_svmredlight_featurizer();
+  Init_svmredlight_memory();
+  Init_svmredlight_classify_file();
 }
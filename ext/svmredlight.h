@@ -0,0 +1,239 @@
+#ifndef SVMREDLIGHT_H
+#define SVMREDLIGHT_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "ruby.h"
+#ifdef HAVE_RUBY_THREAD_H
+#include "ruby/thread.h"
+#endif
+#include "svm_light/svm_common.h"
+#include "svm_light/svm_learn.h"
+
+extern VALUE rb_mSvmLight;
+extern VALUE rb_cModel;
+extern VALUE rb_cDocument;
+extern VALUE rb_cDocumentSet;
+
+/* Rubies without Ractors have no use for the flag */
+#ifndef RUBY_TYPED_FROZEN_SHAREABLE
+#define RUBY_TYPED_FROZEN_SHAREABLE 0
+#endif
+
+/* Flags of every wrapped class. dfree functions only release C memory, so they can run
+ * right away, and no wrapped struct references ruby objects, so there are no mark
+ * functions, nothing for compaction to move and no write barriers to miss */
+#define SVMREDLIGHT_TYPED_FLAGS \
+  (RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | RUBY_TYPED_FROZEN_SHAREABLE)
+
+/* See stats.c */
+typedef struct training_stats {
+  long   documents;
+  long   features;
+  double setup_time;
+  double train_time;
+  double train_cpu_time;
+  double copy_time;
+  long   kernel_evaluations;
+  long   kernel_cache_size;
+  long   kernel_cache_rows;
+  long   kernel_cache_max_rows;
+  long   peak_rss;
+} TRAINING_STATS;
+
+/* Alignment of the dense weights of linear models (linear.c, online.c) */
+#define LINEAR_WEIGHTS_ALIGN 64
+
+#define INFERENCE_STATS_BUCKETS 24
+
+typedef struct inference_stats {
+  long   calls;
+  long   documents;
+  long   latency_ns;
+  long   histogram[INFERENCE_STATS_BUCKETS];
+  struct inference_stats *next;
+} INFERENCE_STATS;
+
+/* See compact.c, values are float or int8_t, indices is NULL when the weights are
+ * stored dense (nnz == len) */
+#define COMPACT_FLOAT32 1
+#define COMPACT_INT8    2
+
+typedef struct compact_weights {
+  int     precision;
+  long    len;
+  long    nnz;
+  int32_t *indices;
+  void    *values;
+  double  scale;
+  double  max_error;
+  int     owned;
+} COMPACT_WEIGHTS;
+
+/* What Model objects wrap, the SVM-light MODEL plus how its memory is owned. Models
+ * loaded from a binary file point into the file mapping, only the DOC and SVECTOR
+ * headers of their support vectors (sv_docs, sv_vecs) are malloc'd. linear is set when
+ * the model is scored by the dense weights engine in linear.c, kernel when it is scored
+ * by the engine in kernel_engine.c. training_docnums is set when the docnums of the
+ * support vectors are their positions in the training set (trained models). training
+ * and inference are the stats in stats.c, NULL when there are none. compact is set for
+ * compact linear models (compact.c), which have no support vectors, online for linear
+ * models that were updated (online.c). memsize is what memory.c was last told the model
+ * holds */
+typedef struct rmodel {
+  MODEL   *m;
+  void    *mapping;
+  size_t  mapping_len;
+  DOC     *sv_docs;
+  SVECTOR *sv_vecs;
+  int     linear;
+  pthread_rwlock_t lock;  // linear models, see rmodel_classify and online.c
+  struct kernel_engine *kernel;
+  int     training_docnums;
+  TRAINING_STATS  *training;
+  INFERENCE_STATS *inference;
+  INFERENCE_STATS *retired_inference;
+  COMPACT_WEIGHTS *compact;
+  struct online_state *online;
+  long    memsize;
+} RMODEL;
+
+extern const rb_data_type_t model_data_type;
+extern const rb_data_type_t document_data_type;
+
+int    is_linear(MODEL *model);
+void   doc_free(DOC *d);
+size_t doc_memsize(const DOC *d);
+RMODEL *rmodel_new(MODEL *m);
+size_t model_memsize(const RMODEL *rm);
+void   model_memory_sync(RMODEL *rm);
+VALUE  model_wrap(VALUE klass, RMODEL *rm);
+RMODEL *model_get(VALUE self);
+VALUE  document_wrap(VALUE klass, DOC *d);
+DOC    *document_get(VALUE self);
+
+/* reader.c */
+
+/* The contents of a text file, mmap'd when possible */
+typedef struct text_buffer {
+  char   *data;
+  size_t len;
+  int    mapped;
+} TEXT_BUFFER;
+
+/* One example parsed out of a line in SVM-light's format, words is terminated by a
+ * word with wnum 0 just like SVM-light expects it, comment is always NUL terminated */
+typedef struct parsed_line {
+  double label;
+  long   queryid;
+  long   slackid;
+  double costfactor;
+  WORD   *words;
+  long   nwords;
+  long   words_capacity;
+  char   *comment;
+  long   comment_capacity;
+} PARSED_LINE;
+
+int  text_buffer_open(const char *path, TEXT_BUFFER *buf);
+void text_buffer_close(TEXT_BUFFER *buf);
+void parsed_line_init(PARSED_LINE *line);
+void parsed_line_free(PARSED_LINE *line);
+int  parse_svmlight_line(const char *start, const char *end, PARSED_LINE *line, char *error);
+DOC  *parsed_line_to_doc(PARSED_LINE *line, long docnum);
+void Init_svmredlight_reader(void);
+
+/* linear.c */
+void   linear_engine_prepare(RMODEL *rm);
+void   linear_engine_free(RMODEL *rm);
+double rmodel_classify(RMODEL *rm, DOC *ex);
+double dense_sparse_dot(const double *w, long len, const WORD *words, long n);
+void   Init_svmredlight_linear(void);
+
+/* kernel_engine.c */
+void   kernel_engine_prepare(RMODEL *rm);
+void   kernel_engine_prepare_mapped(RMODEL *rm, WORD *words, const int64_t *rows,
+                                    const double *alpha, const double *norms);
+void   kernel_engine_free(RMODEL *rm);
+size_t kernel_engine_heap_bytes(RMODEL *rm);
+double kernel_engine_classify(RMODEL *rm, DOC *ex);
+void   Init_svmredlight_kernel_engine(void);
+
+/* svmredlight.c, training. Solvers, see the 'solver' learn param */
+#define SOLVER_SVMLIGHT 0
+#define SOLVER_DUAL_CD  1
+
+int   training_params(VALUE learn_params, VALUE kernel_params, LEARN_PARM *c_learn_param,
+                      KERNEL_PARM *c_kernel_param, int *solver, char *error_msg);
+int   training_documents(VALUE r_docs_and_classes, DOC ***c_docs, double **labels,
+                         long *totdocs, long *totwords, VALUE *r_docs, char *error_msg);
+void  training_documents_release(VALUE r_docs, DOC **c_docs, double *labels);
+MODEL *train_classification(DOC **docs, double *labels, long totdocs, long totwords,
+                            LEARN_PARM *learn_param, KERNEL_PARM *kernel_param, int solver,
+                            double *alpha_in, TRAINING_STATS *stats, volatile int *cancelled);
+void  solver_interrupt(void);
+
+/* dual_cd.c */
+MODEL *train_dual_cd(DOC **docs, double *labels, long totdocs, long totwords,
+                     LEARN_PARM *learn_param, KERNEL_PARM *kernel_param, double *alpha_in);
+
+/* stats.c */
+double stats_now(void);
+double stats_thread_cpu_time(void);
+long   stats_peak_rss(void);
+void   inference_stats_record(RMODEL *rm, long documents, double latency);
+void   stats_free(RMODEL *rm);
+void   Init_svmredlight_stats(void);
+
+/* compact.c */
+double compact_classify(RMODEL *rm, DOC *ex);
+size_t compact_bytes(const COMPACT_WEIGHTS *c);
+void   compact_expand(const COMPACT_WEIGHTS *c, double *w);
+void   compact_free(RMODEL *rm);
+void   Init_svmredlight_compact(void);
+
+/* online.c */
+double online_classify(RMODEL *rm, DOC *ex);
+void   online_fold(RMODEL *rm);
+void   online_free(RMODEL *rm);
+size_t online_heap_bytes(const RMODEL *rm);
+void   Init_svmredlight_online(void);
+
+/* model_io.c */
+void Init_svmredlight_model_io(void);
+
+/* multi_model.c */
+void Init_svmredlight_multi_model(void);
+
+/* cross_validation.c */
+void Init_svmredlight_cross_validation(void);
+
+/* document_set.c */
+int  document_set_training_data(VALUE self, DOC ***docs, double **labels, long *totdocs,
+                                long *totwords, char *error);
+void document_set_training_done(VALUE self);
+void Init_svmredlight_document_set(void);
+
+/* binary_model.c */
+void binary_model_unmap(RMODEL *rm);
+void Init_svmredlight_binary_model(void);
+
+/* memory.c, kinds of objects */
+#define MEMORY_MODELS        0
+#define MEMORY_DOCUMENTS     1
+#define MEMORY_DOCUMENT_SETS 2
+#define MEMORY_MULTI_MODELS  3
+#define MEMORY_FEATURIZERS   4
+#define MEMORY_KINDS         5
+
+void memory_adjust(int kind, long objects, long bytes);
+void memory_adjust_mapped(long bytes);
+void Init_svmredlight_memory(void);
+
+/* featurizer.c */
+void Init_svmredlight_featurizer(void);
+
+/* classify_file.c */
+void Init_svmredlight_classify_file(void);
+
+#endif
@@ -2,3 +2,6 @@ require File.dirname(__FILE__) + '/../ext/svmredlight'
 require File.dirname(__FILE__) + '/svmredlight/model'
 require File.dirname(__FILE__) + '/svmredlight/document'
 
+require File.dirname(__FILE__) + '/svmredlight/document_set'
+require File.dirname(__FILE__) + '/svmredlight/multi_model'
+require File.dirname(__FILE__) + '/svmredlight/featurizer'
@@ -17,5 +17,39 @@ module SVMLight
 
       create(docnum, costfactor, slackid, queryid, vector.to_a)
     end
+
+    # Creates a document straight from packed feature numbers and weights, no ruby object
+    # is created per feature
+    # @param [String|Numo::Int32] indices native int32 feature numbers, greater than 0 and increasing
+    # @param [String|Numo::SFloat] weights native float32 weights, one per feature number
+    # @param [Hash] opts same as for Document.new
+    def self.from_packed(indices, weights, opts={})
+      opts = {:docnum => 0, :costfactor => 0, :slackid => 0, :queryid => 0}.merge(opts)
+
+      create_packed(packed(indices), packed(weights),
+                    opts[:docnum], opts[:costfactor], opts[:slackid], opts[:queryid])
+    end
+
+    # Creates many documents out of the features of all of them laid out one after the other,
+    # like the rows of a CSR matrix
+    # @param [String|Numo::Int32] indices native int32 feature numbers of every document
+    # @param [String|Numo::SFloat] weights native float32 weights of every document
+    # @param [Array|String|Numo::Int64] offsets n + 1 positions in indices, document i has the
+    # features from offsets[i] to offsets[i + 1] (exclusive), a String holds native int64
+    # @param [Hash] opts same as for Document.new, documents are numbered from :docnum on
+    # @return [Array] the documents
+    def self.from_packed_batch(indices, weights, offsets, opts={})
+      opts    = {:docnum => 0, :costfactor => 0, :slackid => 0, :queryid => 0}.merge(opts)
+      offsets = offsets.pack('q*') if offsets.is_a? Array
+
+      create_packed_batch(packed(indices), packed(weights), packed(offsets),
+                          opts[:docnum], opts[:costfactor], opts[:slackid], opts[:queryid])
+    end
+
+    def self.packed(buffer)
+      buffer.respond_to?(:to_binary) ? buffer.to_binary : buffer
+    end
+
+    private_class_method :create_packed, :create_packed_batch, :packed
   end
 end
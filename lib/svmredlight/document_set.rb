@@ -0,0 +1,49 @@
+module SVMLight
+  # A DocumentSet holds many labeled documents in a few big native buffers instead of one ruby object per
+  # document, use it for large training sets. Documents are copied in when added and copied out when read, a
+  # set can be given to Model.new instead of an array of documents and labels.
+  class DocumentSet
+    include Enumerable
+
+    # @param [Array] documents_and_labels optional array of [Document, label] pairs to start with
+    def self.new(documents_and_labels = [])
+      create.concat(documents_and_labels)
+    end
+
+    # Appends a [Document, label] pair
+    def <<(document_and_label)
+      add(*document_and_label)
+    end
+
+    # Appends every [Document, label] pair in documents_and_labels
+    def concat(documents_and_labels)
+      documents_and_labels.each { |document, label| add(document, label) }
+      self
+    end
+
+    # Appends a document out of packed feature numbers and weights, no Document is created
+    # @param [String|Numo::Int32] indices native int32 feature numbers, greater than 0 and increasing
+    # @param [String|Numo::SFloat] weights native float32 weights, one per feature number
+    # @param [Numeric] label
+    # @param [Hash] opts :costfactor (1 by default), :slackid and :queryid
+    def add_packed(indices, weights, label, opts = {})
+      opts    = {:costfactor => 1, :slackid => 0, :queryid => 0}.merge(opts)
+      indices = indices.to_binary if indices.respond_to?(:to_binary)
+      weights = weights.to_binary if weights.respond_to?(:to_binary)
+
+      append_packed(indices, weights, label, opts[:costfactor], opts[:slackid], opts[:queryid])
+    end
+
+    # A copy of the set in new native buffers, no Document is created
+    # @return [DocumentSet]
+    def dup
+      self[0, size]
+    end
+
+    alias_method :length, :size
+    alias_method :slice, :[]
+
+    private :append_packed
+    private_class_method :create
+  end
+end
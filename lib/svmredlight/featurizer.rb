@@ -0,0 +1,49 @@
+module SVMLight
+  # Turns raw text into Documents over a fixed vocabulary, term i of the vocabulary being feature number i (from
+  # 1) like in the words file of the examples. Tokenizing, lookups and weighting all happen in C, texts are split
+  # in runs of ASCII letters and digits (other bytes over 127 are kept in tokens), lowercased by default and terms
+  # that are not in the vocabulary are skipped. There is no stemming, terms must look like the vocabulary's.
+  #
+  # A Featurizer never changes once idf is set (see #fit), it can be frozen and shared between threads and
+  # Ractors.
+  class Featurizer
+    DEFAULTS = {:weighting => :tf, :normalize => true, :lowercase => true}.freeze
+
+    # @param [Array] terms the vocabulary, Strings
+    # @param [Hash] opts
+    # @option [:weighting] Symbol :tf (term counts, the default), :binary (1 for every term present) or
+    # :tfidf (counts times the idf of the term, see #fit)
+    # @option [:normalize] Boolean scale every Document to unit L2 norm, true by default
+    # @option [:lowercase] Boolean lowercase ASCII letters of tokens and of the vocabulary's terms, true by default
+    def self.new(terms, opts = {})
+      opts = DEFAULTS.merge(opts)
+      create(terms, opts[:weighting], opts[:normalize], opts[:lowercase])
+    end
+
+    # Loads the vocabulary from a file with a term per line, the term on line i is feature number i
+    # @param [String] path
+    # @param [Hash] opts see Featurizer.new
+    def self.load(path, opts = {})
+      opts = DEFAULTS.merge(opts)
+      from_file(path, opts[:weighting], opts[:normalize], opts[:lowercase])
+    end
+
+    # @param [String] text
+    # @param [Fixnum] docnum the docnum of the Document
+    # @return [Document]
+    def featurize(text, docnum = 0)
+      featurize_one(text, docnum)
+    end
+
+    # Featurizes many texts in a single call with the GVL released
+    # @param [Array] texts Strings
+    # @param [Fixnum] docnum the docnum of the first Document, the next ones count up from it
+    # @return [Array] Documents
+    def featurize_batch(texts, docnum = 0)
+      featurize_many(texts, docnum)
+    end
+
+    private :featurize_one, :featurize_many
+    private_class_method :create, :from_file
+  end
+end
@@ -1,65 +1,296 @@
+require 'tmpdir'
+
 module SVMLight
   
   class MissingModelFile < StandardError; end
+  class ModelWriteError < StandardError; end
   # A model is the product of training a SVM, once created it can take documents as inputs
   # and act of them (by for instance classifying them). Models can also be read from files
   # created by svm_learn.
   class Model
-    TYPES = [:classification]
+    TYPES = [:classification].freeze
+    KERNELS = {:linear => LINEAR, :poly => POLY, :rbf => RBF, :sigmoid => SIGMOID}.freeze
 
-    # Learns a model from a set of labeled documents.
+    # Learns a model from a set of labeled documents. Training runs without holding the GVL so
+    # other threads keep running, and it can be cancelled with Thread#raise or Timeout. Note
+    # SVM-light's solver is not reentrant so concurrent trainings are run one after the other.
     # @param [Symbol] type, what kind of model is this, classification, regression, etc. for now the only valid value is classification.
     # @param [Array] documents_and_lables documents and labels is an array of arrays where each inner array must have two elements, the first, a Document and the second a classification (normally +1 and  -1)
-    # @param [Hash] learn_params each key of learn_params is a string it that maps to a field of the LEARN_PARM struct in SVMLight
-    # @param [Hash] kernel_params each key of kernel_params is a string it that maps to a field of the KERNEL_PARM struct in SVMLight
+    # @param [Hash] learn_params each key of learn_params is a string it that maps to a field of the LEARN_PARM struct in SVMLight,
+    # 'solver' can be :svmlight (the default) or :dual_cd, a dual coordinate descent solver for linear models that is much
+    # faster on large sparse problems and trains concurrently with other trainings
+    # @param [Hash] kernel_params each key of kernel_params is a string it that maps to a field of the KERNEL_PARM struct in SVMLight, 'kernel_type' can also be one of the keys of KERNELS (:linear, :poly, :rbf, :sigmoid)
     # @param [Array|Nil] alphas an array of alpha values 
     def self.new(type, documents_and_lables, learn_params, kernel_params, alphas = nil )
       raise ArgumentError, "Supporte types are (for now) #{TYPES}" unless TYPES.include? type
 
-      learn_classification(documents_and_lables, learn_params, kernel_params, false, alphas)
+      learn_classification(documents_and_lables, learn_params, c_kernel_params(kernel_params), true, alphas)
+    end
+
+    # Learns a classification model from a training file in SVM-light's format without creating a ruby object per
+    # document, the file is parsed in C into a DocumentSet which is released as soon as training is over, so peak
+    # memory is the set plus what SVM-light needs to train.
+    # @param [String] path
+    # @param [Hash] learn_params same as for Model.new
+    # @param [Hash] kernel_params same as for Model.new
+    # @return [Model]
+    def self.learn_classification_from_file(path, learn_params = {}, kernel_params = {})
+      documents_and_labels = DocumentSet.read(path)
+
+      new(:classification, documents_and_labels, learn_params, kernel_params)
+    ensure
+      documents_and_labels.clear if documents_and_labels
+    end
+
+    # Cross validates every configuration in a grid of parameters, folds and configurations are trained and
+    # tested on a pool of native threads without holding the GVL. Document i is tested in fold i % folds.
+    # @param [Array|DocumentSet] documents_and_labels same as for Model.new
+    # @param [Hash] opts
+    # @option [:folds] Fixnum number of folds, 5 by default
+    # @option [:grid] Array|Hash learn and/or kernel params to try, either an array of hashes or a hash of arrays
+    # (all combinations are tried), e.g. {'svm_c' => [0.1, 1, 10], 'eps' => [0.1, 0.01]}
+    # @option [:learn_params] Hash learn params shared by all configurations
+    # @option [:kernel_params] Hash kernel params shared by all configurations
+    # @option [:threads] Fixnum size of the thread pool, the number of CPUs by default
+    # @return [Array] one hash per configuration, in grid order, with :params, :accuracy, :precision, :recall,
+    # :train_time and :test_time (seconds, summed over the folds) and the per fold results in :folds
+    def self.cross_validate(documents_and_labels, opts = {})
+      folds         = opts[:folds] || 5
+      grid          = expand_grid(opts[:grid] || [{}])
+      learn_params  = opts[:learn_params] || {}
+      kernel_params = opts[:kernel_params] || {}
+
+      results = cross_validation(documents_and_labels, folds,
+                                 grid.map { |params| learn_params.merge(params) },
+                                 grid.map { |params| c_kernel_params(kernel_params.merge(params)) },
+                                 opts[:threads] || 0)
+
+      grid.each_with_index.map do |params, config|
+        fold_results = results.select { |r| r[:config] == config }
+        totals       = Hash.new(0)
+
+        fold_results.each { |r| r.each { |k, v| totals[k] += v if v.is_a?(Numeric) } }
+
+        tp, fp, tn, fn = totals.values_at(:true_positives, :false_positives, :true_negatives, :false_negatives)
+
+        { :params     => params,
+          :accuracy   => (tp + tn).to_f / (tp + fp + tn + fn),
+          :precision  => tp + fp > 0 ? tp.to_f / (tp + fp) : 0.0,
+          :recall     => tp + fn > 0 ? tp.to_f / (tp + fn) : 0.0,
+          :train_time => totals[:train_time],
+          :test_time  => totals[:test_time],
+          :folds      => fold_results }
+      end
     end
 
-    private_class_method :learn_classification
+    def self.expand_grid(grid)
+      return grid unless grid.is_a? Hash
+
+      grid.inject([{}]) do |points, (key, values)|
+        points.product(Array(values)).map { |point, value| point.merge(key => value) }
+      end
+    end
+
+    # Kernel params as the C side expects them, 'kernel_type' can be one of the keys of KERNELS
+    def self.c_kernel_params(kernel_params)
+      if KERNELS.has_key?(kernel_params['kernel_type'])
+        kernel_params.merge('kernel_type' => KERNELS[kernel_params['kernel_type']])
+      else
+        kernel_params
+      end
+    end
+
+    private_class_method :learn_classification, :cross_validation, :expand_grid, :c_kernel_params
     private_class_method :from_file
     
-    # in self.read_from_file and #write_to_file
-    #
-    # This is an anti-pattern. Checking for existence of resources is normally something to be avoided. Trying to open
-    # the resource and then rescuing the exception/reading the error code is a much better practice, however SVMLight
-    # will call exit(1) if the file does not exists, and, that in turn will kill the ruby VM, so in this case to
-    # minimize that possibility I'm optimistically check for the file existence and hope it is still there when it is
-    # actually time to open it.
-    #
-    # TODO: Come up with a proper replacement for those methods, probably simply reimplementing them in svmredlight.c 
-    # and raising an exception when files cannot be open.
-
-    # Will load an existent model from a file
+    # Will load an existent model from a file, format errors raise ArgumentError
     # @param [String] pahtofile path to the model file 
     def self.read_from_file(pahtofile)
-      if File.exists?(pahtofile) && File.file?(pahtofile) 
-        from_file(pahtofile)
+      from_file(pahtofile)
+    rescue Errno::ENOENT, Errno::EISDIR
+      raise MissingModelFile, "the #{pahtofile} does not exists or is not a file"
+    end
+
+    # Writes the model in SVM-light's text format, to io or to a new String
+    # @param [IO] io any object that responds to write
+    # @return [String|IO] the String, or io
+    def dump(io = nil)
+      dump_to(io)
+    end
+
+    private :classify_many, :dump_to, :online_update, :classify_path
+
+    # Trains a new model warm started from this one's solution. Without previous_documents_and_labels the new model
+    # is trained on this model's support vectors plus the additional documents (the documents that are not support
+    # vectors have an alpha of 0 and are left out), with them on the whole original training set, in the same order,
+    # plus the additional documents.
+    # @param [Array] additional_documents_and_labels new [Document, label] pairs, they start with an alpha of 0
+    # @param [Hash] learn_params same as for Model.new, use the ones this model was trained with
+    # @param [Array|DocumentSet] previous_documents_and_labels the documents this model was trained on, a set is
+    #   trained on as is when there are no additional documents, else they are appended to a copy of it
+    # @return [Model]
+    # @raise [ArgumentError] when previous_documents_and_labels is not the size of this model's training set
+    def retrain(additional_documents_and_labels, learn_params = {}, previous_documents_and_labels = nil)
+      if previous_documents_and_labels
+        alphas = self.alphas
+
+        if alphas.size != previous_documents_and_labels.size
+          raise ArgumentError, "the model was trained on #{alphas.size} documents, " \
+                               "#{previous_documents_and_labels.size} previous documents given"
+        end
+      end
 
+      if previous_documents_and_labels.is_a? DocumentSet
+        documents_and_labels = if additional_documents_and_labels.to_a.empty?
+                                 previous_documents_and_labels
+                               else
+                                 previous_documents_and_labels.dup.concat(additional_documents_and_labels)
+                               end
+      elsif previous_documents_and_labels
+        documents_and_labels = previous_documents_and_labels + additional_documents_and_labels.to_a
       else
+        svs                  = support_vectors
+        documents_and_labels = svs + additional_documents_and_labels.to_a
+        all_alphas           = self.alphas
+        alphas               = svs.map { |document, label| all_alphas[document.docnum] }
+      end
+
+      self.class.new(:classification, documents_and_labels, learn_params, kernel_params, alphas)
+    end
+
+    # A copy of this model that lives in a read only mapping of a binary model file (see write_binary) in shared
+    # memory, /dev/shm when there is one. The file is unlinked right away, the mapping goes away with the last model
+    # (and forked process) using it. Load models this way, or with Model.load_binary, before forking workers: the
+    # support vectors and weights are never written so every worker keeps sharing the parent's pages.
+    # @param [String] dir where the file is written, /dev/shm or Dir.tmpdir by default
+    # @return [Model]
+    def shared(dir = nil)
+      dir ||= File.directory?('/dev/shm') && File.writable?('/dev/shm') ? '/dev/shm' : Dir.tmpdir
+      path  = File.join(dir, "svmredlight-#{Process.pid}-#{object_id}.bin")
+
+      write_binary(path)
+      Model.load_binary(path)
+    ensure
+      File.unlink(path) if path && File.exist?(path)
+    end
+
+    # How much of this model's memory is shared with other processes, read from /proc/self/smaps, nil for models
+    # not loaded from a binary file (or without smaps). Only the pages of the mapping that were touched count, the
+    # ones other processes (e.g. the parent of a forked worker) map too are shared, the rest private. heap_bytes is
+    # what this process malloc'd for the model on top of the mapping, it is never shared after writes.
+    # @return [Hash|Nil] :mapped_bytes, :resident_bytes, :shared_bytes, :private_bytes and :heap_bytes
+    def memory_sharing
+      address, length, heap = mapping
+      return nil unless address && File.readable?('/proc/self/smaps')
 
-        raise MissingModelFile, "the #{pahtofile} does not exists or is not a file"
+      result = {:mapped_bytes => length, :resident_bytes => 0, :shared_bytes => 0, :private_bytes => 0,
+                :heap_bytes => heap}
+      inside = false
+
+      File.foreach('/proc/self/smaps') do |line|
+        if line =~ /\A(\h+)-(\h+) /
+          inside = $1.hex < address + length && $2.hex > address
+        elsif inside && line =~ /\A(\w+):\s+(\d+) kB/
+          bytes = $2.to_i * 1024
+
+          case $1
+          when 'Rss' then result[:resident_bytes] += bytes
+          when 'Shared_Clean', 'Shared_Dirty' then result[:shared_bytes] += bytes
+          when 'Private_Clean', 'Private_Dirty' then result[:private_bytes] += bytes
+          end
+        end
       end
+
+      result
+    end
+
+    # A copy of this linear model that keeps only its weight vector, quantized, for serving many models from little
+    # memory. The support vectors are dropped so the copy can classify but cannot be retrained or written in
+    # SVM-light's text format, write_binary keeps it compact. The score of a document x differs from this model's by at
+    # most compact_info[:max_weight_error] times the sum of the absolute values of x's features.
+    # @param [Hash] opts
+    # @option [:precision] Symbol :float32 (the default) or :int8, a byte per weight plus a scale for the whole model
+    # @option [:prune_below] Float weights with an absolute value under this are dropped, the rest are stored sparse
+    # when that takes less memory
+    # @return [Model]
+    def compact(opts = {})
+      compact_weights(opts[:precision] || :float32, (opts[:prune_below] || 0).to_f)
+    end
+
+    # Classifies many documents in a single call, the documents are scored in C with the GVL
+    # released so other threads can keep running while a large batch is being scored.
+    # @param [Array] documents an array of Documents
+    # @param [Hash] opts
+    # @option [:packed] Boolean when true the scores are returned as a binary String of native doubles (use unpack('d*')) instead of an Array of Floats
+    # @return [Array|String] the scores in the same order as documents
+    def classify_batch(documents, opts = {})
+      classify_many(documents, opts[:packed] ? true : false)
     end
 
-    private :to_file
+    # Scores every example in a file in SVM-light's format and writes one prediction per line to output_path, like
+    # svm_classify does. Chunks of the input are parsed and scored in parallel by native threads with the GVL
+    # released, predictions are written in input order. Labeled examples (label other than 0) are counted against
+    # their predictions.
+    # @param [String] input_path
+    # @param [String] output_path
+    # @param [Hash] opts
+    # @option [:threads] Fixnum worker threads, the number of online CPUs by default
+    # @option [:chunk_size] Fixnum bytes of input a thread takes at a time (rounded up to whole lines), 4MB by
+    # default. Up to 4 chunks per thread are in memory at once
+    # @return [Hash] :documents and :labeled, the confusion counts :true_positives, :false_positives,
+    # :false_negatives and :true_negatives, and :accuracy, :precision and :recall (nil when undefined)
+    def classify_file(input_path, output_path, opts = {})
+      threads = opts[:threads]
+      threads = 0 if threads.nil? || threads == :auto
+      raise ArgumentError, "threads must be greater than 0" unless threads.is_a?(Integer) && threads >= 0
+
+      chunk_size = opts[:chunk_size] || 0
+      raise ArgumentError, "chunk_size must be greater than 0" unless chunk_size.is_a?(Integer) && chunk_size >= 0
+
+      documents, labeled, correct, tp, fp, fn, tn = classify_path(input_path, output_path, threads, chunk_size)
+
+      {:documents => documents, :labeled => labeled,
+       :true_positives => tp, :false_positives => fp, :false_negatives => fn, :true_negatives => tn,
+       :accuracy  => labeled > 0 ? correct.to_f / labeled : nil,
+       :precision => tp + fp > 0 ? tp.to_f / (tp + fp) : nil,
+       :recall    => tp + fn > 0 ? tp.to_f / (tp + fn) : nil}
+    end
+
+    # Updates this linear model in place with one labeled document, see update_batch
+    # @param [Document] document
+    # @param [Numeric] label
+    # @param [Hash] opts same as for update_batch
+    # @return [Fixnum] 1 when the document changed the weights, 0 otherwise
+    def update(document, label, opts = {})
+      update_batch([[document, label]], opts)
+    end
+
+    # Updates this linear model in place, in O(number of features of the documents) however many features the model
+    # has. Features the model has never seen are added. Other threads can keep classifying while it is updated, every
+    # score is taken against one version of the weights. The first update drops the support vectors, from then on the
+    # model keeps a single one, its weight vector, so alphas and retrain do not apply anymore. Unlabeled documents
+    # (label 0) are skipped.
+    # @param [Array] documents_and_labels [Document, label] pairs
+    # @param [Hash] opts
+    # @option [:rule] Symbol :pegasos (the default), one stochastic sub gradient step for the whole batch, or
+    # :passive_aggressive, the smallest change that classifies each document with a margin of 1, one document at a time
+    # @option [:lambda] Float Pegasos' regularization, 1 / totdoc by default (i.e. C = 1)
+    # @option [:c] Float how far a passive aggressive update can go, 1.0 by default
+    # @return [Fixnum] how many of the documents changed the weights
+    def update_batch(documents_and_labels, opts = {})
+      online_update(documents_and_labels, opts[:rule] || :pegasos, (opts[:lambda] || 0).to_f, (opts[:c] || 1.0).to_f)
+    end
 
     # Will create a file containing the model info, the model info can be turn back into a model by using
     # Model.read_from_file
     # @param [String] pahtofile
     def write_to_file(pahtofile)
-      dir = File.dirname(pahtofile)
-
-      if File.directory?(dir) && File.writable?(dir)
-        to_file(pahtofile)
+      # Checked before opening, File.open would leave an empty file behind
+      raise ArgumentError, "Compact models can only be written with write_binary" if compact_info
 
-      else
-        raise ModelWriteError, "impossible to write #{pahtofile}" 
-
-      end
+      File.open(pahtofile, 'w') { |f| dump(f) }
+    rescue SystemCallError => e
+      raise ModelWriteError, "impossible to write #{pahtofile}: #{e.message}"
     end
   end
 end
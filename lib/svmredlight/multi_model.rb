@@ -0,0 +1,43 @@
+module SVMLight
+  # Scores documents against many linear models at once, e.g. one vs rest multiclass or multi label classification
+  # with a model per category. The weights of the models are copied into a single features x classes matrix so a
+  # document is scored against every model in one pass over its features, which costs about as much as scoring it
+  # against one model.
+  class MultiModel
+    attr_reader :labels
+
+    # @param [Array] models linear (or compact) Models, they are not referenced once the MultiModel is created
+    # @param [Array] labels what each model stands for, 0...models.size by default
+    def self.new(models, labels = nil)
+      labels ||= (0...models.size).to_a
+      raise ArgumentError, "There must be one label per model" unless labels.size == models.size
+
+      multi_model = create(models)
+      multi_model.send(:labels=, labels.dup.freeze)
+      multi_model
+    end
+
+    # The k labels with the highest scores, best first
+    # @param [Document] document
+    # @param [Fixnum] k
+    # @return [Array] [label, score] pairs
+    def top(document, k = 1)
+      labels.zip(classify(document)).sort_by { |label, score| -score }.first(k)
+    end
+
+    # Scores many documents in a single call with the GVL released, see Model#classify_batch
+    # @param [Array] documents an array of Documents
+    # @param [Hash] opts
+    # @option [:packed] Boolean when true the scores are returned as a binary String of native doubles, size scores
+    # per document, instead of an Array with an Array of scores per document
+    # @return [Array|String]
+    def classify_batch(documents, opts = {})
+      classify_many(documents, opts[:packed] ? true : false)
+    end
+
+    attr_writer :labels
+
+    private :labels=, :classify_many
+    private_class_method :create
+  end
+end
@@ -29,6 +29,24 @@ class TestDocument < Test::Unit::TestCase
       assert_raise(ArgumentError){ Document.create(1, 0.5, 1, 0, [[-1, 1.0 ], [30, 0.0 ], [40, 0.0], [41, 0.1 ]])}
     end
 
+    should "create documents from packed indices and weights" do
+      d = Document.from_packed([1, 4, 11].pack('l*'), [1.0, 0.25, 0.5].pack('f*'), :docnum => 3, :costfactor => 0.5)
+
+      assert_equal 3, d.docnum
+      assert_equal 0.5, d.costfactor
+      assert_raise(ArgumentError){ Document.from_packed([1, 4].pack('l*'), [1.0].pack('f*')) }
+      assert_raise(ArgumentError){ Document.from_packed([4, 1].pack('l*'), [1.0, 1.0].pack('f*')) }
+      assert_raise(ArgumentError){ Document.from_packed('', '') }
+    end
+
+    should "create many documents from packed buffers" do
+      docs = Document.from_packed_batch([1, 4, 2, 3, 9].pack('l*'), [1, 2, 3, 4, 5].pack('f*'), [0, 2, 5], :docnum => 10)
+
+      assert_equal [10, 11], docs.map(&:docnum)
+      assert_raise(ArgumentError){ Document.from_packed_batch([1].pack('l*'), [1].pack('f*'), [0, 1, 1]) }
+      assert_raise(ArgumentError){ Document.from_packed_batch([1].pack('l*'), [1].pack('f*'), [0, 2]) }
+    end
+
     should "raise type error when the fourth argument is not an array" do
       assert_raise(TypeError) { Document.create(-1, 0, 1, 0, {})  }
     end
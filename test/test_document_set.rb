@@ -0,0 +1,109 @@
+require './test/helper'
+include SVMLight
+
+class TestDocumentSet < Test::Unit::TestCase
+
+  context "a document set" do
+    setup do
+      @features = [
+        [ [1,0.6], [11, 0.2], [34, 0.1] ],
+        [ [5,0.4], [15, 0.3], [30, 0.1] ],
+        [ [1,0.1], [13, 0.5], [31, 0.1] ],
+        [ [7,0.7], [15, 0.2], [35, 0.1] ],
+        [ [5,0.6], [19, 0.4], [44, 0.1] ],
+      ]
+
+      @docs_and_labels = @features.each_with_index.map do |feature, index|
+        [ Document.create(index, 1, 0, 0, feature), index % 2 == 0 ? 1 : -1 ]
+      end
+
+      @set = DocumentSet.new(@docs_and_labels)
+    end
+
+    should "hold copies of the documents and their labels" do
+      assert_equal 5, @set.size
+      assert_equal 44, @set.total_words
+      assert_equal [1.0, -1.0, 1.0, -1.0, 1.0], @set.labels
+
+      document, label = @set[1]
+      assert_kind_of Document, document
+      assert_equal 1, document.docnum
+      assert_equal -1.0, label
+      assert_nil @set[5]
+      assert_equal -1.0, @set[-2].last
+    end
+
+    should "append, slice and iterate" do
+      @set << [Document.create(0, 1, 0, 0, [[2, 0.5]]), 1]
+      @set.add_packed([3, 9].pack('l*'), [0.5, 0.25].pack('f*'), -1)
+
+      assert_equal 7, @set.size
+      assert_equal [1.0, -1.0], @set[5..6].labels
+      assert_equal [-1.0, 1.0], @set.slice(1, 2).labels
+      assert_equal @set.labels, @set.dup.labels
+      assert_equal 8, @set.dup.concat(@docs_and_labels.first(1)).size
+      assert_equal [0, 1, 2, 3, 4, 5, 6], @set.map { |document, label| document.docnum }
+      assert_raise(ArgumentError){ @set.add_packed([9, 3].pack('l*'), [0.5, 0.25].pack('f*'), -1) }
+      assert_raise(TypeError){ @set << [1, 1] }
+      assert_equal 7, @set.size
+    end
+
+    should "be accepted for training" do
+      from_set   = Model.new(:classification, @set, {}, {}, nil)
+      from_array = Model.new(:classification, @docs_and_labels, {}, {}, nil)
+
+      assert_equal from_array.support_vectors_count, from_set.support_vectors_count
+      @docs_and_labels.each do |document, label|
+        assert_in_delta from_array.classify(document), from_set.classify(document), 0.0001
+      end
+
+      assert_raise(ArgumentError){ Model.new(:classification, DocumentSet.new, {}, {}, nil) }
+    end
+
+    should "refuse to be cleared while it is being trained on" do
+      random = Random.new(7)
+      set    = DocumentSet.new
+      3000.times do
+        set.add_packed((1..20).map { |i| i * 50 + random.rand(50) }.pack('l*'),
+                       Array.new(20) { random.rand }.pack('f*'), random.rand(2) * 2 - 1)
+      end
+
+      # Noisy labels and a tiny epsilon keep dual_cd busy for a while without the GVL
+      training = Thread.new do
+        Model.new(:classification, set, {'solver' => :dual_cd, 'svm_c' => 1000.0, 'epsilon_crit' => 1e-12}, {}, nil)
+      end
+      sleep 0.05
+
+      assert_raise(RuntimeError){ set.clear }
+      assert_kind_of Model, training.value
+      assert_equal 0, set.clear.size
+    end
+
+    should "read a training file and train from it" do
+      path = './test/assets/written_training_file'
+      File.open(path, 'w') do |f|
+        f.puts '# a comment'
+        @features.each_with_index do |features, i|
+          f.puts "#{i % 2 == 0 ? 1 : -1} #{features.map { |wnum, weight| "#{wnum}:#{weight}" }.join(' ')} # doc #{i}"
+        end
+      end
+
+      set = DocumentSet.read(path)
+      assert_equal @set.labels, set.labels
+      assert_equal @set.total_words, set.total_words
+
+      from_file = Model.learn_classification_from_file(path, {}, {})
+      from_set  = Model.new(:classification, @set, {}, {}, nil)
+      @docs_and_labels.each do |document, label|
+        assert_equal from_set.classify(document), from_file.classify(document)
+      end
+
+      assert_equal 0, set.clear.size
+      File.open(path, 'a') { |f| f.puts '1 3:x' }
+      assert_raise(ArgumentError){ DocumentSet.read(path) }
+      assert_raise(Errno::ENOENT){ DocumentSet.read(path + '.missing') }
+    ensure
+      File.delete(path) if File.exist?(path)
+    end
+  end
+end
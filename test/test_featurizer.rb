@@ -0,0 +1,77 @@
+require './test/helper'
+include SVMLight
+
+class TestFeaturizer < Test::Unit::TestCase
+
+  # Features are only observable through scores
+  def assert_same_vector(expected, document)
+    assert_in_delta @model.classify_batch([Document.new(expected)])[0], @model.classify_batch([document])[0], 1e-6
+  end
+
+  context "a featurizer" do
+    setup do
+      @model      = Model.read_from_file('test/assets/model')
+      @featurizer = Featurizer.new(%w{cat dog the mat sat}, :normalize => false)
+    end
+
+    should "map terms to their feature numbers" do
+      assert_equal 5, @featurizer.vocabulary_size
+      assert_equal 1, @featurizer['cat']
+      assert_equal 4, @featurizer['mat']
+      assert_nil @featurizer['bird']
+
+      cased = Featurizer.new(%w{Cat DOG cat}, :normalize => false)
+      assert_equal 1, cased['cat']
+      assert_equal 2, cased['Dog']
+      assert_same_vector({1 => 2, 2 => 1}, cased.featurize("cat CAT dog"))
+
+      exact = Featurizer.new(%w{Cat dog}, :normalize => false, :lowercase => false)
+      assert_equal 1, exact['Cat']
+      assert_nil exact['cat']
+      assert_same_vector({1 => 1}, exact.featurize("Cat cat"))
+    end
+
+    should "count the known tokens of a text" do
+      assert_same_vector({1 => 2, 3 => 2, 4 => 1, 5 => 1}, @featurizer.featurize("The cat sat on the MAT, cat!"))
+      assert_same_vector({1 => 0.0}, @featurizer.featurize("nothing known here"))
+      assert_equal 7, @featurizer.featurize("cat", 7).docnum
+
+      binary = Featurizer.new(%w{cat dog the mat sat}, :weighting => :binary, :normalize => false)
+      assert_same_vector({1 => 1, 3 => 1}, binary.featurize("the cat the cat"))
+
+      normalized = Featurizer.new(%w{cat dog the mat sat})
+      assert_same_vector({1 => 0.6, 2 => 0.8}, normalized.featurize("dog cat dog cat dog cat dog"))
+    end
+
+    should "weight terms by idf once fit" do
+      tfidf = Featurizer.new(%w{cat dog the mat sat}, :weighting => :tfidf, :normalize => false)
+      assert_equal [1.0] * 5, tfidf.idf
+
+      tfidf.fit(["the cat", "the dog", "the mat"])
+      idf = tfidf.idf
+      assert_in_delta Math.log(4.0 / 4) + 1, idf[2], 1e-12
+      assert_in_delta Math.log(4.0 / 2) + 1, idf[0], 1e-12
+      assert_in_delta Math.log(4.0 / 1) + 1, idf[4], 1e-12
+      assert_same_vector({1 => 2 * idf[0], 3 => idf[2]}, tfidf.featurize("cat the cat"))
+
+      tfidf.idf = [2.0] * 5
+      assert_same_vector({1 => 4.0}, tfidf.featurize("cat cat"))
+      assert_raise(ArgumentError) { tfidf.idf = [1.0] }
+      assert_raise(FrozenError) { tfidf.freeze.fit(["cat"]) }
+      assert_raise(ArgumentError) { Featurizer.new(%w{cat}, :weighting => :bm25) }
+    end
+
+    should "featurize batches and load vocabularies from files" do
+      words = Featurizer.load('examples/example1/words')
+      texts = File.readlines('examples/example1/words').first(200).each_slice(20).map(&:join)
+      batch = words.featurize_batch(texts, 10)
+
+      assert_equal 9947, words.vocabulary_size
+      assert_equal 1, words[File.readlines('examples/example1/words').first.chomp]
+      assert_equal texts.size, batch.size
+      assert_equal (10...10 + texts.size).to_a, batch.map(&:docnum)
+      assert_equal texts.map { |t| @model.classify_batch([words.featurize(t)])[0] }, @model.classify_batch(batch)
+      assert_equal [], words.featurize_batch([])
+    end
+  end
+end
@@ -24,11 +24,280 @@ class TestModel < Test::Unit::TestCase
       assert_kind_of Numeric, m.classify( Document.create(-1, 1, 0, 0,[1, 0.5, 0, 0, 0, 0 , 0 ].each_with_index.map{|v, i| [i + 1,v.to_f]}) )
     end
 
+    should "classify many documents at once with classify_batch" do
+      m    = Model.read_from_file(@file_name)
+      docs = [[1.0, 0, 0, 0, 0.5 ], [1, 0, 0, 0, 0.8, 0, 0 , 0 ], [1, 0.5, 0, 0, 0, 0 , 0 ]].map do |values|
+        Document.create(-1, 1, 0, 0, values.each_with_index.map{|v, i| [i + 1, v.to_f]})
+      end
+
+      scores = m.classify_batch(docs)
+      assert_equal docs.size, scores.size
+      docs.each_with_index{ |d, i| assert_in_delta m.classify(d), scores[i], 0.0001 }
+
+      assert_equal scores, m.classify_batch(docs, :packed => true).unpack('d*')
+      assert_equal [], m.classify_batch([])
+      assert_raise(TypeError){ m.classify_batch([docs.first, 1]) }
+    end
+
+    should "ignore features the linear model has never seen" do
+      m = Model.read_from_file(@file_name)
+
+      assert_includes %w{avx512 avx2 scalar}, SVMLight.linear_engine
+      assert_equal m.classify(Document.create(-1, 1, 0, 0, [[1, 1.0], [15, 0.5]])),
+                   m.classify(Document.create(-1, 1, 0, 0, [[1, 1.0], [15, 0.5], [50000, 2.0], [60000, 1.0]]))
+    end
+
+    should "classify a whole file in SVM-light's format" do
+      output = './test/assets/written_predictions'
+      m      = Model.read_from_file(@file_name)
+      docs   = SVMLight.read_documents('examples/example1/test.dat')
+      scores = m.classify_batch(docs.map(&:first))
+
+      result = m.classify_file('examples/example1/test.dat', output, :threads => 3)
+      File.readlines(output).map(&:to_f).zip(scores).each { |p, s| assert_in_delta s, p, 1e-6 }
+
+      # About 130 chunks, so chunks are written out of order and slots get reused
+      chunked = m.classify_file('examples/example1/test.dat', output + '.chunked', :threads => 3, :chunk_size => 4096)
+      assert_equal File.read(output), File.read(output + '.chunked')
+      assert_equal result, chunked
+
+      assert_equal docs.size, File.readlines(output).size
+      assert_equal docs.size, result[:documents]
+      assert_equal docs.size, result[:labeled]
+      assert_equal docs.count { |d, label| label > 0 }, result[:true_positives] + result[:false_negatives]
+      assert_in_delta docs.zip(scores).count { |(d, label), s| label * s > 0 } / docs.size.to_f, result[:accuracy], 1e-12
+
+      File.write(output + '.in', "1 1:0.5\n\n# comment\n-1 3:1 2:1\n")
+      assert_raise(ArgumentError){ m.classify_file(output + '.in', output) }
+      assert_raise(ArgumentError){ m.classify_file(output + '.in', output, :chunk_size => -1) }
+    ensure
+      [output, output + '.chunked', output + '.in'].each { |path| File.delete(path) if File.exist?(path) }
+    end
+
+    should "report the native memory it holds" do
+      require 'objspace'
+      m = Model.read_from_file(@file_name)
+      d = Document.create(-1, 1, 0, 0, [[1, 1.0], [15, 0.5], [4217, 0.3]])
+
+      assert ObjectSpace.memsize_of(m) > 3876 * 64
+      assert ObjectSpace.memsize_of(d) >= 4 * 8
+
+      # Online updates grow the weights
+      m.update(Document.create(-1, 1, 0, 0, [[100000, 1.0]]), 1)
+      assert ObjectSpace.memsize_of(m) >= 100000 * 8
+
+      stats = SVMLight.memory_stats
+      assert stats[:allocated_bytes] >= stats[:bytes]
+      assert stats[:models][:objects] >= 1
+      assert stats[:documents][:objects] >= 1
+      assert stats[:models][:bytes] >= 100000 * 8
+      assert_equal stats.values_at(:models, :documents, :document_sets, :multi_models, :featurizers).sum { |s| s[:bytes] },
+                   stats[:bytes]
+
+      allocated = stats[:allocated_bytes]
+      Document.create(-1, 1, 0, 0, [[1, 1.0], [2, 1.0]])
+      assert SVMLight.memory_stats[:allocated_bytes] > allocated
+    end
+
+    should "classify from several Ractors with a shareable model" do
+      m = Ractor.make_shareable(Model.read_from_file(@file_name))
+      d = Document.create(-1, 1, 0, 0, [[1, 1.0], [15, 0.5], [4217, 0.3]])
+
+      assert m.frozen?
+      assert_raise(FrozenError){ m.inference_stats = true }
+
+      expected = [m.classify(d), m.classify_batch([d])]
+      ractors  = 4.times.map do
+        Ractor.new(m) do |model|
+          doc = SVMLight::Document.create(-1, 1, 0, 0, [[1, 1.0], [15, 0.5], [4217, 0.3]])
+          [model.classify(doc), model.classify_batch([doc] * 100).uniq]
+        end
+      end
+
+      ractors.each{ |r| assert_equal expected, r.take }
+    end if defined?(Ractor)
+
     should "raise file not found exception when file does not exists" do
       assert_raises(MissingModelFile){ Model.read_from_file(@file_name + 'bleh') }
     end
   end
 
+  context "scoring non linear models" do
+    setup do
+      @file_name = './test/assets/written_rbf_model'
+      lines      = File.readlines('test/assets/model')
+      lines[1]   = "2 # kernel type\n"
+      lines[3]   = "0.5 # kernel parameter -g \n"
+      File.open(@file_name, 'w'){ |f| f.write(lines.join) }
+
+      @b   = lines[10].to_f
+      @svs = lines[11..-1].map do |l|
+        fields = l.split('#').first.split
+        [fields.shift.to_f, Hash[fields.map{ |w| k, v = w.split(':'); [k.to_i, v.to_f] }]]
+      end
+    end
+
+    teardown do
+      [@file_name, @file_name + '.trained', @file_name + '.bin'].each { |f| File.delete(f) if File.exist?(f) }
+      SVMLight.kernel_threads = 1
+    end
+
+    should "score trained models the same as their text and binary copies" do
+      random = Random.new(7)
+      docs   = Array.new(40) do |i|
+        [Document.create(i, 1, 0, 0, (1..5).map { |j| [j * 3 + random.rand(3), random.rand] }), i.even? ? 1 : -1]
+      end
+      m = Model.new(:classification, docs, {}, {'kernel_type' => :rbf, 'rbf_gamma' => 0.5}, nil)
+      m.write_to_file(@file_name + '.trained')
+      m.write_binary(@file_name + '.bin')
+      text, binary = Model.read_from_file(@file_name + '.trained'), Model.load_binary(@file_name + '.bin')
+
+      docs.each do |doc, _|
+        assert_in_delta text.classify(doc), m.classify(doc), 0.0001
+        assert_in_delta text.classify(doc), binary.classify(doc), 0.0001
+      end
+    end
+
+    should "give the same scores as the rbf kernel expansion" do
+      m    = Model.read_from_file(@file_name)
+      x    = {15 => 0.5, 160 => 0.25, 4217 => 1.0, 50000 => 2.0}
+      doc  = Document.create(-1, 1, 0, 0, x.to_a)
+      norm = x.values.inject(0.0){ |s, v| s + v * v }
+
+      expected = @svs.inject(0.0) do |sum, (alpha, sv)|
+        dot     = x.inject(0.0){ |s, (k, v)| s + v * sv.fetch(k, 0.0) }
+        sv_norm = sv.values.inject(0.0){ |s, v| s + v * v }
+        sum + alpha * Math.exp(-0.5 * (sv_norm - 2 * dot + norm))
+      end - @b
+
+      assert_in_delta expected, m.classify(doc), 0.0001
+
+      SVMLight.kernel_threads = 4
+      assert_equal 4, SVMLight.kernel_threads
+      assert_in_delta expected, m.classify(doc), 0.0001
+      assert_in_delta expected, m.classify_batch([doc]).first, 0.0001
+      assert_raises(ArgumentError){ SVMLight.kernel_threads = 0 }
+    end
+  end
+
+  context "binary models" do
+    setup do
+      @model    = Model.read_from_file('test/assets/model')
+      @filepath = './test/assets/written_binary_model'
+      @model.write_binary(@filepath)
+    end
+
+    should "load a model written with write_binary" do
+      m = Model.load_binary(@filepath)
+
+      assert_equal @model.support_vectors_count, m.support_vectors_count
+      assert_equal @model.total_words, m.total_words
+      assert_equal @model.totdoc, m.totdoc
+
+      d = Document.create(-1, 1, 0, 0, [[1, 1.0], [15, 0.5], [4217, 0.3]])
+      assert_equal @model.classify(d), m.classify(d)
+    end
+
+    should "round trip with the text format" do
+      @model.write_to_file(@filepath + '.txt')
+      Model.load_binary(@filepath).write_to_file(@filepath + '.txt2')
+
+      assert_equal File.read(@filepath + '.txt'), File.read(@filepath + '.txt2')
+    end
+
+    should "share the pages of a shared model with forked processes" do
+      m = @model.shared
+      d = Document.create(-1, 1, 0, 0, [[1, 1.0], [15, 0.5], [4217, 0.3]])
+
+      assert_nil @model.memory_sharing
+      assert_equal @model.classify(d), m.classify(d)
+      assert_equal File.size(@filepath), m.memory_sharing[:mapped_bytes]
+
+      reader, writer = IO.pipe
+      pid = fork do
+        reader.close
+        m.classify(d)
+        writer.write(Marshal.dump(m.memory_sharing))
+        exit!
+      end
+
+      writer.close
+      child = Marshal.load(reader.read)
+      Process.wait(pid)
+
+      assert child[:shared_bytes] > 0
+      assert_equal 0, child[:private_bytes]
+    end
+
+    should "raise argument error when the file is not a binary model" do
+      assert_raise(ArgumentError){ Model.load_binary('test/assets/model') }
+    end
+
+    should "refuse support vectors with out of range feature numbers" do
+      data = File.binread(@filepath)
+      rows_offset, words_offset = data[208, 16].unpack('Q2')
+      first_word = data[rows_offset + 8, 8].unpack('q').first
+      data[words_offset + first_word * 8, 4] = [-3].pack('l')
+      File.binwrite(@filepath, data)
+
+      assert_raise(ArgumentError){ Model.load_binary(@filepath) }
+
+      # sv_num * sizeof(double) and nwords * sizeof(WORD) wrap around to 8 bytes
+      data[144, 8] = [2**61 + 1].pack('q')
+      data[176, 8] = [2**61 + 1].pack('q')
+      File.binwrite(@filepath, data)
+      assert_raise_message(/corrupt binary model sections/){ Model.load_binary(@filepath) }
+    end
+
+    teardown do
+      `rm #{@filepath}* &> /dev/null`
+    end
+  end
+
+  context "compact models" do
+    setup do
+      @model    = Model.read_from_file('test/assets/model')
+      @filepath = './test/assets/written_compact_model'
+      @words    = [[[1, 1.0], [15, 0.5], [4217, 0.3]], [[3, 2.0], [20, 1.0], [39000, 0.7]]]
+      @docs     = @words.map { |words| Document.create(-1, 1, 0, 0, words) }
+    end
+
+    should "score within the reported bound of the full model" do
+      [[:float32, 0], [:int8, 0], [:float32, 0.5], [:int8, 0.5]].each do |precision, prune_below|
+        compact = @model.compact(:precision => precision, :prune_below => prune_below)
+        info    = compact.compact_info
+
+        assert_equal precision, info[:precision]
+        assert_equal [], compact.support_vectors
+        assert_equal prune_below > 0, info[:sparse]
+        @words.each_with_index do |words, i|
+          bound = info[:max_weight_error] * words.map { |_, v| v.abs }.inject(:+)
+          assert_in_delta @model.classify_batch([@docs[i]])[0], compact.classify_batch([@docs[i]])[0], bound + 1e-9
+        end
+      end
+
+      assert_nil @model.compact_info
+      assert @model.compact(:precision => :int8).compact_info[:bytes] < @model.compact.compact_info[:bytes]
+    end
+
+    should "be written and loaded in the binary format only" do
+      compact = @model.compact(:precision => :int8, :prune_below => 0.5)
+      compact.write_binary(@filepath)
+      m = Model.load_binary(@filepath)
+
+      assert_equal compact.compact_info, m.compact_info
+      assert_equal compact.classify_batch(@docs), m.classify_batch(@docs)
+      assert_raise(ArgumentError){ compact.write_to_file(@filepath + '.txt') }
+      assert !File.exist?(@filepath + '.txt')
+      assert_raise(ArgumentError){ compact.compact }
+      assert_raise(ArgumentError){ @model.compact(:precision => :float16) }
+    end
+
+    teardown do
+      `rm #{@filepath}* &> /dev/null`
+    end
+  end
+
   context "writting a model to a file" do 
     setup do
       @features ||= [
@@ -50,14 +319,41 @@ class TestModel < Test::Unit::TestCase
     should "write a model from memmory to a file" do
       @model.write_to_file(@filepath)
 
-      assert File.exists?(@filepath)
+      assert File.exist?(@filepath)
       assert File.file?(@filepath)
       # TODO: Implement actual model equality
       assert_equal @model.support_vectors_count, Model.read_from_file(@filepath).support_vectors_count
     end
 
-    # Need to find a good way to test this without relaying too much in the environment
-    should "raise ModelWriteError when it is impossible to write a model file" 
+    should "raise ModelWriteError when it is impossible to write a model file" do
+      assert_raise(ModelWriteError){ @model.write_to_file('./test/assets/missing_directory/model') }
+    end
+
+    should "dump to and load from memory" do
+      require 'stringio'
+
+      text = @model.dump
+      io   = StringIO.new
+      assert_same io, @model.dump(io)
+      assert_equal text, io.string
+
+      doc = Document.create(-1, 1, 0, 0, @features.first)
+      [Model.load(text), Model.load(StringIO.new(text))].each do |m|
+        assert_equal @model.support_vectors_count, m.support_vectors_count
+        assert_equal @model.classify(doc), m.classify(doc)
+        assert_equal text, m.dump
+      end
+    end
+
+    should "raise argument error when loading a malformed model" do
+      text = @model.dump
+
+      assert_raise(ArgumentError){ Model.load('') }
+      assert_raise(ArgumentError){ Model.load(text.sub('SVM-light', 'SVM-heavy')) }
+      assert_raise(ArgumentError){ Model.load(text.lines[0..-2].join) }
+      assert_raise(ArgumentError){ Model.load(text + text.lines.last) }
+      assert_raise(ArgumentError){ Model.load(text.sub(/(\d+):/, 'x\1:')) }
+    end
 
     teardown do
       `rm #{@filepath} &> /dev/null`
@@ -91,6 +387,101 @@ class TestModel < Test::Unit::TestCase
       end
     end
 
+    should "keep working once the training documents are collected" do
+      m = Model.new(:classification, DocumentSet.new(@docs_and_labels), {}, {}, nil)
+      expected = @docs_and_labels.map { |document, label| m.classify(document) }
+
+      GC.start
+      3.times { DocumentSet.new(@docs_and_labels); GC.start }
+
+      assert_equal expected, @docs_and_labels.map { |document, label| m.classify(document) }
+    end
+
+    should "learn classification from several threads at once" do
+      models = 3.times.map do
+        Thread.new{ Model.new(:classification, @docs_and_labels, {}, {}, nil) }
+      end.map(&:value)
+
+      models.each do |m|
+        assert_kind_of Model, m
+        assert_equal 5, m.totdoc
+      end
+    end
+
+    should "cancel trainings promptly, also the ones waiting for another training" do
+      require 'timeout'
+      random = Random.new(5)
+      large  = Array.new(1500) do
+        [Document.create(-1, 1, 0, 0, (1..10).map { |i| [i * 20 + random.rand(20), random.rand] }), random.rand(2) * 2 - 1]
+      end
+
+      started = Time.now
+      assert_raise(Timeout::Error){ Timeout.timeout(0.3){ Model.new(:classification, large, {}, {'kernel_type' => :rbf}, nil) } }
+      assert Time.now - started < 2
+
+      # This one holds SVM-light's solver, the next one waits for it
+      running = Thread.new { Model.new(:classification, large, {}, {'kernel_type' => :rbf}, nil) }
+      sleep 0.1
+
+      started = Time.now
+      assert_raise(Timeout::Error){ Timeout.timeout(0.3){ Model.new(:classification, @docs_and_labels, {}, {}, nil) } }
+      assert Time.now - started < 2
+
+      running.kill.join
+      assert Time.now - started < 4
+      assert_equal 5, Model.new(:classification, @docs_and_labels, {}, {}, nil).totdoc
+    end
+
+    should "expose alphas and retrain from them" do
+      m      = Model.new(:classification, @docs_and_labels, {}, {}, nil)
+      alphas = m.alphas
+
+      assert_equal @docs_and_labels.size, alphas.size
+      assert_equal m.support_vectors_count - 1, alphas.count { |a| a > 0 }
+      assert_equal m.support_vectors_count - 1, m.support_vectors.size
+      assert_equal 0, m.kernel_params['kernel_type']
+
+      additional = [[Document.create(10, 1, 0, 0, [[2, 0.5], [11, 0.3]]), 1]]
+      assert_kind_of Model, m.retrain(additional)
+      assert_equal @docs_and_labels.size + 1, m.retrain(additional, {}, @docs_and_labels).alphas.size
+      set = DocumentSet.new(@docs_and_labels)
+      assert_equal @docs_and_labels.size + 1, m.retrain(additional, {}, set).alphas.size
+      assert_equal @docs_and_labels.size, set.size
+      assert_equal @docs_and_labels.size, m.retrain([], {}, set).alphas.size
+      assert_raises(ArgumentError){ m.retrain(additional, {}, @docs_and_labels[1..-1]) }
+      assert_raises(ArgumentError){ m.retrain(additional, {}, DocumentSet.new(@docs_and_labels + additional)) }
+
+      m.write_binary('./test/assets/written_binary_model')
+      assert_equal alphas, Model.load_binary('./test/assets/written_binary_model').alphas
+      File.delete('./test/assets/written_binary_model')
+
+      assert_raises(RuntimeError){ Model.read_from_file('test/assets/model').alphas }
+    end
+
+    should "report training and inference stats" do
+      m     = Model.new(:classification, @docs_and_labels, {}, {'kernel_type' => :rbf}, nil)
+      stats = m.training_stats
+
+      assert_equal @docs_and_labels.size, stats[:documents]
+      assert stats[:train_time] >= 0 && stats[:train_cpu_time] >= 0
+      assert stats[:kernel_evaluations] > 0
+      assert stats[:peak_rss] > 0
+      assert_nil Model.read_from_file('test/assets/model').training_stats
+
+      assert_nil m.inference_stats
+      m.inference_stats = true
+      m.classify(@docs_and_labels.first.first)
+      m.classify_batch(@docs_and_labels.map(&:first))
+
+      inference = m.inference_stats
+      assert_equal 2, inference[:calls]
+      assert_equal @docs_and_labels.size + 1, inference[:documents]
+      assert_equal 2, inference[:latency_histogram].values.inject(:+)
+
+      m.inference_stats = false
+      assert_nil m.inference_stats
+    end
+
     should "learn classification with alpha values" do
       m = Model.new(:classification, @docs_and_labels, {}, {}, [1, 0.0] * 50)
       assert_kind_of Model, m
@@ -145,6 +536,114 @@ class TestModel < Test::Unit::TestCase
       end
     end
 
+    should "learn classification with non linear kernels" do
+      [:poly, :rbf, :sigmoid, Model::RBF].each do |kernel|
+        m = Model.new(:classification, @docs_and_labels, {'kernel_cache_size' => 10},
+                      {'kernel_type' => kernel, 'rbf_gamma' => 0.5}, nil)
+        assert_kind_of Model, m
+
+        kernel_type = Model::KERNELS.fetch(kernel, kernel)
+        assert_equal kernel_type, m.kernel_params['kernel_type']
+        assert_equal "#{kernel_type} # kernel type", m.dump.lines[1].chomp
+        assert_equal 10 * 1024 * 1024, m.training_stats[:kernel_cache_size]
+
+        @docs_and_labels.each_with_index do |item, i|
+          assert_kind_of  Numeric, m.classify(item.first), "failed in item # #{i} with #{kernel}"
+        end
+      end
+    end
+
+    should "cross validate a grid of parameters" do
+      results = Model.cross_validate(@docs_and_labels, :folds => 2, :threads => 2,
+                                     :grid => {'svm_c' => [0.5, 1.0], 'kernel_type' => [:linear, :rbf]})
+
+      assert_equal 4, results.size
+      assert_equal({'svm_c' => 1.0, 'kernel_type' => :linear}, results[2][:params])
+
+      results.each do |result|
+        assert_equal 2, result[:folds].size
+        assert_equal @docs_and_labels.size, result[:folds].inject(0) { |sum, fold|
+          sum + fold.values_at(:true_positives, :false_positives, :true_negatives, :false_negatives).inject(:+) }
+        assert (0..1).include?(result[:accuracy])
+        assert result[:train_time] >= 0
+      end
+
+      assert_raises(ArgumentError){ Model.cross_validate(@docs_and_labels, :folds => 1) }
+      assert_raises(ArgumentError){ Model.cross_validate(@docs_and_labels, :grid => [{'svm_c' => -1}]) }
+    end
+
+    should "learn classification with the dual coordinate descent solver" do
+      docs_and_labels = 40.times.map do |i|
+        label = (i / 2).even? ? 1 : -1
+        [Document.create(i, 1, 0, 0, [[label > 0 ? 1 : 2, 1.0 + (i % 5) * 0.1], [3 + i % 7, 0.5]]), label]
+      end
+
+      m = Model.new(:classification, docs_and_labels, {'solver' => :dual_cd, 'svm_c' => 1.0}, {}, nil)
+
+      assert_equal 40, m.totdoc
+      docs_and_labels.each { |document, label| assert_equal label, m.classify(document) > 0 ? 1 : -1 }
+      assert m.alphas.all? { |alpha| (0..1.0).include?(alpha) }
+
+      loaded = Model.load(m.dump)
+      docs_and_labels.each { |document, label| assert_in_delta m.classify(document), loaded.classify(document), 1e-6 }
+
+      results = Model.cross_validate(docs_and_labels, :folds => 2, :learn_params => {'solver' => 'dual_cd'})
+      assert_equal 1.0, results.first[:accuracy]
+
+      assert_raises(ArgumentError){ Model.new(:classification, docs_and_labels, {'solver' => :dual_cd}, {'kernel_type' => :rbf}, nil) }
+      assert_raises(ArgumentError){ Model.new(:classification, docs_and_labels, {'solver' => :newton}, {}, nil) }
+    end
+
+    should "update a linear model online" do
+      m        = Model.new(:classification, @docs_and_labels, {}, {}, nil)
+      positive = Document.create(-1, 1, 0, 0, [[50, 1.0], [51, 0.5]])
+      negative = Document.create(-1, 1, 0, 0, [[52, 1.0]])
+
+      20.times { m.update_batch([[positive, 1], [negative, -1]]) }
+      assert m.classify(positive) > m.classify(negative)
+      assert_equal 52, m.total_words
+
+      pa = Model.new(:classification, @docs_and_labels, {}, {}, nil)
+      assert_equal 1, pa.update(positive, 1, :rule => :passive_aggressive)
+      assert pa.classify(positive) > 0
+
+      assert_in_delta m.classify(positive), Model.load(m.dump).classify(positive), 1e-5
+      assert_equal 1, m.support_vectors.size
+      assert_raise(RuntimeError){ m.alphas }
+      assert_raise(ArgumentError){ m.update(positive, 1, :rule => :perceptron) }
+      assert_raise(FrozenError){ m.freeze.update(positive, 1) }
+    end
+
+    should "keep classifying in other threads while it is updated" do
+      m         = Model.read_from_file('test/assets/model')
+      random    = Random.new(3)
+      documents = Array.new(20000) do
+        Document.create(-1, 1, 0, 0, (1..10).map { |i| [i * 400 + random.rand(400), random.rand] })
+      end
+      before  = m.classify_batch(documents)
+      started = Queue.new
+
+      scoring = Thread.new do
+        Array.new(10) { |i| started << true if i == 1; m.classify_batch(documents) }
+      end
+      started.pop
+
+      # The first update frees the trained weights and support vectors, and this one
+      # grows the weights too
+      m.update(Document.create(-1, 1, 0, 0, [[2, 1.0], [100000, 1.0]]), 1)
+      after = m.classify_batch(documents)
+
+      assert before != after
+      scoring.value.each do |scores|
+        assert scores.each_with_index.all? { |score, i| score == before[i] || score == after[i] }
+      end
+    end
+
+    should "raise argument error when the kernel type is not supported" do
+      assert_raises(ArgumentError){Model.new(:classification, @docs_and_labels, {}, {'kernel_type' => 4}, nil)}
+      assert_raises(ArgumentError){Model.new(:classification, @docs_and_labels, {}, {'kernel_type' => 'rbf'}, nil)}
+    end
+
     should "raise argument error when predfile is not string" do
 
       learn_params = { "predfile"  => {}}
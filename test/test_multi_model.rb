@@ -0,0 +1,47 @@
+require './test/helper'
+include SVMLight
+
+class TestMultiModel < Test::Unit::TestCase
+
+  context "a multi model" do
+    setup do
+      @model   = Model.read_from_file('test/assets/model')
+      @compact = @model.compact(:precision => :int8, :prune_below => 0.5)
+      @multi   = MultiModel.new([@model, @compact, @model, @compact, @model], %w{a b c d e})
+      @docs    = [[[1, 1.0], [15, 0.5], [4217, 0.3]], [[3, 2.0], [20, 1.0], [39000, 0.7]]].map do |words|
+        Document.create(-1, 1, 0, 0, words)
+      end
+    end
+
+    should "give every model's score in one call" do
+      expected = @docs.map do |doc|
+        [@model, @compact, @model, @compact, @model].map { |m| m.classify_batch([doc])[0] }
+      end
+
+      assert_equal 5, @multi.size
+      @docs.each_with_index do |doc, i|
+        @multi.classify(doc).zip(expected[i]).each { |score, e| assert_in_delta e, score, 1e-9 }
+      end
+
+      assert_equal @docs.map { |doc| @multi.classify(doc) }, @multi.classify_batch(@docs)
+      assert_equal @multi.classify_batch(@docs).flatten, @multi.classify_batch(@docs, :packed => true).unpack('d*')
+      assert_equal [], @multi.classify_batch([])
+    end
+
+    should "rank the labels by score" do
+      scores = @multi.classify(@docs.first)
+      top    = @multi.top(@docs.first, 2)
+
+      assert_equal 2, top.size
+      assert_equal scores.max, top.first.last
+      assert_includes %w{a b c d e}, top.first.first
+      assert top.first.last >= top.last.last
+    end
+
+    should "raise errors on models it cannot stack" do
+      assert_raise(TypeError){ MultiModel.new([@model, 1]) }
+      assert_raise(ArgumentError){ MultiModel.new([]) }
+      assert_raise(ArgumentError){ MultiModel.new([@model], %w{a b}) }
+    end
+  end
+end
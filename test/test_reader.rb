@@ -0,0 +1,56 @@
+require './test/helper'
+require 'stringio'
+include SVMLight
+
+class TestReader < Test::Unit::TestCase
+
+  context "reading documents in SVM-light's format" do
+
+    setup do
+      @file_name = 'examples/example1/train.dat'
+    end
+
+    should "read every labeled document in a file" do
+      docs_and_labels = SVMLight.read_documents(@file_name)
+
+      assert_equal 2000, docs_and_labels.size
+      assert_kind_of Document, docs_and_labels.first.first
+      assert_equal 1, docs_and_labels.first.last
+      assert_equal [0, 1], docs_and_labels.first(2).map{ |d, l| d.docnum }
+    end
+
+    should "read the same documents from an IO object" do
+      from_io = File.open(@file_name){ |f| SVMLight.read_documents(f) }
+
+      assert_equal SVMLight.read_documents(@file_name).map(&:last), from_io.map(&:last)
+    end
+
+    should "parse qid, sid and cost and skip comments and empty lines" do
+      io = StringIO.new("# a comment\n1 qid:3 sid:2 cost:0.5 1:0.5 3:1 # doc\n\n-1 2:1")
+      docs_and_labels = SVMLight.each_document(io).to_a
+
+      assert_equal [1, -1], docs_and_labels.map(&:last)
+      assert_equal 3, docs_and_labels.first.first.queryid
+      assert_equal 2, docs_and_labels.first.first.slackid
+      assert_equal 0.5, docs_and_labels.first.first.costfactor
+    end
+
+    should "be usable to learn a model" do
+      docs_and_labels = SVMLight.read_documents(StringIO.new("1 1:1 2:0.5\n-1 3:1\n1 1:0.8\n-1 2:0.1 3:0.9\n"))
+      m = Model.new(:classification, docs_and_labels, {}, {}, nil)
+
+      assert_equal 4, m.totdoc
+    end
+
+    should "raise argument error on malformed lines" do
+      assert_raise(ArgumentError){ SVMLight.read_documents(StringIO.new("1 3:1 2:1\n")) }
+      assert_raise(ArgumentError){ SVMLight.read_documents(StringIO.new("1 0:1\n")) }
+      assert_raise(ArgumentError){ SVMLight.read_documents(StringIO.new("x 1:1\n")) }
+      assert_raise(ArgumentError){ SVMLight.read_documents(StringIO.new("1 1-1\n")) }
+    end
+
+    should "raise when the file does not exist" do
+      assert_raise(Errno::ENOENT){ SVMLight.read_documents(@file_name + 'bleh') }
+    end
+  end
+end